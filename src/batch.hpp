@@ -0,0 +1,1094 @@
+#ifndef HEADER_BATCH_HPP
+#define HEADER_BATCH_HPP
+
+#include <GLXW/glxw.h>
+#include "filter_params.hpp"
+#include "compute_filter.hpp"
+#include "cpu_filter.hpp"
+#include "thread_pool.hpp"
+#include "gl_context.hpp"
+#include "gl_error_check.hpp"
+#include "image_utils.hpp"
+#include "image_cache.hpp"
+#include "png_writer.hpp"
+#include "raw_image.hpp"
+#include "pipeline.hpp"
+#include "pixel_buffer.hpp"
+#include "gpu_profiler.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+// Batch processing: filters every PNG of a directory without creating any
+// window, on a headless GL context or, when there's none, on the CPU
+
+struct BatchOptions {
+  std::string input_directory;
+  std::string output_directory;
+  FilterParams params;
+  FilterMode mode = FilterMode::Separable;
+  PostFilters post; // GL only
+  // GL only: compiled programs are kept there across runs, empty disables it
+  std::string program_cache_directory;
+  bool force_cpu = false; // Use the CPU filter even if a GL context is available
+  unsigned threads = 0; // CPU filter and PNG strip encoding threads, 0 is one per core
+  unsigned decode_threads = 2;
+  PNGInput input = PNGInput::Stdio; // How the decoders read the files
+  unsigned encode_threads = 2;
+  PNGWriteOptions png; // Compression of the output files
+  size_t queue_depth = 4; // Images waiting between two stages
+  // GL only: images are decoded straight into a ring of persistently mapped
+  // upload buffers of that many bytes each, 0 disables it. Larger images go
+  // through client memory.
+  size_t upload_slot_bytes = 16 * 1024 * 1024;
+  // GL only: readbacks started ahead of the oldest one still in flight, the
+  // images of an array texture share one
+  size_t readback_depth = 3;
+  // GL only: GPU time statistics (JSON) and timeline (Chrome trace) of the
+  // uploads, filter passes and readbacks are written there, empty disables them
+  std::string profile_file;
+  std::string trace_file;
+  // GL only: creates a debug context and reports errors through the debug
+  // output callback, synchronously with 'gl_debug_sync'
+  bool gl_debug = false;
+  bool gl_debug_sync = false;
+  // Input images kept across the jobs of a BatchSession, 0 disables it: GL
+  // textures on a GL context, decoded PNGs on the CPU
+  size_t cache_bytes = 0;
+  // GL only: consecutive images of the same size and format are packed into
+  // the layers of array textures, up to that many per array and
+  // 'array_bytes' per array texture, and every filter pass runs once for the
+  // whole array. 0 or 1 filters the images one by one.
+  int array_layers = 0;
+  size_t array_bytes = 64 * 1024 * 1024;
+  // GL only: intermediate textures left unused after a batch are deleted
+  // beyond that many bytes, so that the jobs of a session don't accumulate
+  // textures of every size they met
+  size_t idle_texture_bytes = 64 * 1024 * 1024;
+};
+
+// Returns the names (not paths) of the .png and .raw files in 'directory',
+// sorted
+std::vector<std::string> listImageFiles(const std::string& directory) {
+  std::vector<std::string> names;
+
+  auto isImage = [](std::string name) {
+    if (name.size() < 4)
+      return false;
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+      return static_cast<char>(std::tolower(c));
+    });
+    return name.compare(name.size() - 4, 4, ".png") == 0 || isRawImageName(name);
+  };
+
+#ifdef _WIN32
+  WIN32_FIND_DATAA find_data;
+  HANDLE find = FindFirstFileA((directory + "\\*").c_str(), &find_data);
+  if (find == INVALID_HANDLE_VALUE)
+    throw std::runtime_error("Cannot open directory " + directory);
+  do {
+    if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && isImage(find_data.cFileName))
+      names.emplace_back(find_data.cFileName);
+  } while (FindNextFileA(find, &find_data));
+  FindClose(find);
+#else
+  DIR *dir = opendir(directory.c_str());
+  if (dir == nullptr)
+    throw std::runtime_error("Cannot open directory " + directory);
+  while (dirent *entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    struct stat info;
+    if (stat((directory + "/" + name).c_str(), &info) == 0 && S_ISREG(info.st_mode) && isImage(name))
+      names.push_back(name);
+  }
+  closedir(dir);
+#endif
+
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+// Creates 'directory' if it doesn't exist yet
+void makeDirectory(const std::string& directory) {
+#ifdef _WIN32
+  _mkdir(directory.c_str());
+#else
+  mkdir(directory.c_str(), 0755);
+#endif
+}
+
+bool isDirectory(const std::string& path) {
+#ifdef _WIN32
+  DWORD attributes = GetFileAttributesA(path.c_str());
+  return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+// Filters images on a GL context. The input and output textures come from
+// the filter's texture pool, so images of a size already seen reuse its
+// textures, as do the intermediates. Results are read back asynchronously:
+// submit() queues the upload, the filter and the readback of an image and
+// returns right away, receive() returns the filtered images in submission
+// order. An input texture can be kept (see takeInputTexture()) and filtered
+// again later without any upload.
+//
+// With setArrayLayers(), small images of the same size are uploaded to the
+// layers of an array texture instead, which is filtered and read back once
+// full: a thousand thumbnails packed 64 per array take 16 dispatches per pass
+// instead of a thousand.
+class GLBatchFilter {
+public:
+  GLBatchFilter(const FilterParams& params, FilterMode mode, const PostFilters& post,
+                const std::string& program_cache_directory)
+    : params(params), mode(mode), post(post) {
+    compute_filter.setProgramCacheDirectory(program_cache_directory);
+  }
+
+  GLBatchFilter(const GLBatchFilter&) = delete;
+  GLBatchFilter& operator=(const GLBatchFilter&) = delete;
+
+  // Applies to the images submitted from now on. Throws, keeping the
+  // current filter, if no filter can run with 'params'.
+  void setFilter(const FilterParams& params, FilterMode mode, const PostFilters& post) {
+    checkFilterParams(params);
+    filterLayers(); // The images already submitted keep their filter
+    this->params = params;
+    this->mode = mode;
+    this->post = post;
+  }
+
+  // 'format' is GL_RGB or GL_RGBA, 'type' GL_UNSIGNED_BYTE or
+  // GL_UNSIGNED_SHORT, 'image_data' is laid out as loadPNGFromFile returns it
+  // and can be released when this returns
+  void submit(int width, int height, GLint format, GLenum type,
+              const unsigned char *image_data) {
+    const int layer = reserveLayer(width, height, format, type);
+    if (layer >= 0) {
+      {
+        GpuProfileScope scope(profiler, "upload");
+        GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_ALIGNMENT, 4));
+        GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D_ARRAY, layers.input));
+        GL_ERROR_CHECK(glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1,
+                                       format, type, image_data));
+        GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
+      }
+      addLayer(true);
+      return;
+    }
+    ensureTextures(width, height, type, true);
+    uploaded_layer = -1;
+
+    // Rows are 4-byte aligned. RGB data is expanded to RGBA8 by the upload
+    // (alpha = 1) since 3 component textures can't be bound as images.
+    {
+      GpuProfileScope scope(profiler, "upload");
+      GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_ALIGNMENT, 4));
+      GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, input_texture_id));
+      GL_ERROR_CHECK(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type,
+                                     image_data));
+    }
+
+    filterAndReadBack(input_texture_id, width, height, format, type);
+  }
+
+  // Same as above with the input image in 'upload_slot' of 'ring'
+  void submit(int width, int height, GLint format, GLenum type, PixelUploadRing& ring,
+              unsigned upload_slot) {
+    const int layer = reserveLayer(width, height, format, type);
+    if (layer >= 0) {
+      {
+        GpuProfileScope scope(profiler, "upload");
+        ring.uploadLayer(upload_slot, layers.input, layer, width, height, format, type);
+      }
+      addLayer(true);
+      return;
+    }
+    ensureTextures(width, height, type, true);
+    uploaded_layer = -1;
+    {
+      GpuProfileScope scope(profiler, "upload");
+      ring.upload(upload_slot, input_texture_id, width, height, format, type);
+    }
+    filterAndReadBack(input_texture_id, width, height, format, type);
+  }
+
+  // Same as above with the input image already in 'texture', which must have
+  // the internal format imageTextureFormat(type)
+  void submitTexture(GLuint texture, int width, int height, GLint format, GLenum type) {
+    const int layer = reserveLayer(width, height, format, type);
+    if (layer >= 0) {
+      copyTextureLayer(texture, layers.input, layer, width, height);
+      addLayer(false);
+      return;
+    }
+    ensureTextures(width, height, type, false);
+    filterAndReadBack(texture, width, height, format, type);
+  }
+
+  // Gives up the input texture of the last image submitted by upload, the
+  // caller gets it back to the pool with releaseTexture(). The next upload
+  // goes to another texture. An image uploaded to an array texture is copied
+  // to a texture of its own.
+  GLuint takeInputTexture() {
+    if (uploaded_layer >= 0) {
+      GLuint texture = compute_filter.texturePool().acquire(layers.width, layers.height,
+                                                            layers.internal_format);
+      copyTextureLayer(texture, layers.uploaded_input, uploaded_layer, layers.width,
+                       layers.height, false);
+      uploaded_layer = -1;
+      return texture;
+    }
+    return std::exchange(input_texture_id, 0);
+  }
+
+  // Packs up to 'max_layers' images into every array texture, and at most
+  // 'max_bytes' of them (a 2 MiB image and 64 MiB make 32 layers at most).
+  // Images that only fit one per array are filtered on their own, as every
+  // image is when 'max_layers' is 0 or 1.
+  void setArrayLayers(int max_layers, size_t max_bytes) {
+    filterLayers();
+    GLint gl_max_layers = 0;
+    GL_ERROR_CHECK(glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &gl_max_layers));
+    array_layers = std::min(max_layers, static_cast<int>(gl_max_layers));
+    array_bytes = max_bytes;
+  }
+
+  // Images filtered in array textures, and array textures filtered
+  size_t layeredImagesCount() const {
+    return layered_images_count;
+  }
+
+  size_t arraysCount() const {
+    return arrays_count;
+  }
+
+  void releaseTexture(GLuint texture) {
+    compute_filter.texturePool().release(texture);
+  }
+
+  // Drops every image submitted and not received yet, and the array texture
+  // being filled, e.g. after a batch failed halfway. The next images start
+  // from a clean state.
+  void reset() {
+    auto& pool = compute_filter.texturePool();
+    if (layers.input != 0)
+      pool.release(layers.input);
+    if (layers.output != 0)
+      pool.release(layers.output);
+    layers = ArrayTextures();
+    uploaded_layer = -1;
+    pending.clear(); // Deletes the readbacks still running
+    readbacks_count = 0;
+  }
+
+  // Images submitted and not received yet
+  size_t pendingCount() const {
+    return pending.size();
+  }
+
+  // Readbacks started and not received yet, one per array texture for the
+  // images in array textures. Images waiting for their array texture to fill
+  // up aren't read back yet.
+  size_t readbacksCount() const {
+    return readbacks_count;
+  }
+
+  // True if the oldest pending image can be received without blocking
+  bool oldestReady() {
+    return !pending.empty() && pending.front().readback && pending.front().readback->ready();
+  }
+
+  // Waits for the oldest pending image and writes it to 'image_data', laid out
+  // as loadPNGFromFile returns it. Returns true if it had to block. An image
+  // whose array texture isn't full yet is filtered with the layers filled so far.
+  bool receive(std::vector<unsigned char>& image_data) {
+    if (!pending.front().readback)
+      filterLayers();
+    auto image = std::move(pending.front());
+    pending.pop_front();
+    bool stalled = image.readback->finish(image_data, image.layer);
+    // Recycled once every image of its array texture has been received
+    if (image.readback.use_count() == 1) {
+      idle.push_back(std::move(image.readback));
+      --readbacks_count;
+    }
+    return stalled;
+  }
+
+  const ProgramCache& programCache() const {
+    return compute_filter.getGraph().programCache();
+  }
+
+  const TexturePool::Stats& texturePoolStatistics() const {
+    return compute_filter.getGraph().texturePool().statistics();
+  }
+
+  // Deletes the pooled textures not in use beyond 'max_idle_bytes', see
+  // TexturePool::trim()
+  void trimTextures(size_t max_idle_bytes) {
+    compute_filter.texturePool().trim(max_idle_bytes);
+  }
+
+  // Times the uploads, the filter passes and the readbacks. Null disables it.
+  void setProfiler(GpuProfiler *profiler) {
+    this->profiler = profiler;
+    compute_filter.setProfiler(profiler);
+  }
+
+private:
+
+  void filterAndReadBack(GLuint input_texture, int width, int height, GLint format, GLenum type) {
+    if (profiler)
+      profiler->collect(); // The previous images, without waiting for them
+    compute_filter.apply(input_texture, output_texture_id, width, height, params, mode, post);
+
+    auto readback = idleReadback();
+    {
+      GpuProfileScope scope(profiler, "readback");
+      readback->start(output_texture_id, width, height, format, type);
+    }
+    pending.push_back({ std::move(readback), 0 });
+  }
+
+  // Pack buffers are reused once their images have been received
+  std::shared_ptr<PixelReadback> idleReadback() {
+    ++readbacks_count;
+    if (idle.empty())
+      return std::make_shared<PixelReadback>();
+    auto readback = std::move(idle.back());
+    idle.pop_back();
+    return readback;
+  }
+
+  // Layer of the array texture a width x height image goes to, or -1 if it's
+  // filtered on its own. The layers filled so far are filtered first when
+  // the image doesn't go with them.
+  int reserveLayer(int width, int height, GLint format, GLenum type) {
+    const GLenum internal_format = imageTextureFormat(type);
+    const size_t image_bytes = static_cast<size_t>(width) * height * texelBytes(internal_format);
+    const int capacity = static_cast<int>(
+      std::min<size_t>(std::max(array_layers, 0), array_bytes / image_bytes));
+    if (layers.count > 0 && (capacity < 2 || layers.width != width || layers.height != height ||
+                             layers.format != format || layers.type != type))
+      filterLayers();
+    if (capacity < 2)
+      return -1;
+
+    if (layers.count == 0) {
+      auto& pool = compute_filter.texturePool();
+      layers.input = pool.acquireArray(width, height, capacity, internal_format);
+      layers.output = pool.acquireArray(width, height, capacity, internal_format);
+      layers.width = width;
+      layers.height = height;
+      layers.format = format;
+      layers.type = type;
+      layers.internal_format = internal_format;
+      layers.capacity = capacity;
+    }
+    return layers.count;
+  }
+
+  // Queues the image just put in the layer reserveLayer() returned, and
+  // filters the array texture once it's full
+  void addLayer(bool uploaded) {
+    uploaded_layer = uploaded ? layers.count : -1;
+    layers.uploaded_input = layers.input;
+    pending.push_back({ nullptr, layers.count++ });
+    if (layers.count == layers.capacity)
+      filterLayers();
+  }
+
+  // Filters the layers filled so far and reads them back at once. The array
+  // textures go back to the pool, the next image starts another array.
+  void filterLayers() {
+    if (layers.count == 0)
+      return;
+    if (profiler)
+      profiler->collect();
+    compute_filter.applyLayers(layers.input, layers.output, layers.width, layers.height,
+                               layers.count, params, mode, post);
+
+    auto readback = idleReadback();
+    {
+      GpuProfileScope scope(profiler, "readback");
+      readback->start(layers.output, layers.width, layers.height, layers.format, layers.type,
+                      layers.capacity);
+    }
+    // The images of the array are the last ones submitted
+    for (auto image = pending.end() - layers.count; image != pending.end(); ++image)
+      image->readback = readback;
+
+    auto& pool = compute_filter.texturePool();
+    pool.release(layers.input);
+    pool.release(layers.output);
+    layers.input = layers.output = 0;
+    layered_images_count += layers.count;
+    ++arrays_count;
+    layers.count = 0;
+  }
+
+  // The textures store 16 bits per channel for 16-bit images. The previous
+  // ones go back to the pool: reusing them with readbacks pending is fine,
+  // the GL runs commands in order. The input texture is only needed for
+  // uploads.
+  void ensureTextures(int width, int height, GLenum type, bool upload) {
+    GLenum internal_format = imageTextureFormat(type);
+    auto& pool = compute_filter.texturePool();
+    if (output_texture_id == 0 || texture_width != width || texture_height != height ||
+        texture_format != internal_format) {
+      if (input_texture_id != 0)
+        pool.release(input_texture_id);
+      if (output_texture_id != 0)
+        pool.release(output_texture_id);
+      input_texture_id = 0;
+      output_texture_id = pool.acquire(width, height, internal_format);
+
+      texture_width = width;
+      texture_height = height;
+      texture_format = internal_format;
+    }
+    if (upload && input_texture_id == 0)
+      input_texture_id = pool.acquire(width, height, internal_format);
+  }
+
+  // Array textures the images are packed into, see setArrayLayers()
+  struct ArrayTextures {
+    GLuint input = 0;
+    GLuint output = 0;
+    int width = 0;
+    int height = 0;
+    GLint format = GL_RGBA; // Of the images, as submitted
+    GLenum type = GL_UNSIGNED_BYTE;
+    GLenum internal_format = 0;
+    int capacity = 0; // Layers
+    int count = 0; // Layers filled
+    GLuint uploaded_input = 0; // Input of the last image added, see uploaded_layer
+  };
+
+  // An image submitted and not received yet. Images of the same array
+  // texture share its readback, which is null until the array is filtered.
+  struct PendingImage {
+    std::shared_ptr<PixelReadback> readback;
+    int layer;
+  };
+
+  FilterParams params;
+  FilterMode mode;
+  PostFilters post;
+  GaussianComputeFilter compute_filter;
+  GLuint input_texture_id = 0;
+  GLuint output_texture_id = 0;
+  int texture_width = 0;
+  int texture_height = 0;
+  GLenum texture_format = 0;
+  int array_layers = 0;
+  size_t array_bytes = 0;
+  ArrayTextures layers;
+  int uploaded_layer = -1; // Layer of the last image submitted by upload, if in an array
+  size_t layered_images_count = 0;
+  size_t arrays_count = 0;
+  size_t readbacks_count = 0;
+  GpuProfiler *profiler = nullptr;
+  std::deque<PendingImage> pending;
+  std::vector<std::shared_ptr<PixelReadback>> idle;
+};
+
+// Per-stage throughput of a batch run
+struct BatchStats {
+  StageCounters decode{ "decode" };
+  StageCounters filter{ "filter" };
+  StageCounters encode{ "encode" };
+  std::atomic<int> failed{ 0 };
+  size_t ring_uploads = 0; // Images uploaded from the persistently mapped ring
+  size_t ring_stalls = 0; // Times the filter stage waited for an upload slot fence
+  size_t readback_stalls = 0; // Times the filter stage waited for a readback fence
+  std::atomic<uint64_t> png_bytes{ 0 }; // Size of the output files
+  TexturePool::Stats texture_pool; // GL filter only
+  size_t layered_images = 0; // GL only: images filtered in array textures
+  size_t arrays = 0; // GL only: array textures filtered
+  ImageCache::Stats image_cache; // Since the session started
+  double wall_seconds = 0.0;
+};
+
+// An image travelling through the batch pipeline
+struct BatchImage {
+  std::string name;
+  int width;
+  int height;
+  GLint format;
+  GLenum type; // GL_UNSIGNED_BYTE or GL_UNSIGNED_SHORT
+  std::vector<unsigned char> data;
+  int upload_slot = -1; // When >= 0 the image is in that PixelUploadRing slot, not in data
+  std::shared_ptr<RawImageFile> raw; // GL only: when set the image is mapped there, not in data
+  bool cacheable = false; // The session caches images and 'stamp' is set
+  FileStamp stamp;
+  bool cached = false; // GL only: not decoded, its texture is in the image cache
+
+  ImageLayout layout() const {
+    return ImageLayout::fromPNG(width, height, format == GL_RGBA ? 4 : 3,
+                                type == GL_UNSIGNED_SHORT ? 2 : 1);
+  }
+};
+
+// What batch jobs run on, kept from one job to the next: the headless GL
+// context and filter, whose programs and pooled textures are reused, or the
+// CPU thread pool, and the cache of input images. Of the options it's created
+// with, only force_cpu, threads, program_cache_directory, the profiling and
+// debug options and cache_bytes apply to the session, the others are per job.
+class BatchSession {
+public:
+  explicit BatchSession(const BatchOptions& options)
+    : profile_file(options.profile_file), trace_file(options.trace_file) {
+    if (options.force_cpu == false) {
+      gl_context = HeadlessGLContext::create(options.gl_debug);
+      if (gl_context && glxwInit() == 0) {
+        std::cout << "Batch filtering on [" << glGetString(GL_RENDERER) << "]\n";
+        if (options.gl_debug && enableGLDebugOutput(options.gl_debug_sync) == false)
+          std::cerr << "The GL context has no debug output" << std::endl;
+        gl_filter = std::make_unique<GLBatchFilter>(options.params, options.mode, options.post,
+                                                    options.program_cache_directory);
+        if (profile_file.empty() == false || trace_file.empty() == false) {
+          profiler = std::make_unique<GpuProfiler>();
+          gl_filter->setProfiler(profiler.get());
+        }
+      } else {
+        gl_context.reset();
+      }
+    }
+
+    // Deflates the strips of large output images, and filters on the CPU
+    pool = std::make_unique<ThreadPool>(options.threads ? options.threads
+                                                        : std::thread::hardware_concurrency());
+    if (!gl_filter) {
+      std::cout << "Batch filtering on the CPU (" << pool->size() << " threads, "
+                << cpu_filter::selectKernels(CpuKernel::Auto).name << " kernels)\n";
+    }
+    if (options.cache_bytes)
+      image_cache = std::make_unique<ImageCache>(options.cache_bytes);
+  }
+
+  BatchSession(const BatchSession&) = delete;
+  BatchSession& operator=(const BatchSession&) = delete;
+
+  // Gives the cached textures back to the pool and saves the GPU profile
+  // while the context is still current
+  ~BatchSession() {
+    if (image_cache && gl_filter) {
+      image_cache->clear();
+      releaseRetiredTextures();
+    }
+    if (profiler)
+      saveGpuProfile(*profiler, profile_file, trace_file);
+  }
+
+  // Null when filtering on the CPU
+  GLBatchFilter *glFilter() {
+    return gl_filter.get();
+  }
+
+  ThreadPool& threadPool() {
+    return *pool;
+  }
+
+  // Null when disabled
+  ImageCache *imageCache() {
+    return image_cache.get();
+  }
+
+  // GL only: returns the textures evicted from the image cache to the pool
+  void releaseRetiredTextures() {
+    for (auto texture : image_cache->takeRetiredTextures())
+      gl_filter->releaseTexture(texture);
+  }
+
+private:
+  std::string profile_file;
+  std::string trace_file;
+  std::unique_ptr<HeadlessGLContext> gl_context;
+  std::unique_ptr<GpuProfiler> profiler; // Destroyed before the context
+  std::unique_ptr<GLBatchFilter> gl_filter;
+  std::unique_ptr<ThreadPool> pool;
+  std::unique_ptr<ImageCache> image_cache;
+};
+
+// Filters every PNG and raw image in options.input_directory into a PNG with
+// the same name (.raw becoming .png) in options.output_directory, on
+// 'session'. Returns the number of files that failed.
+//
+// Decoding, filtering and encoding are pipelined: decoder threads feed the
+// filter stage through a bounded queue and the filter stage feeds the encoder
+// threads through another one, so image N + 1 is decoded and image N - 1
+// encoded while image N is being filtered. The GL filter stage runs on the
+// calling thread since that's where the GL context is current. On the CPU
+// the decoders queue row bands on the thread pool as soon as they're decoded
+// and hand the filtered images straight to the encoders. Image buffers are
+// recycled, in steady state no memory is allocated per image.
+//
+// With an image cache, inputs already seen by the session (same path,
+// modification time and size) are neither decoded nor uploaded again: the GL
+// filters their cached texture, the CPU their cached pixels.
+int runBatch(BatchSession& session, const BatchOptions& options, BatchStats& stats) {
+  GLBatchFilter *gl_filter = session.glFilter();
+  ThreadPool& pool = session.threadPool();
+  ImageCache *cache = session.imageCache();
+  // Fails the batch before any thread starts, rather than every image
+  checkFilterParams(options.params);
+  if (gl_filter) {
+    gl_filter->setFilter(options.params, options.mode, options.post);
+    gl_filter->setArrayLayers(options.array_layers, options.array_bytes);
+  } else if (options.post.enabled())
+    throw std::runtime_error("Morphology and grayscale conversion need a GL context");
+
+  auto files = listImageFiles(options.input_directory);
+  makeDirectory(options.output_directory);
+
+  // Enough slots for every image that can be decoded ahead of the filter
+  // stage, plus the one being uploaded
+  std::unique_ptr<PixelUploadRing> ring;
+  unsigned ring_slots = static_cast<unsigned>(options.queue_depth) +
+                        std::max(options.decode_threads, 1u) + 1;
+  if (gl_filter && options.upload_slot_bytes && glSupportsBufferStorage())
+    ring = std::make_unique<PixelUploadRing>(options.upload_slot_bytes, ring_slots);
+
+  BoundedQueue<BatchImage> decoded(options.queue_depth);
+  BoundedQueue<BatchImage> filtered(options.queue_depth);
+  BoundedQueue<unsigned> free_slots(ring_slots);
+  // Enough buffers for every image in the pipeline, CPU images need two, and
+  // a third while they're filtered with more than one iteration
+  const size_t array_layers = static_cast<size_t>(std::max(options.array_layers, 1));
+  BufferPool buffers(2 * (2 * options.queue_depth + options.readback_depth * array_layers +
+                          options.decode_threads + options.encode_threads) +
+                     options.decode_threads);
+  if (ring) {
+    for (unsigned slot = 0; slot < ring_slots; ++slot)
+      free_slots.push(slot);
+  }
+  std::atomic<size_t> next_file{ 0 };
+  const size_t layered_images_before = gl_filter ? gl_filter->layeredImagesCount() : 0;
+  const size_t arrays_before = gl_filter ? gl_filter->arraysCount() : 0;
+  auto start = std::chrono::steady_clock::now();
+
+  // The image the CPU filter's iterations alternate with, none with a single
+  // iteration
+  auto acquireScratch = [&](const ImageLayout& layout) {
+    return options.params.iterations > 1 ? buffers.acquire(layout.size())
+                                         : std::vector<unsigned char>();
+  };
+
+  // CPU only: filters the image band by band while the rest of it is still
+  // being decoded. Returns false if decoding failed. When 'decoded' isn't
+  // null the decoded image is moved there instead of being recycled.
+  auto decodeAndFilter = [&](PNGReader& reader, BatchImage& image,
+                             std::vector<unsigned char> *decoded) {
+    auto layout = image.layout();
+    auto input = buffers.acquire(layout.size());
+    image.data = buffers.acquire(layout.size());
+    auto scratch = acquireScratch(layout);
+
+    bool ok = true;
+    std::chrono::steady_clock::duration decode_time{};
+    try {
+      StreamingImageFilter filter(input.data(), image.data.data(), layout, options.params, pool, true,
+                                  scratch.data());
+      const int band_rows = reader.interlaced() ? image.height
+                                                : cpu_filter::bandRows(layout, options.params);
+      while (ok && reader.rowsRead() < image.height) {
+        auto begin = std::chrono::steady_clock::now();
+        // Bottom row first, the next rows to decode end at row 'height - 1 - rowsRead()'
+        unsigned char *top_row = input.data() + (image.height - 1 - reader.rowsRead()) * layout.stride;
+        ok = reader.readRows(top_row, -static_cast<std::ptrdiff_t>(layout.stride), band_rows) > 0;
+        decode_time += std::chrono::steady_clock::now() - begin;
+        if (ok)
+          filter.rowsAvailable(reader.rowsRead());
+      }
+      if (ok) {
+        filter.finish();
+        stats.filter.add(layout.size(), filter.busyTime());
+      }
+    } catch (const std::exception& e) {
+      // The filter waited for the bands still reading 'input'
+      std::cerr << "Error filtering " << image.name << ": " << e.what() << std::endl;
+      ok = false;
+    }
+    buffers.release(std::move(scratch));
+    if (ok && decoded)
+      *decoded = std::move(input);
+    else
+      buffers.release(std::move(input));
+    if (ok)
+      stats.decode.add(layout.size(), decode_time);
+    return ok;
+  };
+
+  // CPU only: filters an image already in memory, such as a mapped raw image
+  // or a cached one
+  auto filterPixels = [&](const unsigned char *pixels, BatchImage& image) {
+    auto layout = image.layout();
+    image.data = buffers.acquire(layout.size());
+    auto scratch = acquireScratch(layout);
+    bool ok = true;
+    try {
+      StreamingImageFilter filter(pixels, image.data.data(), layout, options.params, pool, true,
+                                  scratch.data());
+      filter.finish();
+      stats.filter.add(layout.size(), filter.busyTime());
+    } catch (const std::exception& e) {
+      std::cerr << "Error filtering " << image.name << ": " << e.what() << std::endl;
+      ok = false;
+    }
+    buffers.release(std::move(scratch));
+    return ok;
+  };
+
+  // Raw images are mapped, not decoded: the GL uploads them from the mapping
+  // and the CPU filters them from it
+  auto openRaw = [&](const std::string& path, BatchImage& image) {
+    auto begin = std::chrono::steady_clock::now();
+    auto raw = std::make_shared<RawImageFile>();
+    if (raw->open(path.c_str()) == false)
+      return false;
+    raw->adviseSequential();
+    image.width = raw->width();
+    image.height = raw->height();
+    image.format = raw->format();
+    image.type = raw->type();
+    stats.decode.add(image.layout().size(), std::chrono::steady_clock::now() - begin);
+    if (gl_filter) {
+      image.raw = std::move(raw);
+      return true;
+    }
+    return filterPixels(raw->pixels(), image);
+  };
+
+  // GL images go to the filter stage, CPU ones are filtered while they're
+  // decoded and go straight to the encoders
+  auto decoder = [&] {
+    PNGReader reader;
+    for (size_t i = next_file++; i < files.size(); i = next_file++) {
+      unsigned slot = 0;
+      if (ring && free_slots.pop(slot) == false)
+        return;
+
+      auto begin = std::chrono::steady_clock::now();
+      BatchImage image;
+      image.name = files[i];
+      auto input_path = options.input_directory + "/" + image.name;
+      image.cacheable = cache && fileStamp(input_path, image.stamp);
+      CachedImage cached;
+      bool ok;
+      if (image.cacheable && gl_filter && cache->contains(input_path, image.stamp)) {
+        image.cached = true; // The filter stage looks its texture up
+        ok = true;
+      } else if (image.cacheable && !gl_filter && cache->find(input_path, image.stamp, cached)) {
+        image.width = cached.width;
+        image.height = cached.height;
+        image.format = cached.format;
+        image.type = cached.type;
+        ok = filterPixels(cached.pixels->data(), image);
+      } else if (isRawImageName(image.name)) {
+        ok = openRaw(input_path, image); // Mapped, the CPU doesn't cache them
+      } else {
+        ok = reader.open(input_path.c_str(), options.input);
+        if (ok) {
+          image.width = reader.width();
+          image.height = reader.height();
+          image.format = reader.format();
+          image.type = reader.type();
+        }
+
+        if (ok && !gl_filter) {
+          std::vector<unsigned char> decoded;
+          ok = decodeAndFilter(reader, image, image.cacheable ? &decoded : nullptr);
+          if (ok && image.cacheable) {
+            const size_t bytes = decoded.size();
+            cached.width = image.width;
+            cached.height = image.height;
+            cached.format = image.format;
+            cached.type = image.type;
+            cached.pixels = std::make_shared<const std::vector<unsigned char>>(std::move(decoded));
+            cache->insert(input_path, image.stamp, std::move(cached), bytes);
+          }
+        } else if (ok) {
+          const size_t size = reader.rowBytes() * image.height;
+          unsigned char *pixels;
+          if (ring && size <= ring->slotSize()) {
+            image.upload_slot = static_cast<int>(slot);
+            pixels = ring->slotData(slot);
+          } else {
+            image.data = buffers.acquire(size);
+            pixels = image.data.data();
+          }
+          // Bottom row first, as glTexImage2D expects
+          ok = reader.readRows(pixels + (image.height - 1) * reader.rowBytes(),
+                               -static_cast<std::ptrdiff_t>(reader.rowBytes()), image.height) > 0;
+          if (ok)
+            stats.decode.add(size, std::chrono::steady_clock::now() - begin);
+        }
+      }
+
+      if (ring && (!ok || image.upload_slot < 0))
+        free_slots.push(slot);
+      if (ok == false) {
+        buffers.release(std::move(image.data));
+        ++stats.failed;
+        continue;
+      }
+      if ((gl_filter ? decoded : filtered).push(std::move(image)) == false)
+        return;
+    }
+  };
+
+  auto encoder = [&] {
+    BatchImage image;
+    while (filtered.pop(image)) {
+      auto begin = std::chrono::steady_clock::now();
+      auto output_name = image.name;
+      if (isRawImageName(output_name))
+        output_name.replace(output_name.size() - 4, 4, ".png");
+      auto output_path = options.output_directory + "/" + output_name;
+      size_t png_size = 0;
+      bool saved = savePNGToFile(output_path.c_str(), image.width, image.height, image.format,
+                                 image.type, image.data, options.png, &pool, &png_size);
+      if (saved) {
+        stats.encode.add(image.data.size(), std::chrono::steady_clock::now() - begin);
+        stats.png_bytes += png_size;
+      } else
+        ++stats.failed;
+      buffers.release(std::move(image.data));
+    }
+  };
+
+  std::vector<std::thread> decoders, encoders;
+  for (unsigned i = 0; i < std::max(options.decode_threads, 1u); ++i)
+    decoders.emplace_back(decoder);
+  for (unsigned i = 0; i < std::max(options.encode_threads, 1u); ++i)
+    encoders.emplace_back(encoder);
+
+  // Closes the decoded queue once every decoder is done
+  std::thread decoders_done([&] {
+    for (auto& thread : decoders)
+      thread.join();
+    decoded.close();
+  });
+
+  auto joinAll = [&] {
+    free_slots.close();
+    decoders_done.join();
+    filtered.close();
+    for (auto& thread : encoders)
+      thread.join();
+  };
+
+  try {
+    // GL images submitted and not received yet, with the time spent submitting
+    // them
+    std::deque<std::pair<BatchImage, std::chrono::steady_clock::duration>> in_flight;
+    auto receiveOldest = [&] {
+      auto begin = std::chrono::steady_clock::now();
+      auto& image = in_flight.front().first;
+      if (image.data.empty()) // Uploaded from the ring or a mapping
+        image.data = buffers.acquire(image.layout().size());
+      if (gl_filter->receive(image.data))
+        stats.readback_stalls++;
+      auto busy = in_flight.front().second + (std::chrono::steady_clock::now() - begin);
+      stats.filter.add(image.data.size(), busy);
+      filtered.push(std::move(image));
+      in_flight.pop_front();
+    };
+
+    // Keeps the texture the image was just uploaded to, the next upload goes
+    // to another one
+    auto cacheInput = [&](const BatchImage& image) {
+      const size_t bytes = static_cast<size_t>(image.width) * image.height *
+                           texelBytes(imageTextureFormat(image.type));
+      if (bytes > cache->budgetBytes())
+        return;
+      CachedImage cached;
+      cached.width = image.width;
+      cached.height = image.height;
+      cached.format = image.format;
+      cached.type = image.type;
+      cached.texture = gl_filter->takeInputTexture();
+      cache->insert(options.input_directory + "/" + image.name, image.stamp, cached, bytes);
+      session.releaseRetiredTextures();
+    };
+
+    // Loads an image the decoders skipped since it was cached, and which got
+    // evicted before reaching the filter stage
+    auto loadEvicted = [&](BatchImage& image) {
+      auto path = options.input_directory + "/" + image.name;
+      if (isRawImageName(image.name)) {
+        image.raw = std::make_shared<RawImageFile>();
+        if (image.raw->open(path.c_str()) == false)
+          return false;
+        image.width = image.raw->width();
+        image.height = image.raw->height();
+        image.format = image.raw->format();
+        image.type = image.raw->type();
+        return true;
+      }
+      return loadPNGFromFile(path.c_str(), image.width, image.height, image.format, image.type,
+                             image.data);
+    };
+
+    BatchImage image;
+    int uploading_slot = -1;
+    while (decoded.pop(image)) {
+      auto begin = std::chrono::steady_clock::now();
+      CachedImage cached;
+      if (image.cached &&
+          cache->find(options.input_directory + "/" + image.name, image.stamp, cached)) {
+        image.width = cached.width;
+        image.height = cached.height;
+        image.format = cached.format;
+        image.type = cached.type;
+        gl_filter->submitTexture(cached.texture, image.width, image.height, image.format,
+                                 image.type);
+        session.releaseRetiredTextures(); // Of stale entries dropped by find()
+      } else {
+        // The miss was counted by find()
+        if (image.cached && loadEvicted(image) == false) {
+          ++stats.failed;
+          continue;
+        }
+        if (image.upload_slot >= 0) {
+          auto slot = static_cast<unsigned>(image.upload_slot);
+          gl_filter->submit(image.width, image.height, image.format, image.type, *ring, slot);
+          image.upload_slot = -1;
+          // Recycle the previous image's slot once the GL is done with it, this
+          // one is still being uploaded
+          if (uploading_slot >= 0) {
+            ring->waitIdle(static_cast<unsigned>(uploading_slot));
+            free_slots.push(static_cast<unsigned>(uploading_slot));
+          }
+          uploading_slot = static_cast<int>(slot);
+        } else if (image.raw) {
+          gl_filter->submit(image.width, image.height, image.format, image.type,
+                            image.raw->pixels());
+          image.raw.reset(); // Unmaps it
+        } else {
+          gl_filter->submit(image.width, image.height, image.format, image.type,
+                            image.data.data());
+        }
+        if (image.cacheable)
+          cacheInput(image);
+      }
+      in_flight.emplace_back(std::move(image), std::chrono::steady_clock::now() - begin);
+
+      // Hand over every finished image, and block on the oldest one only when
+      // too many readbacks are in flight (the images of an array texture
+      // share one)
+      while (!in_flight.empty() &&
+             (gl_filter->readbacksCount() > std::max<size_t>(options.readback_depth, 1) ||
+              gl_filter->oldestReady()))
+        receiveOldest();
+    }
+    while (!in_flight.empty())
+      receiveOldest();
+  } catch (...) {
+    // Unblock the decoders before waiting for them
+    decoded.close();
+    joinAll();
+    // The next batch of the session must not receive this one's images
+    if (gl_filter)
+      gl_filter->reset();
+    throw;
+  }
+  joinAll();
+  if (ring) {
+    stats.ring_uploads = ring->uploadsCount();
+    stats.ring_stalls = ring->stallsCount();
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  stats.wall_seconds = elapsed.count();
+
+  std::cout << files.size() - stats.failed << " of " << files.size() << " images filtered in "
+            << stats.wall_seconds << "s\n";
+  stats.decode.print(std::cout, stats.wall_seconds);
+  stats.filter.print(std::cout, stats.wall_seconds);
+  stats.encode.print(std::cout, stats.wall_seconds);
+  if (stats.encode.bytes > 0) {
+    std::cout << "PNG output: " << stats.png_bytes / 1e6 << " MB, "
+              << 100.0 * stats.png_bytes / stats.encode.bytes << "% of the image size\n";
+  }
+  std::cout << buffers.allocationsCount() << " image buffers allocated\n";
+  if (ring) {
+    std::cout << stats.ring_uploads << " uploads through " << ring->slotCount()
+              << " persistently mapped buffers, " << stats.ring_stalls << " fence stalls\n";
+  }
+  if (gl_filter) {
+    std::cout << stats.readback_stalls << " of " << stats.filter.items << " readbacks stalled\n";
+    if (options.array_layers > 1) {
+      stats.layered_images = gl_filter->layeredImagesCount() - layered_images_before;
+      stats.arrays = gl_filter->arraysCount() - arrays_before;
+      std::cout << stats.layered_images << " images filtered in " << stats.arrays
+                << " array textures\n";
+    }
+    auto& programs = gl_filter->programCache();
+    std::cout << programs.compiledCount() << " programs compiled, " << programs.binaryLoadsCount()
+              << " loaded from the program cache\n";
+    gl_filter->trimTextures(options.idle_texture_bytes);
+    stats.texture_pool = gl_filter->texturePoolStatistics();
+    auto& textures = stats.texture_pool;
+    std::cout << "Texture pool: " << textures.hits << " hits, " << textures.misses << " misses, "
+              << textures.textures << " textures (" << textures.bytes / (1024 * 1024) << " MiB), "
+              << textures.trimmed_bytes / (1024 * 1024) << " MiB trimmed\n";
+  }
+  if (cache) {
+    stats.image_cache = cache->statistics();
+    auto& images = stats.image_cache;
+    std::cout << "Image cache: " << images.hits << " hits, " << images.misses << " misses, "
+              << images.evictions << " evictions, " << images.images << " images ("
+              << images.bytes / (1024 * 1024) << " of " << cache->budgetBytes() / (1024 * 1024)
+              << " MiB)\n";
+  }
+  return stats.failed;
+}
+
+int runBatch(const BatchOptions& options) {
+  BatchSession session(options);
+  BatchStats stats;
+  return runBatch(session, options, stats);
+}
+
+// Converts every PNG of 'input_directory' into a raw image and every raw
+// image into a PNG, with the same name and the other extension, in
+// 'output_directory'. Returns the number of files that failed.
+int convertImages(const std::string& input_directory, const std::string& output_directory,
+                  const PNGWriteOptions& png_options, ThreadPool& pool) {
+  makeDirectory(output_directory);
+  int failed = 0;
+  for (auto& name : listImageFiles(input_directory)) {
+    auto output_name = name.substr(0, name.size() - 4) + (isRawImageName(name) ? ".png" : ".raw");
+    if (convertImage((input_directory + "/" + name).c_str(),
+                     (output_directory + "/" + output_name).c_str(), png_options, &pool) == false)
+      ++failed;
+  }
+  return failed;
+}
+
+#endif // HEADER_BATCH_HPP
@@ -0,0 +1,563 @@
+#include <GLXW/glxw.h>
+#include <GL/freeglut.h>
+#include "filter_params.hpp"
+#include "compute_filter.hpp"
+#include "cpu_filter.hpp"
+#include "thread_pool.hpp"
+#include "gl_context.hpp"
+#include "gl_error_check.hpp"
+#include "gl_objects.hpp"
+#include "image_utils.hpp"
+#include "mapped_file.hpp"
+#include "png_writer.hpp"
+#include "raw_image.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+// Benchmarks of the PNG decoder, the CPU filter engines and the compute
+// filter. Inputs are reproducible (seeded noise), every benchmark is warmed up
+// once and then timed iteration by iteration, and the median iteration is
+// reported, which is what regressions are checked against: it's much less
+// sensitive than the mean to the odd preempted iteration.
+
+// Returns 'size' bytes of reproducible noise
+std::vector<unsigned char> noiseImage(size_t size) {
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<int> distribution(0, 255);
+  std::vector<unsigned char> pixels(size);
+  for (auto& value : pixels)
+    value = static_cast<unsigned char>(distribution(generator));
+  return pixels;
+}
+
+// Times of the iterations of a benchmark, in milliseconds
+struct Timing {
+  double median_ms = 0.0;
+  double min_ms = 0.0;
+};
+
+// Runs 'run' once to warm up, then 'iterations' times. 'run' must not return
+// before its work is done (e.g. it calls glFinish).
+template <typename Function>
+Timing timeIterations(int iterations, Function run) {
+  run();
+
+  std::vector<double> times;
+  for (int i = 0; i < std::max(iterations, 1); ++i) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    times.push_back(elapsed.count());
+  }
+
+  std::sort(times.begin(), times.end());
+  Timing timing;
+  timing.median_ms = times[times.size() / 2];
+  timing.min_ms = times.front();
+  return timing;
+}
+
+// One benchmark run. Throughputs are computed from the median time: pixels
+// of the image and 'bytes', the data the benchmark streams through (the image
+// buffer, or the file for the decoder).
+struct BenchResult {
+  std::string name; // e.g. "cpu/avx2", unique together with the size
+  int width;
+  int height;
+  size_t bytes;
+  Timing timing;
+
+  double megapixelsPerSecond() const {
+    return width * static_cast<double>(height) / 1e3 / timing.median_ms;
+  }
+
+  double bytesPerSecond() const {
+    return bytes * 1e3 / timing.median_ms;
+  }
+
+  std::string key() const {
+    return name + "@" + std::to_string(width) + "x" + std::to_string(height);
+  }
+};
+
+// Collects the results, prints them as they come and writes them as CSV
+class BenchReport {
+public:
+  void section(const std::string& title) {
+    std::cout << "\n" << title << "\n"
+              << std::left << std::setw(28) << "benchmark" << std::setw(12) << "size"
+              << std::right << std::setw(12) << "median ms" << std::setw(12) << "min ms"
+              << std::setw(12) << "MPixel/s" << std::setw(12) << "MB/s" << "\n";
+  }
+
+  void add(const BenchResult& result) {
+    std::stringstream size;
+    size << result.width << "x" << result.height;
+    std::cout << std::left << std::setw(28) << result.name << std::setw(12) << size.str()
+              << std::right << std::fixed << std::setprecision(3)
+              << std::setw(12) << result.timing.median_ms << std::setw(12) << result.timing.min_ms
+              << std::setw(12) << result.megapixelsPerSecond()
+              << std::setw(12) << result.bytesPerSecond() / 1e6 << "\n";
+    results.push_back(result);
+  }
+
+  void skipped(const std::string& name, const std::string& reason) {
+    std::cout << std::left << std::setw(28) << name << "skipped: " << reason << "\n";
+  }
+
+  // One row per result, with a header: the format --baseline reads back
+  bool writeCSV(const std::string& file_name) const {
+    std::ofstream out(file_name);
+    out << "benchmark,width,height,median_ms,min_ms,mpixels_per_s,bytes_per_s\n"
+        << std::fixed << std::setprecision(6);
+    for (auto& result : results) {
+      out << result.name << "," << result.width << "," << result.height << ","
+          << result.timing.median_ms << "," << result.timing.min_ms << ","
+          << result.megapixelsPerSecond() << "," << result.bytesPerSecond() << "\n";
+    }
+    return static_cast<bool>(out);
+  }
+
+  // Compares the median times against a CSV written by an earlier run.
+  // Returns the number of benchmarks slower than 'max_regression' (e.g. 0.1
+  // for 10%), benchmarks missing from either side are ignored.
+  int compare(const std::string& baseline_file, double max_regression) const {
+    std::ifstream in(baseline_file);
+    if (!in)
+      throw std::runtime_error("Cannot read " + baseline_file);
+
+    std::map<std::string, double> baseline_ms;
+    std::string line;
+    std::getline(in, line); // Header
+    while (std::getline(in, line)) {
+      std::vector<std::string> fields;
+      std::stringstream row(line);
+      for (std::string field; std::getline(row, field, ',');)
+        fields.push_back(field);
+      if (fields.size() < 4)
+        continue;
+      baseline_ms[fields[0] + "@" + fields[1] + "x" + fields[2]] = std::atof(fields[3].c_str());
+    }
+
+    std::cout << "\nCompared to " << baseline_file << " (regression threshold " << std::fixed
+              << std::setprecision(1) << max_regression * 100.0 << "%)\n";
+    int regressions = 0;
+    for (auto& result : results) {
+      auto baseline = baseline_ms.find(result.key());
+      if (baseline == baseline_ms.end() || baseline->second <= 0.0)
+        continue;
+      double change = result.timing.median_ms / baseline->second - 1.0;
+      bool regression = change > max_regression;
+      regressions += regression ? 1 : 0;
+      std::cout << std::left << std::setw(40) << result.key() << std::right << std::fixed
+                << std::setprecision(1) << std::setw(8) << std::showpos << change * 100.0
+                << std::noshowpos << "%" << (regression ? "  REGRESSION" : "") << "\n";
+    }
+    return regressions;
+  }
+
+private:
+  std::vector<BenchResult> results;
+};
+
+// Decodes a PNG read through stdio and from a memory mapping, and maps the
+// same image as a raw image (reading every byte, as an upload would). The
+// files are written right before, so they're in the page cache and the
+// difference is the CPU cost of the I/O paths, not the storage speed.
+void benchPNGDecode(BenchReport& report, int width, int height, int iterations) {
+  const char *file_name = "filter_bench_decode.png";
+  const char *raw_file_name = "filter_bench_decode.raw";
+  auto layout = ImageLayout::fromPNG(width, height, 4);
+  // Noise barely compresses, which gives the largest file for the image size
+  auto noise = noiseImage(layout.size());
+  if (savePNGToFile(file_name, width, height, GL_RGBA, noise) == false ||
+      saveRawImage(raw_file_name, width, height, GL_RGBA, GL_UNSIGNED_BYTE, noise.data()) == false)
+    return;
+
+  MappedFile file;
+  const size_t file_size = file.open(file_name) ? file.size() : 0;
+  file.close();
+
+  std::vector<unsigned char> pixels;
+  auto allocate = [&](size_t size) {
+    pixels.resize(size);
+    return pixels.data();
+  };
+  for (auto input : { PNGInput::Stdio, PNGInput::MemoryMapped }) {
+    const std::string name = input == PNGInput::Stdio ? "decode/stdio" : "decode/mmap";
+    bool ok = true;
+    auto timing = timeIterations(iterations, [&] {
+      int w, h;
+      GLint format;
+      GLenum type;
+      ok = loadPNGFromFile(file_name, w, h, format, type, allocate, input) && ok;
+    });
+    if (ok)
+      report.add({ name, width, height, file_size, timing });
+    else
+      report.skipped(name, "decoding failed");
+  }
+
+  bool ok = true;
+  auto timing = timeIterations(iterations, [&] {
+    RawImageFile raw;
+    ok = raw.open(raw_file_name) && ok;
+    if (ok) {
+      const unsigned char *pixels = raw.pixels();
+      unsigned checksum = 0;
+      for (size_t i = 0; i < layout.size(); ++i)
+        checksum += pixels[i];
+      // Stored through a volatile so that the reads aren't optimized away
+      volatile unsigned sink = checksum;
+      (void)sink;
+    }
+  });
+  if (ok)
+    report.add({ "decode/raw-mmap", width, height, layout.size() + sizeof(RawImageHeader), timing });
+  else
+    report.skipped("decode/raw-mmap", "mapping failed");
+
+  std::remove(file_name);
+  std::remove(raw_file_name);
+}
+
+// Encodes a filtered (so smooth, and compressible) RGBA image with libpng
+// and with the strip encoder at a few compression levels and filters,
+// single threaded. The default settings are then run on each of
+// 'thread_counts' threads. Throughput is in image bytes, as for the filters.
+void benchPNGEncode(BenchReport& report, int width, int height, int iterations,
+                    const std::vector<unsigned>& thread_counts) {
+  const char *file_name = "filter_bench_encode.png";
+  auto layout = ImageLayout::fromPNG(width, height, 4);
+  std::vector<unsigned char> pixels;
+  gaussianFilterImage(noiseImage(layout.size()), pixels, layout, FilterParams());
+
+  auto add = [&](const std::string& name, const std::function<bool()>& encode) {
+    bool ok = true;
+    auto timing = timeIterations(iterations, [&] { ok = encode() && ok; });
+    if (ok)
+      report.add({ name, width, height, layout.size(), timing });
+    else
+      report.skipped(name, "encoding failed");
+  };
+
+  add("encode/libpng", [&] {
+    return savePNGToFile(file_name, width, height, GL_RGBA, pixels);
+  });
+
+  const struct {
+    int level;
+    PNGFilter filter;
+    const char *name;
+  } settings[] = {
+    { 1, PNGFilter::None, "encode/level-1/none" },
+    { 1, PNGFilter::Paeth, "encode/level-1/paeth" },
+    { 6, PNGFilter::Paeth, "encode/level-6/paeth" },
+    { 6, PNGFilter::Adaptive, "encode/level-6/adaptive" }
+  };
+  for (auto& setting : settings) {
+    PNGWriteOptions options;
+    options.compression_level = setting.level;
+    options.filter = setting.filter;
+    add(setting.name, [&] {
+      return savePNGToFile(file_name, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels, options);
+    });
+  }
+
+  for (auto threads : thread_counts) {
+    ThreadPool pool(threads);
+    add("encode/threads-" + std::to_string(threads), [&] {
+      return savePNGToFile(file_name, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels,
+                           PNGWriteOptions(), &pool);
+    });
+  }
+  std::remove(file_name);
+}
+
+// Runs every single threaded CPU kernel this machine supports, then the
+// banded multithreaded filter with each of 'thread_counts' threads
+void benchCpuFilter(BenchReport& report, int width, int height, int iterations,
+                    const std::vector<unsigned>& thread_counts) {
+  auto layout = ImageLayout::fromPNG(width, height, 4);
+  auto input = noiseImage(layout.size());
+  std::vector<unsigned char> output;
+  FilterParams params;
+
+  for (auto kernel : { CpuKernel::Scalar, CpuKernel::SSE2, CpuKernel::AVX2 }) {
+    cpu_filter::Kernels kernels;
+    try {
+      kernels = cpu_filter::selectKernels(kernel);
+    } catch (std::runtime_error&) {
+      continue; // Not supported by this CPU
+    }
+    auto timing = timeIterations(iterations, [&] {
+      gaussianFilterImage(input, output, layout, params, kernel);
+    });
+    report.add({ std::string("cpu/") + kernels.name, width, height, layout.size(), timing });
+  }
+
+  for (auto threads : thread_counts) {
+    ThreadPool pool(threads);
+    auto timing = timeIterations(iterations, [&] {
+      gaussianFilterImage(input, output, layout, params, pool, CpuKernel::Auto);
+    });
+    report.add({ "cpu/threads-" + std::to_string(threads), width, height, layout.size(), timing });
+  }
+}
+
+// Creates a width x height RGBA8 texture, filled with noise if 'fill' is true
+GLTexture createBenchTexture(int width, int height, bool fill) {
+  std::vector<unsigned char> pixels;
+  if (fill)
+    pixels = noiseImage(static_cast<size_t>(width) * height * 4);
+
+  GLTexture texture = GLTexture::create();
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, texture.get()));
+  GL_ERROR_CHECK(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                              fill ? pixels.data() : nullptr));
+  GL_ERROR_CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+  GL_ERROR_CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, 0));
+  return texture;
+}
+
+// Runs every compute filter mode with each of 'work_group_sizes'. Wall clock
+// time around glFinish is used instead of timer queries since software
+// renderers like llvmpipe don't implement them usefully.
+void benchComputeFilter(BenchReport& report, int width, int height, int iterations,
+                        const std::vector<WorkGroupSize>& work_group_sizes) {
+  const struct {
+    FilterMode mode;
+    const char *name;
+  } modes[] = {
+    { FilterMode::Direct5x5, "direct5x5" },
+    { FilterMode::Separable, "separable" },
+    { FilterMode::Tiled, "tiled" }
+  };
+
+  GLTexture input = createBenchTexture(width, height, true);
+  GLTexture output = createBenchTexture(width, height, false);
+  const size_t bytes = static_cast<size_t>(width) * height * 4;
+
+  FilterParams params;
+  GaussianComputeFilter filter;
+
+  for (auto& work_group_size : work_group_sizes) {
+    filter.setWorkGroupSize(work_group_size.x, work_group_size.y);
+    for (auto& mode : modes) {
+      std::stringstream name;
+      name << "gl/" << mode.name << "/" << work_group_size.x << "x" << work_group_size.y;
+      try {
+        auto timing = timeIterations(iterations, [&] {
+          filter.apply(input.get(), output.get(), width, height, params, mode.mode);
+          GL_ERROR_CHECK(glFinish());
+        });
+        report.add({ name.str(), width, height, bytes, timing });
+      } catch (std::exception& e) {
+        report.skipped(name.str(), e.what()); // e.g. the tile doesn't fit into shared memory
+      }
+    }
+  }
+
+  // Uploading a 64x64 patch and refiltering what it affects only, to compare
+  // with refiltering the whole image above
+  const ImageRegion patch{ width / 2 - 32, height / 2 - 32, 64, 64 };
+  if (patch.x < 0 || patch.y < 0)
+    return;
+  auto patch_pixels = noiseImage(static_cast<size_t>(width) * height * 4);
+  filter.setWorkGroupSize(16, 16);
+  filter.apply(input.get(), output.get(), width, height, params, FilterMode::Separable);
+  auto timing = timeIterations(iterations, [&] {
+    uploadTextureRegion(input.get(), patch_pixels.data(), width, GL_RGBA, GL_UNSIGNED_BYTE, patch);
+    filter.applyRegions(input.get(), output.get(), width, height, params, FilterMode::Separable,
+                        PostFilters(), { patch });
+    GL_ERROR_CHECK(glFinish());
+  });
+  report.add({ "gl/separable/dirty-64x64", width, height, bytes, timing });
+}
+
+// Filters 256 64x64 thumbnails with the separable filter one by one, with a
+// dispatch per pass and image, then as the layers of an array texture, with
+// a dispatch per pass
+void benchThumbnails(BenchReport& report, int iterations) {
+  const int size = 64, count = 256;
+  const size_t image_bytes = static_cast<size_t>(size) * size * 4;
+  auto pixels = noiseImage(image_bytes * count);
+
+  FilterParams params;
+  GaussianComputeFilter filter;
+  auto& pool = filter.texturePool();
+  std::vector<GLuint> inputs, outputs;
+  for (int i = 0; i < count; ++i) {
+    inputs.push_back(pool.acquire(size, size, GL_RGBA8));
+    outputs.push_back(pool.acquire(size, size, GL_RGBA8));
+    uploadTextureRegion(inputs.back(), pixels.data() + i * image_bytes, size, GL_RGBA,
+                        GL_UNSIGNED_BYTE, { 0, 0, size, size });
+  }
+  GLuint input_array = pool.acquireArray(size, size, count, GL_RGBA8);
+  GLuint output_array = pool.acquireArray(size, size, count, GL_RGBA8);
+  GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_ALIGNMENT, 4));
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D_ARRAY, input_array));
+  GL_ERROR_CHECK(glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, size, size, count, GL_RGBA,
+                                 GL_UNSIGNED_BYTE, pixels.data()));
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
+
+  // Reported as a single image of all the thumbnails stacked
+  auto timing = timeIterations(iterations, [&] {
+    for (int i = 0; i < count; ++i)
+      filter.apply(inputs[i], outputs[i], size, size, params, FilterMode::Separable);
+    GL_ERROR_CHECK(glFinish());
+  });
+  report.add({ "gl/thumbnails/one-by-one", size, size * count, image_bytes * count, timing });
+  timing = timeIterations(iterations, [&] {
+    filter.applyLayers(input_array, output_array, size, size, count, params,
+                       FilterMode::Separable);
+    GL_ERROR_CHECK(glFinish());
+  });
+  report.add({ "gl/thumbnails/array", size, size * count, image_bytes * count, timing });
+}
+
+// Makes a GL 4.3 context current: a headless one when EGL is available,
+// otherwise a hidden FreeGLUT window (which needs a display server)
+std::unique_ptr<HeadlessGLContext> createBenchContext(int& argc, char **argv) {
+  auto context = HeadlessGLContext::create();
+  if (!context) {
+    glutInitContextVersion(4, 3);
+    glutInitContextProfile(GLUT_CORE_PROFILE);
+    glutInit(&argc, argv);
+
+    glutInitDisplayMode(GLUT_RGB);
+    glutInitWindowSize(1, 1);
+    glutCreateWindow("filter_bench");
+    glutHideWindow();
+  }
+  return context;
+}
+
+// Parses a comma separated list of positive integers, e.g. "512,2048"
+std::vector<int> parseList(const char *text) {
+  std::vector<int> values;
+  std::stringstream list(text);
+  for (std::string value; std::getline(list, value, ',');) {
+    if (std::atoi(value.c_str()) > 0)
+      values.push_back(std::atoi(value.c_str()));
+  }
+  return values;
+}
+
+int main(int argc, char **argv) {
+
+  std::vector<int> sizes = { 512, 2048 };
+  int iterations = 20;
+  unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  bool gpu = true;
+  std::string csv_file, baseline_file;
+  double max_regression = 0.1;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--sizes") == 0 && i + 1 < argc)
+      sizes = parseList(argv[++i]);
+    else if (std::strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+      iterations = std::max(std::atoi(argv[++i]), 1);
+    else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      max_threads = static_cast<unsigned>(std::max(std::atoi(argv[++i]), 1));
+    else if (std::strcmp(argv[i], "--no-gpu") == 0)
+      gpu = false;
+    else if (std::strcmp(argv[i], "--csv") == 0 && i + 1 < argc)
+      csv_file = argv[++i];
+    else if (std::strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+      baseline_file = argv[++i];
+    else if (std::strcmp(argv[i], "--max-regression") == 0 && i + 1 < argc)
+      max_regression = std::atof(argv[++i]) / 100.0;
+    else {
+      std::cerr << "Usage: " << argv[0] << " [--sizes N,N,...] [--iterations N] [--threads N] [--no-gpu]"
+                << " [--csv FILE] [--baseline FILE] [--max-regression PERCENT]" << std::endl;
+      return 1;
+    }
+  }
+  if (sizes.empty()) {
+    std::cerr << "No image size to benchmark" << std::endl;
+    return 1;
+  }
+  const int largest = *std::max_element(sizes.begin(), sizes.end());
+
+  // Thread scaling is only measured on the largest image, the other sizes
+  // run with every thread
+  std::vector<unsigned> thread_counts;
+  for (unsigned threads = 1; threads < max_threads; threads *= 2)
+    thread_counts.push_back(threads);
+  thread_counts.push_back(max_threads);
+
+  BenchReport report;
+  std::cout << iterations << " iterations per benchmark\n";
+
+  report.section("Image decoding (RGBA noise)");
+  for (auto size : sizes)
+    benchPNGDecode(report, size, size, iterations);
+
+  report.section("PNG encoding (filtered RGBA noise)");
+  for (auto size : sizes) {
+    benchPNGEncode(report, size, size, iterations,
+                   size == largest ? thread_counts : std::vector<unsigned>{ max_threads });
+  }
+
+  report.section(std::string("CPU filter (RGBA, radius ") + std::to_string(FilterParams().radius) +
+                 ", auto kernel is " + cpu_filter::selectKernels(CpuKernel::Auto).name + ")");
+  for (auto size : sizes) {
+    benchCpuFilter(report, size, size, iterations,
+                   size == largest ? thread_counts : std::vector<unsigned>{ max_threads });
+  }
+
+  std::unique_ptr<HeadlessGLContext> context;
+  if (gpu) {
+    context = createBenchContext(argc, argv);
+    if (glxwInit()) {
+      std::cerr << "Failed to initialize GL3W" << std::endl;
+      return 1;
+    }
+
+    // The work group sizes are only compared on the largest image
+    const std::vector<WorkGroupSize> work_group_sizes = {
+      { 8, 8 }, { 16, 8 }, { 16, 16 }, { 32, 8 }, { 32, 16 }, { 32, 32 }
+    };
+    std::stringstream title;
+    title << "Compute filter (RGBA8, radius " << FilterParams().radius << ") on ["
+          << glGetString(GL_RENDERER) << "]";
+    report.section(title.str());
+    for (auto size : sizes) {
+      benchComputeFilter(report, size, size, iterations,
+                         size == largest ? work_group_sizes
+                                         : std::vector<WorkGroupSize>{ { 16, 16 } });
+    }
+    benchThumbnails(report, iterations);
+  }
+
+  if (csv_file.empty() == false) {
+    if (report.writeCSV(csv_file))
+      std::cout << "\nResults written to " << csv_file << "\n";
+    else
+      std::cerr << "Cannot write " << csv_file << std::endl;
+  }
+  if (baseline_file.empty() == false) {
+    try {
+      if (report.compare(baseline_file, max_regression) > 0)
+        return 2;
+    } catch (std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
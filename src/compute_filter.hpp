@@ -0,0 +1,583 @@
+#ifndef HEADER_COMPUTEFILTER_HPP
+#define HEADER_COMPUTEFILTER_HPP
+
+#include <GLXW/glxw.h>
+#include "filter_graph.hpp"
+#include "filter_params.hpp"
+#include "gl_error_check.hpp"
+#include "image_layout.hpp"
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Caveat: as for the shader classes, a valid GL context must be current
+
+// The shaders below are FilterGraph passes: they store their result through
+// POINTWISE(), which runs the thresholding and any other per-texel step fused
+// into them
+
+// local_size_x/y/z layout variables define the work group size.
+// gl_GlobalInvocationID is a uvec3 variable giving the global ID of the thread,
+// gl_LocalInvocationID is the local index within the work group, and
+// gl_WorkGroupID is the work group's index
+const std::string gaussian_filter_computeshader_source = { R"(
+
+#version 430
+
+// Invocations in the work group
+// Operate on the image in blocks of LOCAL_SIZE_X x LOCAL_SIZE_Y "threads"
+// (16x16 by default)
+layout (local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y) in;
+
+uniform layout(INPUT_FORMAT, binding = 0) readonly IMAGE input_texture;
+uniform layout(OUTPUT_FORMAT, binding = 1) writeonly IMAGE output_texture;
+
+void main() {
+  // Coordinates of the texel we're about to process
+  ivec2 texelCoords = ivec2(gl_GlobalInvocationID.xy) + region_origin;
+  ivec2 size = IMAGE_SIZE(input_texture);
+  if (any(greaterThanEqual(texelCoords, region_end)))
+    return;
+
+  // Read the pixel from the first texture.
+  // vec4 pixel = imageLoad(input_texture, texelCoords);
+  // imageStore(output_texture, texelCoords, pixel);
+
+  const float gaussian_kernel[25] = float[](1.0, 4.0, 7.0, 4.0, 1.0,
+    4.0, 16.0, 26.0, 16.0, 4.0,
+    7.0, 26.0, 41.0, 26.0, 7.0,
+    4.0, 16.0, 26.0, 16.0, 4.0,
+    1.0, 4.0, 7.0, 4.0, 1.0);
+  const float kernel_sum = 273.0;
+
+  // Compute a simple gaussian blur
+  float result_r = 0.0;
+  float result_g = 0.0;
+  float result_b = 0.0;
+  float result_a = 0.0;
+  for(int i=-2; i<=2; ++i) {
+    for(int j=-2; j<=2; ++j) {
+      int x = texelCoords.x + i;
+      int y = texelCoords.y + j;
+      vec4 pixel = vec4(0.0, 0.0, 0.0, 255.0);
+#ifdef BORDER_CLAMP
+      {
+        vec4 pixel = IMAGE_LOAD(input_texture, clamp(ivec2(x, y), ivec2(0), size - 1));
+#else
+      if(!(x < 0 || x >= size.x || y < 0 || y >= size.y)) {
+        vec4 pixel = IMAGE_LOAD(input_texture, ivec2(x,y));
+#endif
+        float gauss_val = gaussian_kernel[(j + 2) * 5 + (i + 2)];
+        result_r += pixel.r * gauss_val;
+        result_g += pixel.g * gauss_val;
+        result_b += pixel.b * gauss_val;
+        result_a += pixel.a * gauss_val;
+      }
+    }
+  }
+
+  result_r /= kernel_sum;
+  result_g /= kernel_sum;
+  result_b /= kernel_sum;
+  result_a /= kernel_sum;
+
+  // [OT] Example of swapping the red and green channels
+  // pixel.rg = pixel.gr;
+
+  // Now write the modified pixel to the second texture.
+  IMAGE_STORE(output_texture, texelCoords, POINTWISE(vec4(result_r, result_g, result_b, result_a)));
+}
+
+)" };
+
+// First pass of the separable filter: convolves every row with the 1D kernel
+// and stores the result in a float texture, so that the vertical pass doesn't
+// work on requantized values. RADIUS is a compile time constant, so that the
+// loops over the taps are unrolled, and so is the border mode: BORDER_CLAMP
+// repeats the edge texels instead of ignoring the ones outside of the image.
+const std::string gaussian_horizontal_computeshader_source = { R"(
+
+#version 430
+
+layout (local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y) in;
+
+uniform layout(INPUT_FORMAT, binding = 0) readonly IMAGE input_texture;
+uniform layout(OUTPUT_FORMAT, binding = 1) writeonly IMAGE output_texture;
+uniform float weights[2 * RADIUS + 1];
+
+void main() {
+  ivec2 texelCoords = ivec2(gl_GlobalInvocationID.xy) + region_origin;
+  ivec2 size = IMAGE_SIZE(input_texture);
+  if (any(greaterThanEqual(texelCoords, region_end)))
+    return;
+
+  vec4 result = vec4(0.0);
+  for (int i = -RADIUS; i <= RADIUS; ++i) {
+    int x = texelCoords.x + i;
+#ifdef BORDER_CLAMP
+    result += IMAGE_LOAD(input_texture, ivec2(clamp(x, 0, size.x - 1), texelCoords.y)) * weights[i + RADIUS];
+#else
+    // Texels outside of the image don't contribute, as in the direct kernel
+    if (x >= 0 && x < size.x)
+      result += IMAGE_LOAD(input_texture, ivec2(x, texelCoords.y)) * weights[i + RADIUS];
+#endif
+  }
+
+  IMAGE_STORE(output_texture, texelCoords, POINTWISE(result));
+}
+
+)" };
+
+// Second pass of the separable filter: convolves every column of the
+// intermediate texture, specialized as the first one
+const std::string gaussian_vertical_computeshader_source = { R"(
+
+#version 430
+
+layout (local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y) in;
+
+uniform layout(INPUT_FORMAT, binding = 0) readonly IMAGE input_texture;
+uniform layout(OUTPUT_FORMAT, binding = 1) writeonly IMAGE output_texture;
+uniform float weights[2 * RADIUS + 1];
+
+void main() {
+  ivec2 texelCoords = ivec2(gl_GlobalInvocationID.xy) + region_origin;
+  ivec2 size = IMAGE_SIZE(input_texture);
+  if (any(greaterThanEqual(texelCoords, region_end)))
+    return;
+
+  vec4 result = vec4(0.0);
+  for (int j = -RADIUS; j <= RADIUS; ++j) {
+    int y = texelCoords.y + j;
+#ifdef BORDER_CLAMP
+    result += IMAGE_LOAD(input_texture, ivec2(texelCoords.x, clamp(y, 0, size.y - 1))) * weights[j + RADIUS];
+#else
+    if (y >= 0 && y < size.y)
+      result += IMAGE_LOAD(input_texture, ivec2(texelCoords.x, y)) * weights[j + RADIUS];
+#endif
+  }
+
+  IMAGE_STORE(output_texture, texelCoords, POINTWISE(result));
+}
+
+)" };
+
+// Single pass filter working on a tile of the image cached in shared memory.
+// Every work group cooperatively loads its LOCAL_SIZE_X x LOCAL_SIZE_Y block
+// plus a RADIUS wide halo once, then convolves from shared memory instead of
+// issuing (2 * RADIUS + 1)^2 image loads per texel. RADIUS is a compile time
+// constant since it determines the size of the shared tile.
+const std::string gaussian_tiled_computeshader_source = { R"(
+
+#version 430
+
+layout (local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y) in;
+
+#define TILE_X (LOCAL_SIZE_X + 2 * RADIUS)
+#define TILE_Y (LOCAL_SIZE_Y + 2 * RADIUS)
+
+uniform layout(INPUT_FORMAT, binding = 0) readonly IMAGE input_texture;
+uniform layout(OUTPUT_FORMAT, binding = 1) writeonly IMAGE output_texture;
+uniform float weights[2 * RADIUS + 1];
+
+shared vec4 tile[TILE_Y][TILE_X];
+
+void main() {
+  ivec2 size = IMAGE_SIZE(input_texture);
+  ivec2 tileOrigin = region_origin + ivec2(gl_WorkGroupID.xy) * ivec2(LOCAL_SIZE_X, LOCAL_SIZE_Y) -
+                    RADIUS;
+
+  // The tile is larger than the work group, each invocation loads a strided
+  // subset of it. Texels outside of the image don't contribute, or repeat
+  // the edge ones with BORDER_CLAMP.
+  for (int i = int(gl_LocalInvocationIndex); i < TILE_X * TILE_Y;
+       i += LOCAL_SIZE_X * LOCAL_SIZE_Y) {
+    ivec2 tileCoords = ivec2(i % TILE_X, i / TILE_X);
+    ivec2 coords = tileOrigin + tileCoords;
+#ifdef BORDER_CLAMP
+    vec4 pixel = IMAGE_LOAD(input_texture, clamp(coords, ivec2(0), size - 1));
+#else
+    vec4 pixel = vec4(0.0);
+    if (all(greaterThanEqual(coords, ivec2(0))) && all(lessThan(coords, size)))
+      pixel = IMAGE_LOAD(input_texture, coords);
+#endif
+    tile[tileCoords.y][tileCoords.x] = pixel;
+  }
+
+  memoryBarrierShared();
+  barrier();
+
+  ivec2 texelCoords = ivec2(gl_GlobalInvocationID.xy) + region_origin;
+  if (any(greaterThanEqual(texelCoords, region_end)))
+    return;
+
+  ivec2 center = ivec2(gl_LocalInvocationID.xy) + RADIUS;
+  vec4 result = vec4(0.0);
+  for (int j = -RADIUS; j <= RADIUS; ++j) {
+    vec4 row = vec4(0.0);
+    for (int i = -RADIUS; i <= RADIUS; ++i)
+      row += tile[center.y + j][center.x + i] * weights[i + RADIUS];
+    result += row * weights[j + RADIUS];
+  }
+
+  IMAGE_STORE(output_texture, texelCoords, POINTWISE(result));
+}
+
+)" };
+
+// Grayscale morphology over a (2 * radius + 1)^2 square: MORPHOLOGY_OP is max
+// (dilation) or min (erosion). Texels outside of the image are ignored.
+const std::string morphology_computeshader_source = { R"(
+
+#version 430
+
+layout (local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y) in;
+
+uniform layout(INPUT_FORMAT, binding = 0) readonly IMAGE input_texture;
+uniform layout(OUTPUT_FORMAT, binding = 1) writeonly IMAGE output_texture;
+uniform int radius;
+
+void main() {
+  ivec2 texelCoords = ivec2(gl_GlobalInvocationID.xy) + region_origin;
+  ivec2 size = IMAGE_SIZE(input_texture);
+  if (any(greaterThanEqual(texelCoords, region_end)))
+    return;
+
+  ivec2 first = max(texelCoords - radius, ivec2(0));
+  ivec2 last = min(texelCoords + radius, size - 1);
+  vec4 result = IMAGE_LOAD(input_texture, texelCoords);
+  for (int y = first.y; y <= last.y; ++y) {
+    for (int x = first.x; x <= last.x; ++x)
+      result = MORPHOLOGY_OP(result, IMAGE_LOAD(input_texture, ivec2(x, y)));
+  }
+
+  IMAGE_STORE(output_texture, texelCoords, POINTWISE(result));
+}
+
+)" };
+
+// Pointwise nodes, see FilterGraph
+
+// Pixels whose RGB value falls outside [min; max] are set to white
+const std::string threshold_pointwise_source = { R"(
+uniform vec3 NODE_min_threshold;
+uniform vec3 NODE_max_threshold;
+
+vec4 NODE_apply(vec4 color) {
+  if (any(lessThan(color.rgb, NODE_min_threshold)) ||
+      any(greaterThan(color.rgb, NODE_max_threshold)))
+    color.rgb = vec3(1.0);
+  return color;
+}
+)" };
+
+// Rec. 709 luma, for linear RGB
+const std::string grayscale_pointwise_source = { R"(
+vec4 NODE_apply(vec4 color) {
+  return vec4(vec3(dot(color.rgb, vec3(0.2126, 0.7152, 0.0722))), color.a);
+}
+)" };
+
+// Internal format of the textures holding images with 'type' channels
+// (GL_UNSIGNED_BYTE or GL_UNSIGNED_SHORT) without requantizing them. Always
+// RGBA since 3 component textures can't be bound as images, RGB data is
+// expanded with alpha = 1 by the upload.
+GLenum imageTextureFormat(GLenum type) {
+  return (type == GL_UNSIGNED_SHORT) ? GL_RGBA16 : GL_RGBA8;
+}
+
+enum class FilterMode {
+  Direct5x5, // Original 5x5 kernel, 25 image loads per texel
+  Separable, // Horizontal + vertical passes, 2 * (2 * radius + 1) loads per texel
+  Tiled      // Single pass convolving from a shared memory tile
+};
+
+enum class Morphology {
+  None,
+  Dilate, // Max over the square window
+  Erode,  // Min over the square window
+  Open,   // Erode then dilate: removes specks smaller than the window
+  Close   // Dilate then erode: fills holes smaller than the window
+};
+
+// Steps run on the GPU after the gaussian + threshold filter, in this order
+struct PostFilters {
+  Morphology morphology = Morphology::None;
+  int morphology_radius = 1;
+  bool grayscale = false;
+
+  bool enabled() const {
+    return morphology != Morphology::None || grayscale;
+  }
+};
+
+// Size of the compute work groups, i.e. local_size_x and local_size_y
+struct WorkGroupSize {
+  int x = 16;
+  int y = 16;
+};
+
+// Filter graph nodes. Each returns the resource holding its result.
+
+FilterGraph::Resource addGaussianBlur(FilterGraph& graph, FilterGraph::Resource source,
+                                      const FilterParams& params, FilterMode mode) {
+  auto weights = gaussianKernel1D(params.radius, params.sigma);
+  const int radius = params.radius;
+  auto setWeights = [weights](GLuint program, const std::string&) {
+    GLint weights_loc;
+    GL_ERROR_CHECK(weights_loc = glGetUniformLocation(program, "weights"));
+    GL_ERROR_CHECK(glUniform1fv(weights_loc, static_cast<GLsizei>(weights.size()), weights.data()));
+  };
+  // Every pass is specialized for its border mode, and all but the fixed 5x5
+  // one for their radius too, which would only cache identical programs
+  ShaderDefines border_defines;
+  if (params.border == BorderMode::Clamp)
+    border_defines.emplace_back("BORDER_CLAMP", "1");
+  ShaderDefines defines = { { "RADIUS", std::to_string(radius) } };
+  defines.insert(defines.end(), border_defines.begin(), border_defines.end());
+
+  switch (mode) {
+    case FilterMode::Direct5x5:
+      return graph.addPass("gaussian 5x5", gaussian_filter_computeshader_source, { source }, {},
+                           border_defines, FilterGraph::Storage::Output, { 2, 2 });
+
+    case FilterMode::Separable: {
+      // The vertical pass works on unquantized horizontal sums
+      auto horizontal = graph.addPass("gaussian horizontal", gaussian_horizontal_computeshader_source,
+                                      { source }, setWeights, defines, FilterGraph::Storage::Float,
+                                      { radius, 0 });
+      return graph.addPass("gaussian vertical", gaussian_vertical_computeshader_source,
+                           { horizontal }, setWeights, defines, FilterGraph::Storage::Output,
+                           { 0, radius });
+    }
+
+    case FilterMode::Tiled: {
+      // A radius R tile takes (LOCAL_SIZE_X + 2R) * (LOCAL_SIZE_Y + 2R) * 16 bytes
+      // of shared memory
+      GLint max_shared_size;
+      GL_ERROR_CHECK(glGetIntegerv(GL_MAX_COMPUTE_SHARED_MEMORY_SIZE, &max_shared_size));
+      if ((graph.workGroupSizeX() + 2 * radius) * (graph.workGroupSizeY() + 2 * radius) * 16 >
+          max_shared_size)
+        throw std::runtime_error("Tile doesn't fit in shared memory");
+
+      return graph.addPass("gaussian tiled", gaussian_tiled_computeshader_source, { source },
+                           setWeights, defines, FilterGraph::Storage::Output, { radius, radius });
+    }
+  }
+  throw std::invalid_argument("Unknown filter mode");
+}
+
+FilterGraph::Resource addThreshold(FilterGraph& graph, FilterGraph::Resource source,
+                                   const RGB& min_threshold, const RGB& max_threshold) {
+  return graph.addPointwise("threshold", threshold_pointwise_source, source,
+    [min_threshold, max_threshold](GLuint program, const std::string& prefix) {
+      GLint min_loc, max_loc;
+      GL_ERROR_CHECK(min_loc = glGetUniformLocation(program, (prefix + "min_threshold").c_str()));
+      GL_ERROR_CHECK(glUniform3f(min_loc, min_threshold.r, min_threshold.g, min_threshold.b));
+      GL_ERROR_CHECK(max_loc = glGetUniformLocation(program, (prefix + "max_threshold").c_str()));
+      GL_ERROR_CHECK(glUniform3f(max_loc, max_threshold.r, max_threshold.g, max_threshold.b));
+    });
+}
+
+FilterGraph::Resource addMorphology(FilterGraph& graph, FilterGraph::Resource source,
+                                    Morphology morphology, int radius) {
+  if (radius < 0 || radius > max_kernel_radius)
+    throw std::out_of_range("Morphology radius out of range");
+  auto setRadius = [radius](GLuint program, const std::string&) {
+    GLint radius_loc;
+    GL_ERROR_CHECK(radius_loc = glGetUniformLocation(program, "radius"));
+    GL_ERROR_CHECK(glUniform1i(radius_loc, radius));
+  };
+  auto dilate = [&](FilterGraph::Resource image) {
+    return graph.addPass("dilate", morphology_computeshader_source, { image }, setRadius,
+                         { { "MORPHOLOGY_OP", "max" } }, FilterGraph::Storage::Output,
+                         { radius, radius });
+  };
+  auto erode = [&](FilterGraph::Resource image) {
+    return graph.addPass("erode", morphology_computeshader_source, { image }, setRadius,
+                         { { "MORPHOLOGY_OP", "min" } }, FilterGraph::Storage::Output,
+                         { radius, radius });
+  };
+
+  switch (morphology) {
+    case Morphology::None:
+      return source;
+    case Morphology::Dilate:
+      return dilate(source);
+    case Morphology::Erode:
+      return erode(source);
+    case Morphology::Open:
+      return dilate(erode(source));
+    case Morphology::Close:
+      return erode(dilate(source));
+  }
+  throw std::invalid_argument("Unknown morphology");
+}
+
+FilterGraph::Resource addGrayscale(FilterGraph& graph, FilterGraph::Resource source) {
+  return graph.addPointwise("grayscale", grayscale_pointwise_source, source);
+}
+
+// Runs the gaussian + threshold filter, and optionally the post filters, as a
+// FilterGraph. The blur is applied params.iterations times, the threshold
+// only to its final result: it's fused into the last blur pass, or left out
+// when it lets everything through. Grayscale conversion is fused into the
+// last morphology pass. Programs are compiled on first use for every work
+// group size, format, radius and border mode they're run with.
+class GaussianComputeFilter {
+public:
+  GaussianComputeFilter() = default;
+  GaussianComputeFilter(const GaussianComputeFilter&) = delete;
+  GaussianComputeFilter& operator=(const GaussianComputeFilter&) = delete;
+
+  // Filters 'input_texture' into 'output_texture', both of size width x
+  // height and of any format imageFormatQualifier() accepts
+  void apply(GLuint input_texture, GLuint output_texture, int width, int height,
+             const FilterParams& params, FilterMode mode, const PostFilters& post = PostFilters()) {
+    build(params, mode, post);
+    graph.run(input_texture, output_texture, width, height);
+  }
+
+  // Refilters the parts of 'output_texture' that depend on the 'dirty'
+  // regions of 'input_texture', after these changed (e.g. through
+  // uploadTextureRegion()). The rest of 'output_texture' must still hold the
+  // result of filtering the previous input with the same parameters. Costs
+  // grow with the dirty area, not with the image size.
+  void applyRegions(GLuint input_texture, GLuint output_texture, int width, int height,
+                    const FilterParams& params, FilterMode mode, const PostFilters& post,
+                    const std::vector<ImageRegion>& dirty) {
+    build(params, mode, post);
+    // Regions of the output to recompute, overlapping ones merged so that no
+    // output texel is computed twice
+    std::vector<ImageRegion> regions;
+    for (auto& region : dirty) {
+      auto affected = graph.affectedRegion(region, width, height);
+      for (size_t i = 0; i < regions.size();) {
+        if (regions[i].overlaps(affected)) {
+          affected = affected.united(regions[i]);
+          regions.erase(regions.begin() + i);
+          i = 0; // The union may overlap regions already checked
+        } else {
+          ++i;
+        }
+      }
+      if (affected.empty() == false)
+        regions.push_back(affected);
+    }
+    if (regions.empty() == false)
+      graph.run(input_texture, output_texture, width, height, regions);
+  }
+
+  // Filters the first 'layers' layers of 'input_texture' into the same
+  // layers of 'output_texture', 2D array textures of width x height images.
+  // Every pass is a single dispatch over all the layers, which pays off with
+  // many small images.
+  void applyLayers(GLuint input_texture, GLuint output_texture, int width, int height,
+                   int layers, const FilterParams& params, FilterMode mode,
+                   const PostFilters& post = PostFilters()) {
+    build(params, mode, post);
+    graph.runLayers(input_texture, output_texture, width, height, layers);
+  }
+
+  void setWorkGroupSize(int x, int y) {
+    graph.setWorkGroupSize(x, y);
+  }
+
+  WorkGroupSize getWorkGroupSize() const {
+    WorkGroupSize size;
+    size.x = graph.workGroupSizeX();
+    size.y = graph.workGroupSizeY();
+    return size;
+  }
+
+  const FilterGraph& getGraph() const {
+    return graph;
+  }
+
+  // Pool of the intermediate textures, callers can draw their own from it
+  TexturePool& texturePool() {
+    return graph.texturePool();
+  }
+
+  // Times every pass, see FilterGraph::setProfiler
+  void setProfiler(GpuProfiler *profiler) {
+    graph.setProfiler(profiler);
+  }
+
+  // Keeps the compiled programs in 'directory' across runs, see ProgramCache
+  void setProgramCacheDirectory(const std::string& directory) {
+    graph.programCache().setDirectory(directory);
+  }
+
+private:
+  // Replaces the nodes of the graph with the ones of the filter
+  void build(const FilterParams& params, FilterMode mode, const PostFilters& post) {
+    if (params.iterations < 1)
+      throw std::out_of_range("The filter needs at least one iteration");
+    graph.clear();
+    // Iterations ping-pong between pooled textures, without leaving the GPU
+    auto result = FilterGraph::input;
+    for (int i = 0; i < params.iterations; ++i)
+      result = addGaussianBlur(graph, result, params, mode);
+    if (params.thresholdEnabled())
+      result = addThreshold(graph, result, params.min_threshold, params.max_threshold);
+    result = addMorphology(graph, result, post.morphology, post.morphology_radius);
+    if (post.grayscale)
+      addGrayscale(graph, result);
+  }
+
+  FilterGraph graph;
+};
+
+// Uploads 'region' of an image laid out as loadPNGFromFile returns it, of
+// 'width' pixels of 'format' and 'type' per row, to the same region of
+// level 0 of 'texture'. The rest of the image isn't read.
+void uploadTextureRegion(GLuint texture, const unsigned char *image_data, int width,
+                         GLenum format, GLenum type, const ImageRegion& region) {
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, texture));
+  GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_ALIGNMENT, 4));
+  GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_ROW_LENGTH, width));
+  GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_SKIP_PIXELS, region.x));
+  GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_SKIP_ROWS, region.y));
+  GL_ERROR_CHECK(glTexSubImage2D(GL_TEXTURE_2D, 0, region.x, region.y, region.width,
+                                 region.height, format, type, image_data));
+  GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_ROW_LENGTH, 0));
+  GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0));
+  GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_SKIP_ROWS, 0));
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, 0));
+}
+
+// Copies level 0 of the 2D texture 'texture' to 'layer' of the 2D array
+// texture 'array', or the other way around when 'to_array' is false. Both
+// have the same internal format and width x height images.
+void copyTextureLayer(GLuint texture, GLuint array, int layer, int width, int height,
+                      bool to_array = true) {
+  if (to_array)
+    GL_ERROR_CHECK(glCopyImageSubData(texture, GL_TEXTURE_2D, 0, 0, 0, 0, array,
+                                      GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1));
+  else
+    GL_ERROR_CHECK(glCopyImageSubData(array, GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, texture,
+                                      GL_TEXTURE_2D, 0, 0, 0, 0, width, height, 1));
+}
+
+// Reads back level 0 of a texture converted to 'format' (GL_RGB or GL_RGBA)
+// and 'type' (GL_UNSIGNED_BYTE or GL_UNSIGNED_SHORT), rows 4-byte aligned as
+// loadPNGFromFile lays them out
+std::vector<unsigned char> readTexture(GLuint texture, int width, int height, GLenum format,
+                                       GLenum type) {
+  const size_t rowbytes = alignedRowBytes(static_cast<size_t>(width) * (format == GL_RGBA ? 4 : 3) *
+                                         (type == GL_UNSIGNED_SHORT ? 2 : 1));
+  std::vector<unsigned char> pixels(rowbytes * height);
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, texture));
+  GL_ERROR_CHECK(glPixelStorei(GL_PACK_ALIGNMENT, 4));
+  GL_ERROR_CHECK(glGetTexImage(GL_TEXTURE_2D, 0, format, type, pixels.data()));
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, 0));
+  return pixels;
+}
+
+// Reads back level 0 of a texture as tightly packed RGBA8 rows
+std::vector<unsigned char> readTextureRGBA8(GLuint texture, int width, int height) {
+  return readTexture(texture, width, height, GL_RGBA, GL_UNSIGNED_BYTE);
+}
+
+#endif // HEADER_COMPUTEFILTER_HPP
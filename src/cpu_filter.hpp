@@ -0,0 +1,623 @@
+#ifndef HEADER_CPUFILTER_HPP
+#define HEADER_CPUFILTER_HPP
+
+#include "filter_params.hpp"
+#include "image_layout.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <stddef.h>
+
+// CPU implementation of the gaussian + RGB threshold filter. It works on the
+// buffers produced by loadPNGFromFile (8 or 16-bit RGB or RGBA, rows 4-byte aligned)
+// and doesn't need a GL context, so it's both a fallback for machines without
+// a GL 4.3 driver and a reference for the compute shaders.
+//
+// The blur is separable: every row is convolved horizontally into a ring of
+// 2 * radius + 1 float rows, which are then combined vertically. Values are
+// normalized to [0;1] as the shaders see them, so the same thresholds apply.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CPU_FILTER_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(CPU_FILTER_X86) && (defined(__GNUC__) || defined(__clang__))
+// Lets the AVX2 kernels live in the same translation unit as everything else
+#define CPU_FILTER_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define CPU_FILTER_TARGET_AVX2
+#endif
+
+enum class CpuKernel {
+  Auto, // Best kernel supported by the running CPU
+  Scalar,
+  SSE2,
+  AVX2
+};
+
+namespace cpu_filter {
+
+  // out[e] = sum(weights[t] * padded[e + t * channels]) for e in [0; count).
+  // 'padded' has radius * channels border values on both sides of the row.
+  typedef void (*HorizontalRowFn)(const float *padded, const float *weights, int taps,
+                                  int channels, float *out, size_t count);
+  // out[e] = sum(weights[t] * rows[t][e]) for e in [0; count)
+  typedef void (*VerticalRowFn)(const float * const *rows, const float *weights, int taps,
+                                float *out, size_t count);
+
+  // Every kernel accumulates the taps in the same order without fused
+  // multiply-adds, so they all produce bit-identical results
+  struct Kernels {
+    CpuKernel kernel;
+    const char *name;
+    HorizontalRowFn horizontal_row;
+    VerticalRowFn vertical_row;
+  };
+
+  void horizontalRowScalar(const float *padded, const float *weights, int taps, int channels,
+                           float *out, size_t count) {
+    for (size_t e = 0; e < count; ++e) {
+      float sum = 0.0f;
+      for (int t = 0; t < taps; ++t)
+        sum += weights[t] * padded[e + t * channels];
+      out[e] = sum;
+    }
+  }
+
+  void verticalRowScalar(const float * const *rows, const float *weights, int taps, float *out,
+                         size_t count) {
+    for (size_t e = 0; e < count; ++e) {
+      float sum = 0.0f;
+      for (int t = 0; t < taps; ++t)
+        sum += weights[t] * rows[t][e];
+      out[e] = sum;
+    }
+  }
+
+#ifdef CPU_FILTER_X86
+  void horizontalRowSSE2(const float *padded, const float *weights, int taps, int channels,
+                         float *out, size_t count) {
+    size_t e = 0;
+    for (; e + 4 <= count; e += 4) {
+      __m128 sum = _mm_setzero_ps();
+      for (int t = 0; t < taps; ++t)
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[t]),
+                                         _mm_loadu_ps(padded + e + t * channels)));
+      _mm_storeu_ps(out + e, sum);
+    }
+    horizontalRowScalar(padded + e, weights, taps, channels, out + e, count - e);
+  }
+
+  void verticalRowSSE2(const float * const *rows, const float *weights, int taps, float *out,
+                       size_t count) {
+    size_t e = 0;
+    for (; e + 4 <= count; e += 4) {
+      __m128 sum = _mm_setzero_ps();
+      for (int t = 0; t < taps; ++t)
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[t]), _mm_loadu_ps(rows[t] + e)));
+      _mm_storeu_ps(out + e, sum);
+    }
+    for (; e < count; ++e) {
+      float sum = 0.0f;
+      for (int t = 0; t < taps; ++t)
+        sum += weights[t] * rows[t][e];
+      out[e] = sum;
+    }
+  }
+
+  CPU_FILTER_TARGET_AVX2
+  void horizontalRowAVX2(const float *padded, const float *weights, int taps, int channels,
+                         float *out, size_t count) {
+    size_t e = 0;
+    for (; e + 8 <= count; e += 8) {
+      __m256 sum = _mm256_setzero_ps();
+      for (int t = 0; t < taps; ++t)
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[t]),
+                                               _mm256_loadu_ps(padded + e + t * channels)));
+      _mm256_storeu_ps(out + e, sum);
+    }
+    horizontalRowSSE2(padded + e, weights, taps, channels, out + e, count - e);
+  }
+
+  CPU_FILTER_TARGET_AVX2
+  void verticalRowAVX2(const float * const *rows, const float *weights, int taps, float *out,
+                       size_t count) {
+    size_t e = 0;
+    for (; e + 8 <= count; e += 8) {
+      __m256 sum = _mm256_setzero_ps();
+      for (int t = 0; t < taps; ++t)
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[t]),
+                                               _mm256_loadu_ps(rows[t] + e)));
+      _mm256_storeu_ps(out + e, sum);
+    }
+    for (; e < count; ++e) {
+      float sum = 0.0f;
+      for (int t = 0; t < taps; ++t)
+        sum += weights[t] * rows[t][e];
+      out[e] = sum;
+    }
+  }
+#endif // CPU_FILTER_X86
+
+  bool cpuSupportsAVX2() {
+#if defined(CPU_FILTER_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+      return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) // The OS must save the YMM registers
+      return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#elif defined(CPU_FILTER_X86)
+    return __builtin_cpu_supports("avx2") != 0;
+#else
+    return false;
+#endif
+  }
+
+  // Returns the kernels for 'requested', throws if the CPU can't run them
+  Kernels selectKernels(CpuKernel requested) {
+#ifdef CPU_FILTER_X86
+    bool avx2 = cpuSupportsAVX2();
+    if (requested == CpuKernel::Auto)
+      requested = avx2 ? CpuKernel::AVX2 : CpuKernel::SSE2; // SSE2 is always there on x86-64
+#else
+    if (requested == CpuKernel::Auto)
+      requested = CpuKernel::Scalar;
+#endif
+
+    switch (requested) {
+      case CpuKernel::Scalar:
+        return { CpuKernel::Scalar, "scalar", horizontalRowScalar, verticalRowScalar };
+#ifdef CPU_FILTER_X86
+      case CpuKernel::SSE2:
+        return { CpuKernel::SSE2, "sse2", horizontalRowSSE2, verticalRowSSE2 };
+      case CpuKernel::AVX2:
+        if (avx2)
+          return { CpuKernel::AVX2, "avx2", horizontalRowAVX2, verticalRowAVX2 };
+        break;
+#endif
+      default:
+        break;
+    }
+    throw std::runtime_error("CPU kernel not supported on this machine");
+  }
+
+  // Converts a row of 8 or 16-bit values to normalized floats, leaving the
+  // border of the padded row untouched
+  template <typename T>
+  void loadRow(const T *in, float *padded_row, size_t count) {
+    const float scale = 1.0f / std::numeric_limits<T>::max();
+    for (size_t e = 0; e < count; ++e)
+      padded_row[e] = in[e] * scale;
+  }
+
+  // Repeats the first and last pixels of a loaded row over its border
+  template <int Channels>
+  void clampRowBorder(float *padded_row, size_t count, size_t padding) {
+    float *first = padded_row + padding;
+    float *last = first + count - Channels;
+    for (size_t e = 0; e < padding; ++e) {
+      padded_row[e] = first[e % Channels];
+      last[Channels + e] = last[e % Channels];
+    }
+  }
+
+  // Applies the RGB threshold to a row of blurred values and stores it as
+  // 8 or 16-bit values, rounding to nearest as the GL unorm conversion does.
+  // Without Threshold every value is in range, and the test is left out.
+  template <typename T, int Channels, bool Threshold>
+  void storeRow(const float *sums, T *out, int width, const FilterParams& params) {
+    const float max_value = std::numeric_limits<T>::max();
+    for (int x = 0; x < width; ++x) {
+      const float *pixel = sums + x * Channels;
+      T *out_pixel = out + x * Channels;
+
+      bool in_range = !Threshold ||
+                      (pixel[0] >= params.min_threshold.r && pixel[0] <= params.max_threshold.r &&
+                       pixel[1] >= params.min_threshold.g && pixel[1] <= params.max_threshold.g &&
+                       pixel[2] >= params.min_threshold.b && pixel[2] <= params.max_threshold.b);
+
+      for (int c = 0; c < Channels; ++c) {
+        // White -> out of range
+        float value = (in_range == false && c < 3) ? 1.0f : pixel[c];
+        value = std::min(std::max(value, 0.0f), 1.0f);
+        out_pixel[c] = static_cast<T>(value * max_value + 0.5f);
+      }
+    }
+  }
+
+  void checkLayout(const ImageLayout& layout) {
+    if (layout.channels != 3 && layout.channels != 4)
+      throw std::invalid_argument("Only RGB and RGBA images are supported");
+    if (layout.channel_bytes != 1 && layout.channel_bytes != 2)
+      throw std::invalid_argument("Only 8 and 16-bit images are supported");
+  }
+
+  void checkIterations(const FilterParams& params) {
+    if (params.iterations < 1)
+      throw std::out_of_range("The filter needs at least one iteration");
+  }
+
+  // Parameters of every iteration but the last one
+  FilterParams blurOnly(FilterParams params) {
+    params.min_threshold = { 0.0f, 0.0f, 0.0f };
+    params.max_threshold = { 1.0f, 1.0f, 1.0f };
+    return params;
+  }
+
+  // Buffer 'iteration' writes. Iterations alternate between 'output' and
+  // 'scratch', so that the last one writes 'output'.
+  unsigned char *iterationOutput(int iteration, const FilterParams& params, unsigned char *output,
+                                 unsigned char *scratch) {
+    return (params.iterations - 1 - iteration) % 2 == 0 ? output : scratch;
+  }
+
+  // Runs iterations [first; params.iterations) of the filter as
+  // pass(in, out, params) calls, every one reading what the previous one
+  // wrote. 'scratch' is only used with more than one iteration.
+  template <typename Pass>
+  void runIterations(int first, const unsigned char *input, unsigned char *output,
+                     unsigned char *scratch, const FilterParams& params, Pass pass) {
+    for (int i = first; i < params.iterations; ++i) {
+      const unsigned char *in = i == 0 ? input : iterationOutput(i - 1, params, output, scratch);
+      pass(in, iterationOutput(i, params, output, scratch),
+           i + 1 == params.iterations ? params : blurOnly(params));
+    }
+  }
+
+  // Working buffers of filterRows. They only grow, so once they fit the
+  // widest row and largest radius filtered no band allocates.
+  struct RowScratch {
+    std::vector<float> padded_row;
+    std::vector<float> ring; // Horizontally blurred rows, slot y % taps
+    std::vector<float> sums;
+    std::vector<const float*> rows;
+    std::vector<float> row_weights;
+  };
+
+  // One per thread: the bands a pool worker runs one after the other share it
+  RowScratch& threadRowScratch() {
+    thread_local RowScratch scratch;
+    return scratch;
+  }
+
+  // filterRows specialized for a sample type, channel count, threshold and
+  // border mode, so that none of them is tested per texel
+  template <typename T, int Channels, bool Threshold, BorderMode Border>
+  void filterRows(const unsigned char *input, unsigned char *output, const ImageLayout& layout,
+                  const FilterParams& params, const std::vector<float>& weights,
+                  const Kernels& kernels, int row_begin, int row_end) {
+    const int radius = params.radius;
+    const int taps = 2 * radius + 1;
+    const size_t count = static_cast<size_t>(layout.width) * Channels;
+    const size_t padding = static_cast<size_t>(radius) * Channels;
+
+    auto& scratch = threadRowScratch();
+    scratch.padded_row.assign(count + 2 * padding, 0.0f);
+    scratch.ring.resize(taps * count);
+    scratch.sums.resize(count);
+    scratch.rows.resize(taps);
+    scratch.row_weights.resize(taps);
+    auto& padded_row = scratch.padded_row;
+    auto& ring = scratch.ring;
+    auto& sums = scratch.sums;
+    auto& rows = scratch.rows;
+    auto& row_weights = scratch.row_weights;
+
+    auto horizontalPass = [&](int y) {
+      loadRow(reinterpret_cast<const T*>(input + y * layout.stride), padded_row.data() + padding,
+              count);
+      if (Border == BorderMode::Clamp)
+        clampRowBorder<Channels>(padded_row.data(), count, padding);
+      kernels.horizontal_row(padded_row.data(), weights.data(), taps, Channels,
+                             ring.data() + (y % taps) * count, count);
+    };
+
+    // Prime the ring with the rows above the first output row
+    int next_row = std::max(row_begin - radius, 0);
+    for (; next_row < std::min(row_begin + radius, layout.height); ++next_row)
+      horizontalPass(next_row);
+
+    for (int y = row_begin; y < row_end; ++y) {
+      if (next_row < std::min(y + radius + 1, layout.height))
+        horizontalPass(next_row++);
+
+      // Rows outside of the image don't contribute, as in the shaders, or
+      // repeat the edge ones, which are still in the ring
+      int used_taps = 0;
+      for (int j = -radius; j <= radius; ++j) {
+        int row = y + j;
+        if (Border == BorderMode::Clamp)
+          row = std::min(std::max(row, 0), layout.height - 1);
+        else if (row < 0 || row >= layout.height)
+          continue;
+        rows[used_taps] = ring.data() + (row % taps) * count;
+        row_weights[used_taps] = weights[j + radius];
+        ++used_taps;
+      }
+      kernels.vertical_row(rows.data(), row_weights.data(), used_taps, sums.data(), count);
+
+      storeRow<T, Channels, Threshold>(sums.data(), reinterpret_cast<T*>(output + y * layout.stride),
+                                       layout.width, params);
+    }
+  }
+
+  template <typename T, int Channels, bool Threshold>
+  void filterRows(const unsigned char *input, unsigned char *output, const ImageLayout& layout,
+                  const FilterParams& params, const std::vector<float>& weights,
+                  const Kernels& kernels, int row_begin, int row_end) {
+    if (params.border == BorderMode::Clamp)
+      filterRows<T, Channels, Threshold, BorderMode::Clamp>(input, output, layout, params, weights,
+                                                           kernels, row_begin, row_end);
+    else
+      filterRows<T, Channels, Threshold, BorderMode::Zero>(input, output, layout, params, weights,
+                                                          kernels, row_begin, row_end);
+  }
+
+  template <typename T, int Channels>
+  void filterRows(const unsigned char *input, unsigned char *output, const ImageLayout& layout,
+                  const FilterParams& params, const std::vector<float>& weights,
+                  const Kernels& kernels, int row_begin, int row_end) {
+    if (params.thresholdEnabled())
+      filterRows<T, Channels, true>(input, output, layout, params, weights, kernels, row_begin,
+                                    row_end);
+    else
+      filterRows<T, Channels, false>(input, output, layout, params, weights, kernels, row_begin,
+                                     row_end);
+  }
+
+  template <typename T>
+  void filterRows(const unsigned char *input, unsigned char *output, const ImageLayout& layout,
+                  const FilterParams& params, const std::vector<float>& weights,
+                  const Kernels& kernels, int row_begin, int row_end) {
+    if (layout.channels == 4)
+      filterRows<T, 4>(input, output, layout, params, weights, kernels, row_begin, row_end);
+    else
+      filterRows<T, 3>(input, output, layout, params, weights, kernels, row_begin, row_end);
+  }
+
+  // Filters rows [row_begin; row_end) of 'input' into the same rows of
+  // 'output'. Rows outside of the range are read (up to radius of them) but
+  // never written, so disjoint ranges can be processed independently.
+  // 'weights' are gaussianKernel1D(params.radius, params.sigma), computed
+  // once by the caller rather than for every range.
+  void filterRows(const unsigned char *input, unsigned char *output, const ImageLayout& layout,
+                  const FilterParams& params, const std::vector<float>& weights,
+                  const Kernels& kernels, int row_begin, int row_end) {
+    if (layout.channel_bytes == 2)
+      filterRows<uint16_t>(input, output, layout, params, weights, kernels, row_begin, row_end);
+    else
+      filterRows<uint8_t>(input, output, layout, params, weights, kernels, row_begin, row_end);
+  }
+
+} // namespace cpu_filter
+
+// Filters an 8 or 16-bit RGB or RGBA image laid out as 'layout' describes. 'output'
+// is resized to match 'input'.
+void gaussianFilterImage(const std::vector<unsigned char>& input, std::vector<unsigned char>& output,
+                         const ImageLayout& layout, const FilterParams& params,
+                         CpuKernel kernel = CpuKernel::Auto) {
+  cpu_filter::checkLayout(layout);
+  if (input.size() < layout.size())
+    throw std::invalid_argument("Image buffer smaller than its layout");
+
+  cpu_filter::checkIterations(params);
+
+  auto kernels = cpu_filter::selectKernels(kernel);
+  const auto weights = gaussianKernel1D(params.radius, params.sigma);
+  output.resize(input.size());
+  std::vector<unsigned char> scratch(params.iterations > 1 ? input.size() : 0);
+  cpu_filter::runIterations(0, input.data(), output.data(), scratch.data(), params,
+                            [&](const unsigned char *in, unsigned char *out, const FilterParams& pass_params) {
+    cpu_filter::filterRows(in, out, layout, pass_params, weights, kernels, 0, layout.height);
+  });
+}
+
+// Bytes of input a band of rows should span, so that a band and its halo stay
+// in a core's share of L2
+constexpr const size_t cpu_filter_band_bytes = 256 * 1024;
+
+namespace cpu_filter {
+
+  // Rows per band of the multithreaded filters. Every band recomputes the
+  // horizontal pass of its 2 * radius halo rows, keep bands tall enough for
+  // that to stay a small fraction of the work.
+  int bandRows(const ImageLayout& layout, const FilterParams& params) {
+    const int taps = 2 * params.radius + 1;
+    int band_rows = std::max(static_cast<int>(cpu_filter_band_bytes / layout.stride), 4 * taps);
+    return std::max(std::min(band_rows, layout.height), 1);
+  }
+
+  // Filters the whole image as bands on 'pool', and waits for them
+  void filterBands(const unsigned char *input, unsigned char *output, const ImageLayout& layout,
+                   const FilterParams& params, const std::vector<float>& weights,
+                   const Kernels& kernels, ThreadPool& pool) {
+    const int band_rows = bandRows(layout, params);
+    const size_t bands = (layout.height + band_rows - 1) / band_rows;
+
+    pool.parallelFor(bands, [&](size_t band) {
+      int row_begin = static_cast<int>(band) * band_rows;
+      int row_end = std::min(row_begin + band_rows, layout.height);
+      filterRows(input, output, layout, params, weights, kernels, row_begin, row_end);
+    });
+  }
+
+} // namespace cpu_filter
+
+// Multithreaded version of gaussianFilterImage. The image is split into row
+// bands that are filtered as independent tasks on 'pool'. Every band reads
+// 'radius' halo rows above and below itself but only writes its own rows, so
+// workers never touch the same part of 'output'.
+void gaussianFilterImage(const std::vector<unsigned char>& input, std::vector<unsigned char>& output,
+                         const ImageLayout& layout, const FilterParams& params, ThreadPool& pool,
+                         CpuKernel kernel = CpuKernel::Auto) {
+  cpu_filter::checkLayout(layout);
+  if (input.size() < layout.size())
+    throw std::invalid_argument("Image buffer smaller than its layout");
+
+  cpu_filter::checkIterations(params);
+
+  auto kernels = cpu_filter::selectKernels(kernel);
+  const auto weights = gaussianKernel1D(params.radius, params.sigma);
+  output.resize(input.size());
+  std::vector<unsigned char> scratch(params.iterations > 1 ? input.size() : 0);
+  cpu_filter::runIterations(0, input.data(), output.data(), scratch.data(), params,
+                            [&](const unsigned char *in, unsigned char *out, const FilterParams& pass_params) {
+    cpu_filter::filterBands(in, out, layout, pass_params, weights, kernels, pool);
+  });
+}
+
+// Filters an image while it's being produced, e.g. decoded, from the top row
+// down. Every time more input rows are complete, the row bands whose input
+// (halo included) is now available are queued on 'pool', so filtering the top
+// of the image overlaps with producing the bottom. 'input' and 'output' must
+// stay alive, and 'output' must not be read, until finish() returned.
+//
+// With more than one iteration only the first one is streamed, finish() runs
+// the others once the whole image is available. The iterations alternate
+// between 'output' and a scratch image, 'scratch' when not null (it must then
+// hold layout.size() bytes and stay alive as long as 'output').
+class StreamingImageFilter {
+public:
+  // With 'bottom_up' the top row of the image is the last one of the buffers,
+  // as loadPNGFromFile lays them out
+  StreamingImageFilter(const unsigned char *input, unsigned char *output, const ImageLayout& layout,
+                       const FilterParams& params, ThreadPool& pool, bool bottom_up,
+                       unsigned char *scratch = nullptr, CpuKernel kernel = CpuKernel::Auto)
+    : input(input), output(output), layout(layout), params(params), pool(pool),
+      bottom_up(bottom_up), kernels(cpu_filter::selectKernels(kernel)),
+      weights(gaussianKernel1D(params.radius, params.sigma)), // Throws on invalid parameters
+      band_rows(cpu_filter::bandRows(layout, params)), scratch(scratch) {
+    cpu_filter::checkLayout(layout);
+    cpu_filter::checkIterations(params);
+    if (params.iterations > 1) {
+      if (this->scratch == nullptr) {
+        own_scratch.resize(layout.size());
+        this->scratch = own_scratch.data();
+      }
+      first_params = cpu_filter::blurOnly(params);
+    } else {
+      first_params = params;
+    }
+    first_output = cpu_filter::iterationOutput(0, params, output, this->scratch);
+  }
+
+  StreamingImageFilter(const StreamingImageFilter&) = delete;
+  StreamingImageFilter& operator=(const StreamingImageFilter&) = delete;
+
+  // The bands still running reference this object
+  ~StreamingImageFilter() {
+    wait();
+  }
+
+  // The top 'rows' rows of the input are complete
+  void rowsAvailable(int rows) {
+    rows = std::min(rows, layout.height);
+    while (next_band_row < layout.height) {
+      int band_end = std::min(next_band_row + band_rows, layout.height);
+      // The band reads up to 'radius' rows below itself
+      if (rows < std::min(band_end + params.radius, layout.height))
+        break;
+      submitBand(next_band_row, band_end);
+      next_band_row = band_end;
+    }
+  }
+
+  // Filters the remaining bands, all the input must be complete, and waits
+  // for every band. The first exception thrown by a band is rethrown here.
+  void finish() {
+    rowsAvailable(layout.height);
+    wait();
+    if (error)
+      std::rethrow_exception(error);
+
+    cpu_filter::runIterations(1, input, output, scratch, params,
+                              [&](const unsigned char *in, unsigned char *out, const FilterParams& pass_params) {
+      cpu_filter::filterBands(in, out, layout, pass_params, weights, kernels, pool);
+    });
+  }
+
+  // Time spent filtering the streamed iteration by the pool's threads
+  std::chrono::nanoseconds busyTime() const {
+    return std::chrono::nanoseconds(busy_ns.load());
+  }
+
+private:
+
+  // Rows [row_begin; row_end) counted from the top of the image
+  void submitBand(int row_begin, int row_end) {
+    if (bottom_up) {
+      std::swap(row_begin, row_end);
+      row_begin = layout.height - row_begin;
+      row_end = layout.height - row_end;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++outstanding;
+    }
+    pool.submit([this, row_begin, row_end] {
+      auto begin = std::chrono::steady_clock::now();
+      std::exception_ptr band_error;
+      try {
+        cpu_filter::filterRows(input, first_output, layout, first_params, weights, kernels,
+                               row_begin, row_end);
+      } catch (...) {
+        band_error = std::current_exception();
+      }
+      busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (band_error && !error)
+        error = band_error;
+      if (--outstanding == 0)
+        done.notify_all();
+    });
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return outstanding == 0; });
+  }
+
+  const unsigned char *input;
+  unsigned char *output;
+  const ImageLayout layout;
+  const FilterParams params;
+  ThreadPool& pool;
+  const bool bottom_up;
+  const cpu_filter::Kernels kernels;
+  const std::vector<float> weights; // Shared by every band and iteration
+  const int band_rows;
+  int next_band_row = 0; // Top row of the next band to submit
+  unsigned char *scratch; // Only with more than one iteration
+  std::vector<unsigned char> own_scratch; // When the caller gave no scratch
+  FilterParams first_params; // Of the streamed iteration
+  unsigned char *first_output; // 'output' or 'scratch'
+
+  std::mutex mutex;
+  std::condition_variable done;
+  int outstanding = 0; // Bands submitted and not finished yet
+  std::exception_ptr error;
+  std::atomic<int64_t> busy_ns{ 0 };
+};
+
+#endif // HEADER_CPUFILTER_HPP
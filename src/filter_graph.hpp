@@ -0,0 +1,704 @@
+#ifndef HEADER_FILTERGRAPH_HPP
+#define HEADER_FILTERGRAPH_HPP
+
+#include <GLXW/glxw.h>
+#include "shader_utils.hpp"
+#include "gl_error_check.hpp"
+#include "gpu_profiler.hpp"
+#include "gl_objects.hpp"
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Caveat: as for the shader classes, a valid GL context must be current
+
+// Internal format of level 0 of 'texture', bound to 'target'
+GLenum textureInternalFormat(GLuint texture, GLenum target = GL_TEXTURE_2D) {
+  GLint internal_format = 0;
+  GL_ERROR_CHECK(glBindTexture(target, texture));
+  GL_ERROR_CHECK(glGetTexLevelParameteriv(target, 0, GL_TEXTURE_INTERNAL_FORMAT,
+                                          &internal_format));
+  GL_ERROR_CHECK(glBindTexture(target, 0));
+  return static_cast<GLenum>(internal_format);
+}
+
+// GLSL format qualifier of the images bound with 'internal_format'
+const char *imageFormatQualifier(GLenum internal_format) {
+  switch (internal_format) {
+    case GL_RGBA8:
+      return "rgba8";
+    case GL_RGBA16:
+      return "rgba16";
+    case GL_RGBA16F:
+      return "rgba16f";
+    case GL_RGBA32F:
+      return "rgba32f";
+    default:
+      throw std::invalid_argument("Texture format can't be filtered, use an RGBA format");
+  }
+}
+
+// Bytes per texel of the formats imageFormatQualifier() accepts
+size_t texelBytes(GLenum internal_format) {
+  switch (internal_format) {
+    case GL_RGBA8:
+      return 4;
+    case GL_RGBA16:
+    case GL_RGBA16F:
+      return 8;
+    case GL_RGBA32F:
+      return 16;
+    default:
+      throw std::invalid_argument("Texture format can't be filtered, use an RGBA format");
+  }
+}
+
+// Rectangle of texels, row 0 being the first row of the texture
+struct ImageRegion {
+  int x = 0;
+  int y = 0;
+  int width = 0;
+  int height = 0;
+
+  bool empty() const {
+    return width <= 0 || height <= 0;
+  }
+
+  // Grown by 'dx' texels left and right and 'dy' texels above and below
+  ImageRegion grown(int dx, int dy) const {
+    return { x - dx, y - dy, width + 2 * dx, height + 2 * dy };
+  }
+
+  // Intersection with a width x height image
+  ImageRegion clipped(int image_width, int image_height) const {
+    const int left = std::max(x, 0), top = std::max(y, 0);
+    const int right = std::min(x + width, image_width);
+    const int bottom = std::min(y + height, image_height);
+    return { left, top, std::max(right - left, 0), std::max(bottom - top, 0) };
+  }
+
+  // Smallest region holding both
+  ImageRegion united(const ImageRegion& other) const {
+    if (empty())
+      return other;
+    if (other.empty())
+      return *this;
+    const int left = std::min(x, other.x), top = std::min(y, other.y);
+    const int right = std::max(x + width, other.x + other.width);
+    const int bottom = std::max(y + height, other.y + other.height);
+    return { left, top, right - left, bottom - top };
+  }
+
+  bool overlaps(const ImageRegion& other) const {
+    return !empty() && !other.empty() && x < other.x + other.width && other.x < x + width &&
+           y < other.y + other.height && other.y < y + height;
+  }
+};
+
+// Recycles textures, keyed by size and internal format: a released texture is
+// handed out again to the next request of the same size and format, so in
+// steady state running a graph, or a batch of same size images, allocates
+// nothing. Released textures are kept until trim() deletes the oldest ones
+// beyond a budget of idle bytes, the rest are deleted with the pool.
+//
+// Pooled textures have a single level of immutable storage and nearest
+// filtering, they're meant for image load/store and readbacks. 2D array
+// textures are pooled too, keyed by their number of layers as well.
+class TexturePool {
+public:
+  // Requests served by a released texture, and by a new one
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t textures = 0; // Created so far, in use or not
+    size_t bytes = 0; // Of every texture created
+    size_t trimmed_bytes = 0; // Of the textures deleted by trim()
+  };
+
+  TexturePool() = default;
+  TexturePool(const TexturePool&) = delete;
+  TexturePool& operator=(const TexturePool&) = delete;
+
+  GLuint acquire(int width, int height, GLenum internal_format) {
+    return acquireTexture(width, height, 0, internal_format);
+  }
+
+  // A GL_TEXTURE_2D_ARRAY of 'layers' width x height images
+  GLuint acquireArray(int width, int height, int layers, GLenum internal_format) {
+    if (layers < 1)
+      throw std::out_of_range("An array texture needs at least one layer");
+    return acquireTexture(width, height, layers, internal_format);
+  }
+
+  void release(GLuint id) {
+    for (auto& texture : textures) {
+      if (texture.texture.get() == id)
+        texture.in_use = false;
+    }
+  }
+
+  // Textures held, in use or not
+  size_t allocationsCount() const {
+    return textures.size();
+  }
+
+  // Deletes the oldest textures not in use until those left take at most
+  // 'max_idle_bytes', e.g. between batches of other sizes, since the pool
+  // otherwise keeps every texture it ever created. Returns the bytes freed.
+  size_t trim(size_t max_idle_bytes = 0) {
+    size_t idle_bytes = 0;
+    for (auto& texture : textures) {
+      if (texture.in_use == false)
+        idle_bytes += textureBytes(texture);
+    }
+    size_t freed_bytes = 0;
+    for (auto texture = textures.begin(); texture != textures.end() && idle_bytes > max_idle_bytes;) {
+      if (texture->in_use) {
+        ++texture;
+        continue;
+      }
+      const size_t bytes = textureBytes(*texture);
+      idle_bytes -= bytes;
+      freed_bytes += bytes;
+      texture = textures.erase(texture); // Deletes the GL texture
+    }
+    stats.trimmed_bytes += freed_bytes;
+    return freed_bytes;
+  }
+
+  const Stats& statistics() const {
+    return stats;
+  }
+
+private:
+  struct Texture {
+    GLTexture texture;
+    int width;
+    int height;
+    int layers; // 0 for a GL_TEXTURE_2D
+    GLenum internal_format;
+    bool in_use;
+  };
+
+  static size_t textureBytes(const Texture& texture) {
+    return static_cast<size_t>(texture.width) * texture.height * std::max(texture.layers, 1) *
+           texelBytes(texture.internal_format);
+  }
+
+  GLuint acquireTexture(int width, int height, int layers, GLenum internal_format) {
+    for (auto& texture : textures) {
+      if (texture.in_use == false && texture.width == width && texture.height == height &&
+          texture.layers == layers && texture.internal_format == internal_format) {
+        texture.in_use = true;
+        ++stats.hits;
+        return texture.texture.get();
+      }
+    }
+
+    Texture texture{ GLTexture::create(), width, height, layers, internal_format, true };
+    const GLenum target = layers ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+    GL_ERROR_CHECK(glBindTexture(target, texture.texture.get()));
+    if (layers)
+      GL_ERROR_CHECK(glTexStorage3D(target, 1, internal_format, width, height, layers));
+    else
+      GL_ERROR_CHECK(glTexStorage2D(target, 1, internal_format, width, height));
+    // Never sampled, but an incomplete texture can't be bound as an image
+    GL_ERROR_CHECK(glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL_ERROR_CHECK(glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL_ERROR_CHECK(glBindTexture(target, 0));
+    ++stats.misses;
+    ++stats.textures;
+    stats.bytes += textureBytes(texture);
+    textures.push_back(std::move(texture));
+    return textures.back().texture.get();
+  }
+
+  std::vector<Texture> textures;
+  Stats stats;
+};
+
+// Declared in every pass, see FilterGraph. The IMAGE_ macros access the
+// images of a pass whether they're 2D textures or, when LAYERED is defined,
+// 2D array textures whose layer gl_GlobalInvocationID.z works on.
+const std::string pass_prelude_source = { R"(
+uniform ivec2 region_origin;
+uniform ivec2 region_end;
+
+#ifdef LAYERED
+#define IMAGE image2DArray
+#define IMAGE_COORDS(coords) ivec3(coords, int(gl_GlobalInvocationID.z))
+#define IMAGE_SIZE(image) imageSize(image).xy
+#else
+#define IMAGE image2D
+#define IMAGE_COORDS(coords) (coords)
+#define IMAGE_SIZE(image) imageSize(image)
+#endif
+#define IMAGE_LOAD(image, coords) imageLoad(image, IMAGE_COORDS(coords))
+#define IMAGE_STORE(image, coords, color) imageStore(image, IMAGE_COORDS(coords), color)
+)" };
+
+// Runs the pointwise nodes of a pass on their own
+const std::string pointwise_computeshader_source = { R"(
+
+#version 430
+
+layout (local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y) in;
+
+uniform layout(INPUT_FORMAT, binding = 0) readonly IMAGE input_texture;
+uniform layout(OUTPUT_FORMAT, binding = 1) writeonly IMAGE output_texture;
+
+void main() {
+  ivec2 texelCoords = ivec2(gl_GlobalInvocationID.xy) + region_origin;
+  if (any(greaterThanEqual(texelCoords, region_end)))
+    return;
+
+  IMAGE_STORE(output_texture, texelCoords, POINTWISE(IMAGE_LOAD(input_texture, texelCoords)));
+}
+
+)" };
+
+// A chain (or any DAG) of compute passes with declared inputs and outputs.
+//
+// Nodes are added in execution order and produce one image each, identified
+// by the returned Resource; FilterGraph::input is the image the graph runs on
+// and the last node added writes the graph's output. Two kinds of nodes exist:
+//
+// - Passes run a compute shader. Its inputs are bound as images 0..n-1 (format
+//   qualifiers INPUT0_FORMAT.., INPUT_FORMAT for the first one), its output as
+//   image n (OUTPUT_FORMAT), and it must store its result through the
+//   POINTWISE(color) macro. Images are declared of type IMAGE and accessed
+//   with IMAGE_LOAD, IMAGE_STORE and IMAGE_SIZE, so that the same pass runs on
+//   the layers of array textures (see runLayers()). A pass is dispatched over
+//   a region of the image:
+//   invocation gl_GlobalInvocationID.xy computes texel
+//   gl_GlobalInvocationID.xy + region_origin, and none at or past region_end
+//   (ivec2 uniforms declared by the graph). Its halo is how far from a texel
+//   its inputs are read, run() uses it to find the regions to dispatch.
+// - Pointwise nodes are a per-texel function 'vec4 NODE_apply(vec4 color)',
+//   where every NODE_ identifier is renamed to be unique in the program. A
+//   pointwise node whose input is only read by it is fused into the pass
+//   producing that input: it runs in the pass's POINTWISE() macro, saving a
+//   full read and write of the image. Otherwise it runs as its own pass.
+//
+// Intermediate images come from a TexturePool and go back to it right after
+// their last reader ran, so later passes reuse them.
+//
+// run() can also recompute only some regions of the output: when the input
+// changed within a region, affectedRegion() is what to recompute. Every pass
+// is then dispatched over the texels these regions depend on only.
+//
+// runLayers() filters many images of the same size at once, each in a layer
+// of an array texture: every pass is a single dispatch over all of them.
+class FilterGraph {
+public:
+  using Resource = int;
+  static constexpr Resource input = 0;
+
+  // Texels read around each output texel, on either side. Halo() is none.
+  struct Halo {
+    int x;
+    int y;
+  };
+
+  // Format of the image a node writes, when it's not the graph's output
+  enum class Storage {
+    Output, // Same as the output texture
+    Float   // Unquantized: half floats for 8-bit images, floats for deeper ones
+  };
+
+  // Sets the uniforms of a node on its program, whose names are prefixed with
+  // 'prefix' for pointwise nodes (the NODE_ renaming)
+  using UniformSetter = std::function<void(GLuint program, const std::string& prefix)>;
+
+  FilterGraph() = default;
+  FilterGraph(const FilterGraph&) = delete;
+  FilterGraph& operator=(const FilterGraph&) = delete;
+
+  // Removes every node. Compiled programs and pooled textures are kept.
+  void clear() {
+    nodes.clear();
+  }
+
+  Resource addPass(const std::string& name, const std::string& source,
+                   std::vector<Resource> inputs, UniformSetter set_uniforms = {},
+                   ShaderDefines defines = {}, Storage storage = Storage::Output,
+                   Halo halo = Halo()) {
+    if (inputs.empty())
+      throw std::invalid_argument("Pass " + name + " has no inputs");
+    Node node;
+    node.name = name;
+    node.source = source;
+    node.inputs = std::move(inputs);
+    node.set_uniforms = std::move(set_uniforms);
+    node.defines = std::move(defines);
+    node.storage = storage;
+    node.halo = halo;
+    return addNode(std::move(node));
+  }
+
+  Resource addPointwise(const std::string& name, const std::string& function_source,
+                        Resource source, UniformSetter set_uniforms = {}) {
+    Node node;
+    node.name = name;
+    node.source = function_source;
+    node.inputs = { source };
+    node.set_uniforms = std::move(set_uniforms);
+    node.pointwise = true;
+    return addNode(std::move(node));
+  }
+
+  // Runs the graph on 'input_texture' into 'output_texture', both of size
+  // width x height and of any format imageFormatQualifier() accepts
+  void run(GLuint input_texture, GLuint output_texture, int width, int height) {
+    run(input_texture, output_texture, width, height, { ImageRegion{ 0, 0, width, height } });
+  }
+
+  // Same as above, only writing 'regions' of 'output_texture'
+  void run(GLuint input_texture, GLuint output_texture, int width, int height,
+           const std::vector<ImageRegion>& regions) {
+    execute(input_texture, output_texture, width, height, 0, regions);
+  }
+
+  // Runs the graph on the first 'layers' layers of 'input_texture' into the
+  // same layers of 'output_texture', 2D array textures of width x height
+  // layers. Intermediates are array textures of 'layers' layers.
+  void runLayers(GLuint input_texture, GLuint output_texture, int width, int height,
+                 int layers) {
+    if (layers < 1)
+      throw std::out_of_range("Nothing to run on, layers must be at least one");
+    execute(input_texture, output_texture, width, height, layers,
+            { ImageRegion{ 0, 0, width, height } });
+  }
+
+  // Region of the output that changes when the input of a width x height
+  // image changes within 'changed'
+  ImageRegion affectedRegion(const ImageRegion& changed, int width, int height) const {
+    // Region of every resource depending on 'changed'
+    std::vector<ImageRegion> affected(nodes.size() + 1);
+    affected[input] = changed.clipped(width, height);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      const Node& node = nodes[i];
+      for (auto resource : node.inputs) {
+        affected[i + 1] = affected[i + 1].united(
+          affected[resource].grown(node.halo.x, node.halo.y).clipped(width, height));
+      }
+    }
+    return affected[nodes.size()];
+  }
+
+  void setWorkGroupSize(int x, int y) {
+    if (x <= 0 || y <= 0 || x * y > 1024) // GL 4.3 guarantees at least 1024 invocations
+      throw std::out_of_range("Invalid work group size");
+    work_group_size_x = x;
+    work_group_size_y = y;
+  }
+
+  int workGroupSizeX() const {
+    return work_group_size_x;
+  }
+
+  int workGroupSizeY() const {
+    return work_group_size_y;
+  }
+
+  // Dispatches of the last run(), fused pointwise nodes don't count
+  size_t passesCount() const {
+    return passes_count;
+  }
+
+  // Dispatches since the graph was created, one per pass and region
+  size_t dispatchesCount() const {
+    return dispatches_count;
+  }
+
+  // Times every dispatch of run() as a section named after its nodes, e.g.
+  // "gaussian vertical + threshold". Null disables it.
+  void setProfiler(GpuProfiler *profiler) {
+    this->profiler = profiler;
+  }
+
+  TexturePool& texturePool() {
+    return pool;
+  }
+
+  const TexturePool& texturePool() const {
+    return pool;
+  }
+
+  ProgramCache& programCache() {
+    return programs;
+  }
+
+  const ProgramCache& programCache() const {
+    return programs;
+  }
+
+private:
+  struct Node {
+    std::string name;
+    std::string source;
+    std::vector<Resource> inputs;
+    UniformSetter set_uniforms;
+    ShaderDefines defines;
+    Storage storage = Storage::Output;
+    Halo halo = Halo();
+    bool pointwise = false;
+  };
+
+  // Nodes run by one dispatch: a pass, or 0 when the pointwise nodes run on
+  // their own, followed by the pointwise nodes fused into it in order. Node N
+  // produces resource N.
+  struct Pass {
+    Resource base;
+    std::vector<Resource> pointwise;
+
+    Resource output() const {
+      return pointwise.empty() ? base : pointwise.back();
+    }
+  };
+
+  std::string passName(const Pass& pass) const {
+    std::string name = pass.base ? nodes[pass.base - 1].name : std::string();
+    for (auto id : pass.pointwise)
+      name += (name.empty() ? "" : " + ") + nodes[id - 1].name;
+    return name;
+  }
+
+  const std::vector<Resource>& passInputs(const Pass& pass) const {
+    return nodes[(pass.base ? pass.base : pass.pointwise.front()) - 1].inputs;
+  }
+
+  Resource addNode(Node node) {
+    const Resource resource = static_cast<Resource>(nodes.size()) + 1;
+    for (auto input : node.inputs) {
+      if (input < 0 || input >= resource)
+        throw std::invalid_argument("Node " + node.name + " reads an image not produced yet");
+    }
+    nodes.push_back(std::move(node));
+    return resource;
+  }
+
+  // Pointwise nodes write what their input is stored as
+  Storage storageOf(Resource resource) const {
+    while (resource != input && nodes[resource - 1].pointwise)
+      resource = nodes[resource - 1].inputs.front();
+    return resource == input ? Storage::Output : nodes[resource - 1].storage;
+  }
+
+  static std::string nodePrefix(Resource resource) {
+    return "node" + std::to_string(resource) + "_";
+  }
+
+  static std::string renameNode(std::string source, const std::string& prefix) {
+    static const std::string placeholder = "NODE_";
+    for (auto at = source.find(placeholder); at != std::string::npos;
+         at = source.find(placeholder, at + prefix.size()))
+      source.replace(at, placeholder.size(), prefix);
+    return source;
+  }
+
+  // Runs the graph over 'regions', on 2D textures when 'layers' is 0 and on
+  // that many layers of 2D array textures otherwise
+  void execute(GLuint input_texture, GLuint output_texture, int width, int height, int layers,
+               const std::vector<ImageRegion>& regions) {
+    if (nodes.empty())
+      throw std::logic_error("Filter graph has no nodes");
+
+    auto passes = plan();
+    auto pass_regions = dispatchRegions(passes, regions, width, height);
+    const Resource output = static_cast<Resource>(nodes.size());
+    const GLenum target = layers ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+    const GLenum input_format = textureInternalFormat(input_texture, target);
+    const GLenum output_format = textureInternalFormat(output_texture, target);
+
+    // Textures and formats of the resources, and index of the last pass
+    // reading each one
+    std::vector<GLuint> textures(nodes.size() + 1, 0);
+    std::vector<GLenum> formats(nodes.size() + 1, 0);
+    std::vector<size_t> last_use(nodes.size() + 1, 0);
+    textures[input] = input_texture;
+    formats[input] = input_format;
+    for (size_t i = 0; i < passes.size(); ++i) {
+      for (auto resource : passInputs(passes[i]))
+        last_use[resource] = i;
+    }
+
+    for (size_t i = 0; i < passes.size(); ++i) {
+      const Pass& pass = passes[i];
+      const auto& inputs = passInputs(pass);
+      const Resource result = pass.output();
+
+      if (result == output) {
+        textures[result] = output_texture;
+        formats[result] = output_format;
+      } else {
+        GLenum format = output_format;
+        if (storageOf(result) == Storage::Float)
+          format = (input_format == GL_RGBA8 && output_format == GL_RGBA8) ? GL_RGBA16F : GL_RGBA32F;
+        textures[result] = layers ? pool.acquireArray(width, height, layers, format)
+                                  : pool.acquire(width, height, format);
+        formats[result] = format;
+      }
+
+      ShaderDefines defines = pass.base ? nodes[pass.base - 1].defines : ShaderDefines();
+      for (size_t binding = 0; binding < inputs.size(); ++binding)
+        defines.emplace_back("INPUT" + std::to_string(binding) + "_FORMAT",
+                             imageFormatQualifier(formats[inputs[binding]]));
+      defines.emplace_back("INPUT_FORMAT", imageFormatQualifier(formats[inputs.front()]));
+      defines.emplace_back("OUTPUT_FORMAT", imageFormatQualifier(formats[result]));
+      defines.emplace_back("LOCAL_SIZE_X", std::to_string(work_group_size_x));
+      defines.emplace_back("LOCAL_SIZE_Y", std::to_string(work_group_size_y));
+      if (layers)
+        defines.emplace_back("LAYERED", "1");
+      // The fused functions are applied in order to the stored color
+      std::string prelude = pass_prelude_source, pointwise = "color";
+      for (auto id : pass.pointwise) {
+        prelude += renameNode(nodes[id - 1].source, nodePrefix(id)) + "\n";
+        pointwise = nodePrefix(id) + "apply(" + pointwise + ")";
+      }
+      defines.emplace_back("POINTWISE(color)", "(" + pointwise + ")");
+
+      const std::string& source = pass.base ? nodes[pass.base - 1].source
+                                            : pointwise_computeshader_source;
+      // The fused functions go first, the shader loader puts the defines above them
+      auto fused_source = specializeShaderSource(source, {}, prelude);
+      GLuint program = programs.get({ { GL_COMPUTE_SHADER, fused_source, defines } }).getId();
+      GL_ERROR_CHECK(glUseProgram(program));
+
+      // Loads and stores are normalized to [0;1] whatever the formats are.
+      // Array textures are bound with all their layers.
+      const GLboolean layered = layers ? GL_TRUE : GL_FALSE;
+      GLuint binding = 0;
+      for (auto resource : inputs)
+        GL_ERROR_CHECK(glBindImageTexture(binding++, textures[resource], 0, layered, 0,
+                                          GL_READ_ONLY, formats[resource]));
+      GL_ERROR_CHECK(glBindImageTexture(binding, textures[result], 0, layered, 0, GL_WRITE_ONLY,
+                                        formats[result]));
+      if (pass.base && nodes[pass.base - 1].set_uniforms)
+        nodes[pass.base - 1].set_uniforms(program, std::string());
+      for (auto id : pass.pointwise) {
+        if (nodes[id - 1].set_uniforms)
+          nodes[id - 1].set_uniforms(program, nodePrefix(id));
+      }
+
+      {
+        GpuProfileScope scope(profiler, profiler ? passName(pass) : std::string());
+        // Every pass reads what the previous ones wrote
+        if (i > 0)
+          GL_ERROR_CHECK(glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT));
+        GLint origin_loc, end_loc;
+        GL_ERROR_CHECK(origin_loc = glGetUniformLocation(program, "region_origin"));
+        GL_ERROR_CHECK(end_loc = glGetUniformLocation(program, "region_end"));
+        for (auto& region : pass_regions[i]) {
+          GL_ERROR_CHECK(glUniform2i(origin_loc, region.x, region.y));
+          GL_ERROR_CHECK(glUniform2i(end_loc, region.x + region.width, region.y + region.height));
+          GL_ERROR_CHECK(glDispatchCompute(
+            (region.width + work_group_size_x - 1) / work_group_size_x,
+            (region.height + work_group_size_y - 1) / work_group_size_y,
+            std::max(layers, 1)));
+          ++dispatches_count;
+        }
+      }
+
+      // Recycle the intermediates no later pass reads
+      for (auto resource : inputs) {
+        if (resource != input && last_use[resource] == i)
+          pool.release(textures[resource]);
+      }
+    }
+    GL_ERROR_CHECK(glUseProgram(0));
+
+    // Make the image stores visible to whoever samples, copies or reads the
+    // output next, including the first pass of the next run (which gets no
+    // barrier of its own)
+    GL_ERROR_CHECK(glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT |
+                                   GL_SHADER_IMAGE_ACCESS_BARRIER_BIT));
+    passes_count = passes.size();
+  }
+
+  // Regions every pass is dispatched over so that 'output_regions' of the
+  // output are right, walking the passes from the last one: a pass computes
+  // what its readers read of its output, grown by its halo for its inputs.
+  // Every output region gets its own dispatches, without any texel of the
+  // output outside of them.
+  std::vector<std::vector<ImageRegion>> dispatchRegions(const std::vector<Pass>& passes,
+                                                        const std::vector<ImageRegion>& output_regions,
+                                                        int width, int height) const {
+    std::vector<std::vector<ImageRegion>> pass_regions(passes.size());
+    for (auto& output_region : output_regions) {
+      // Needed region of every resource for this output region
+      std::vector<ImageRegion> needed(nodes.size() + 1);
+      needed[nodes.size()] = output_region.clipped(width, height);
+      for (size_t i = passes.size(); i > 0; --i) {
+        const Pass& pass = passes[i - 1];
+        const ImageRegion region = needed[pass.output()];
+        if (region.empty())
+          continue;
+        pass_regions[i - 1].push_back(region);
+        const Halo halo = pass.base ? nodes[pass.base - 1].halo : Halo();
+        for (auto resource : passInputs(pass))
+          needed[resource] = needed[resource].united(
+            region.grown(halo.x, halo.y).clipped(width, height));
+      }
+    }
+    return pass_regions;
+  }
+
+  // Groups the nodes into dispatches, fusing every pointwise node into the
+  // pass producing its input when nothing else reads that input. Nodes the
+  // output doesn't depend on are skipped.
+  std::vector<Pass> plan() const {
+    std::vector<bool> live(nodes.size() + 1, false);
+    live[nodes.size()] = true;
+    for (size_t i = nodes.size(); i > 0; --i) {
+      if (live[i]) {
+        for (auto resource : nodes[i - 1].inputs)
+          live[resource] = true;
+      }
+    }
+
+    std::vector<int> readers(nodes.size() + 1, 0);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      if (live[i + 1]) {
+        for (auto resource : nodes[i].inputs)
+          readers[resource]++;
+      }
+    }
+
+    std::vector<Pass> passes;
+    std::vector<size_t> producer(nodes.size() + 1, 0); // Pass writing every resource
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      const Resource resource = static_cast<Resource>(i) + 1;
+      const Node& node = nodes[i];
+      if (live[resource] == false)
+        continue;
+      const Resource source = node.inputs.front();
+      if (node.pointwise && source != input && readers[source] == 1) {
+        passes[producer[source]].pointwise.push_back(resource);
+      } else if (node.pointwise) {
+        passes.push_back({ 0, { resource } });
+      } else {
+        passes.push_back({ resource, {} });
+      }
+      producer[resource] = passes.size() - 1;
+    }
+    return passes;
+  }
+
+  std::vector<Node> nodes;
+  int work_group_size_x = 16;
+  int work_group_size_y = 16;
+  // Linked programs of every specialization the graph ran with
+  ProgramCache programs;
+  TexturePool pool;
+  GpuProfiler *profiler = nullptr;
+  size_t passes_count = 0;
+  size_t dispatches_count = 0;
+};
+
+#endif // HEADER_FILTERGRAPH_HPP
@@ -0,0 +1,76 @@
+#ifndef HEADER_FILTERPARAMS_HPP
+#define HEADER_FILTERPARAMS_HPP
+
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+// Range of valid RGB values
+struct RGB {
+  float r;
+  float g;
+  float b;
+};
+
+// Largest kernel radius supported by the separable passes. Bounded by the
+// uniform storage the weights array of the shaders takes, at 2 * radius + 1
+// floats.
+constexpr const int max_kernel_radius = 32;
+
+// What the blur reads past the edges of the image
+enum class BorderMode {
+  Zero, // Nothing: texels outside of the image don't contribute
+  Clamp // The edge texels, repeated
+};
+
+// Parameters shared by every implementation of the gaussian + threshold filter
+struct FilterParams {
+  // The defaults best match the 273-sum 5x5 kernel of the direct filter
+  int radius = 2;
+  float sigma = 1.05f;
+  BorderMode border = BorderMode::Zero;
+  // Times the blur is applied, for stronger blurs than the largest radius
+  // gives. The threshold only applies to the result of the last one.
+  int iterations = 1;
+  // Pixels whose blurred RGB value falls outside [min; max] are set to white
+  RGB min_threshold = { 0.0f, 0.0f, 0.0f };
+  RGB max_threshold = { 1.0f, 1.0f, 1.0f };
+
+  // False if the thresholds let every value through, the filters then skip
+  // the test altogether
+  bool thresholdEnabled() const {
+    return min_threshold.r > 0.0f || min_threshold.g > 0.0f || min_threshold.b > 0.0f ||
+           max_threshold.r < 1.0f || max_threshold.g < 1.0f || max_threshold.b < 1.0f;
+  }
+};
+
+// Returns the 2 * radius + 1 normalized weights of a 1D gaussian kernel.
+// Applying it horizontally and then vertically is equivalent to convolving
+// with the 2D kernel given by their outer product.
+std::vector<float> gaussianKernel1D(int radius, float sigma) {
+  if (radius < 0 || radius > max_kernel_radius)
+    throw std::out_of_range("Kernel radius out of range");
+  if (sigma <= 0.0f)
+    throw std::invalid_argument("Sigma must be positive");
+
+  std::vector<float> weights(2 * radius + 1);
+  float sum = 0.0f;
+  for (int i = -radius; i <= radius; ++i) {
+    float w = std::exp(-(i * i) / (2.0f * sigma * sigma));
+    weights[i + radius] = w;
+    sum += w;
+  }
+  for (auto& w : weights)
+    w /= sum;
+  return weights;
+}
+
+// Throws if no filter can run with 'params': no iteration, or a radius or
+// sigma gaussianKernel1D() rejects
+void checkFilterParams(const FilterParams& params) {
+  if (params.iterations < 1)
+    throw std::out_of_range("The filter needs at least one iteration");
+  gaussianKernel1D(params.radius, params.sigma);
+}
+
+#endif // HEADER_FILTERPARAMS_HPP
@@ -0,0 +1,388 @@
+#include <GLXW/glxw.h>
+#include "filter_params.hpp"
+#include "compute_filter.hpp"
+#include "cpu_filter.hpp"
+#include "gl_context.hpp"
+#include "gl_error_check.hpp"
+#include "gl_objects.hpp"
+#include "image_layout.hpp"
+#include "image_utils.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Checks the filter implementations against each other on one PNG image,
+// assets/textures/tex1.png unless another one is given. The CPU checks always
+// run, the GL ones need a headless GL 4.3 context and are skipped without
+// one. Returns 0 if every check that ran passed.
+
+// The image under test, decoded as loadPNGFromFile returns it and, once
+// there's a GL context, uploaded as the filter's input texture
+struct TestImage {
+  int width = 0;
+  int height = 0;
+  GLint format = GL_RGBA;
+  GLenum type = GL_UNSIGNED_BYTE;
+  std::vector<unsigned char> pixels;
+  GLTexture texture;
+
+  ImageLayout layout() const {
+    return ImageLayout::fromPNG(width, height, format == GL_RGBA ? 4 : 3,
+                                type == GL_UNSIGNED_SHORT ? 2 : 1);
+  }
+};
+
+void loadTestImage(const char *file_name, TestImage& image) {
+  if (loadPNGFromFile(file_name, image.width, image.height, image.format, image.type,
+                      image.pixels) == false)
+    throw std::runtime_error(std::string("Could not load ") + file_name);
+}
+
+void uploadTestImage(TestImage& image) {
+  image.texture = GLTexture::create();
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, image.texture.get()));
+  GL_ERROR_CHECK(glTexStorage2D(GL_TEXTURE_2D, 1, imageTextureFormat(image.type), image.width,
+                                image.height));
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, 0));
+  uploadTextureRegion(image.texture.get(), image.pixels.data(), image.width, image.format,
+                      image.type, ImageRegion{ 0, 0, image.width, image.height });
+}
+
+// The window's default thresholds, so that the threshold is filtered too
+FilterParams thresholdParams() {
+  FilterParams params;
+  params.min_threshold = { 0.0f, 0.0f, 0.0f };
+  params.max_threshold = { 0.5f, 1.0f, 1.0f };
+  return params;
+}
+
+// Filters the image with both the direct 5x5 kernel and 'mode' and compares
+// the results. Thresholds are disabled so that only the blur is compared.
+// Returns true if no channel differs by more than 'tolerance'.
+bool checkFilterMode(GaussianComputeFilter& filter, const TestImage& image, FilterMode mode,
+                     const char *mode_name, int tolerance) {
+  const int width = image.width, height = image.height;
+
+  // Every comparison reuses the same pooled textures
+  auto& pool = filter.texturePool();
+  GLuint textures[2];
+  for (auto& texture : textures)
+    texture = pool.acquire(width, height, imageTextureFormat(image.type));
+
+  FilterParams params; // Default thresholds let everything through
+
+  filter.apply(image.texture.get(), textures[0], width, height, params, FilterMode::Direct5x5);
+  filter.apply(image.texture.get(), textures[1], width, height, params, mode);
+
+  auto direct = readTextureRGBA8(textures[0], width, height);
+  auto filtered = readTextureRGBA8(textures[1], width, height);
+  for (auto texture : textures)
+    pool.release(texture);
+
+  int max_difference = 0;
+  for (size_t i = 0; i < direct.size(); ++i)
+    max_difference = std::max(max_difference, std::abs(direct[i] - filtered[i]));
+
+  std::cout << mode_name << " vs direct 5x5 filter: max channel difference " << max_difference
+            << " (tolerance " << tolerance << ")\n";
+  return max_difference <= tolerance;
+}
+
+FilterParams cpuParams(BorderMode border, int iterations) {
+  FilterParams params;
+  params.border = border;
+  params.iterations = iterations;
+  return params;
+}
+
+std::string cpuVariant(BorderMode border, int iterations) {
+  std::string variant = border == BorderMode::Clamp ? " (clamped border)" : "";
+  if (iterations > 1)
+    variant += " (" + std::to_string(iterations) + " iterations)";
+  return variant;
+}
+
+// Filters the image on the CPU with every kernel this machine supports, they
+// must agree exactly with the scalar one
+bool checkCpuKernels(const TestImage& image, BorderMode border, int iterations = 1) {
+  auto layout = image.layout();
+  FilterParams params = cpuParams(border, iterations);
+  const std::string variant = cpuVariant(border, iterations);
+
+  std::vector<unsigned char> reference;
+  gaussianFilterImage(image.pixels, reference, layout, params, CpuKernel::Scalar);
+
+  bool ok = true;
+  for (auto kernel : { CpuKernel::SSE2, CpuKernel::AVX2 }) {
+    std::vector<unsigned char> filtered;
+    try {
+      gaussianFilterImage(image.pixels, filtered, layout, params, kernel);
+    } catch (std::runtime_error&) {
+      continue; // Not supported by this CPU
+    }
+    bool identical = (filtered == reference);
+    std::cout << "CPU " << cpu_filter::selectKernels(kernel).name << " vs scalar kernel"
+              << variant << ": " << (identical ? "identical" : "different") << "\n";
+    ok = ok && identical;
+  }
+  return ok;
+}
+
+// Feeds the image to a StreamingImageFilter a few rows at a time, top row
+// first as the decoder does, on a pool. The result must be identical to
+// filtering the whole image at once.
+bool checkStreaming(const TestImage& image, ThreadPool& pool, BorderMode border,
+                    int iterations = 1) {
+  auto layout = image.layout();
+  FilterParams params = cpuParams(border, iterations);
+
+  std::vector<unsigned char> reference;
+  gaussianFilterImage(image.pixels, reference, layout, params);
+
+  std::vector<unsigned char> streamed(reference.size());
+  {
+    StreamingImageFilter filter(image.pixels.data(), streamed.data(), layout, params, pool, true);
+    for (int rows = 0; rows < image.height; rows += 7)
+      filter.rowsAvailable(rows);
+    filter.finish();
+  }
+
+  bool identical = (streamed == reference);
+  std::cout << "CPU streaming vs whole image" << cpuVariant(border, iterations) << ": "
+            << (identical ? "identical" : "different") << "\n";
+  return identical;
+}
+
+// Filters the image on the CPU and with the separable compute filter, they
+// must agree within 'tolerance' (in 8-bit steps) since the compute filter's
+// intermediate values are half floats for 8-bit images
+bool checkCpuFilter(GaussianComputeFilter& filter, const TestImage& image, int tolerance,
+                    BorderMode border, int iterations = 1) {
+  const int width = image.width, height = image.height;
+  auto layout = image.layout();
+  FilterParams params = cpuParams(border, iterations);
+
+  std::vector<unsigned char> reference;
+  gaussianFilterImage(image.pixels, reference, layout, params, CpuKernel::Scalar);
+
+  auto& pool = filter.texturePool();
+  GLuint output_texture = pool.acquire(width, height, imageTextureFormat(image.type));
+  filter.apply(image.texture.get(), output_texture, width, height, params, FilterMode::Separable);
+  // Read back in the image's own layout, RGB images drop the opaque alpha
+  auto gpu = readTexture(output_texture, width, height, image.format, image.type);
+  pool.release(output_texture);
+
+  int max_difference = 0;
+  if (layout.channel_bytes == 2) {
+    auto gpu16 = reinterpret_cast<const uint16_t*>(gpu.data());
+    auto reference16 = reinterpret_cast<const uint16_t*>(reference.data());
+    for (size_t i = 0; i < gpu.size() / 2; ++i)
+      max_difference = std::max(max_difference, std::abs(gpu16[i] - reference16[i]));
+    tolerance *= 257; // 65535 / 255
+  } else {
+    for (size_t i = 0; i < gpu.size(); ++i)
+      max_difference = std::max(max_difference, std::abs(gpu[i] - reference[i]));
+  }
+
+  std::cout << "CPU vs separable compute filter" << cpuVariant(border, iterations)
+            << ": max channel difference " << max_difference << " (tolerance " << tolerance
+            << ")\n";
+  return max_difference <= tolerance;
+}
+
+// Filters the image, patches two regions of it (one crossing the image's
+// edge) and refilters only the regions they affect. The result must be
+// identical to filtering the patched image from scratch.
+bool checkDirtyRegions(GaussianComputeFilter& filter, const TestImage& image, FilterMode mode,
+                       const char *mode_name) {
+  const int width = image.width, height = image.height;
+  const GLint format = image.format;
+  const GLenum type = image.type;
+  std::vector<unsigned char> image_data(image.pixels);
+
+  FilterParams params = thresholdParams();
+  params.iterations = 2;
+  PostFilters post;
+  post.morphology = Morphology::Dilate;
+
+  auto& pool = filter.texturePool();
+  const GLenum internal_format = imageTextureFormat(type);
+  GLuint input = pool.acquire(width, height, internal_format);
+  GLuint incremental = pool.acquire(width, height, internal_format);
+  GLuint reference = pool.acquire(width, height, internal_format);
+  GLuint scratch = pool.acquire(width, height, internal_format);
+  const ImageRegion whole{ 0, 0, width, height };
+  uploadTextureRegion(input, image_data.data(), width, format, type, whole);
+  filter.apply(input, incremental, width, height, params, mode, post);
+
+  // Filtering another image leaves unrelated values in the pooled
+  // intermediates, the incremental run must only read what it recomputes
+  std::vector<unsigned char> inverted(image_data);
+  for (auto& value : inverted)
+    value = static_cast<unsigned char>(~value);
+  uploadTextureRegion(reference, inverted.data(), width, format, type, whole);
+  filter.apply(reference, scratch, width, height, params, mode, post);
+
+  // Inverts the patched regions, rows are 4-byte aligned
+  auto layout = image.layout();
+  const size_t pixel_bytes = layout.channels * layout.channel_bytes;
+  std::vector<ImageRegion> dirty = {
+    ImageRegion{ width / 4, height / 3, width / 5 + 1, height / 7 + 1 }.clipped(width, height),
+    ImageRegion{ width - width / 6, height / 2, width, 9 }.clipped(width, height)
+  };
+  for (auto& region : dirty) {
+    for (int y = region.y; y < region.y + region.height; ++y) {
+      unsigned char *row = image_data.data() + y * layout.stride + region.x * pixel_bytes;
+      for (size_t i = 0; i < region.width * pixel_bytes; ++i)
+        row[i] = static_cast<unsigned char>(~row[i]);
+    }
+    uploadTextureRegion(input, image_data.data(), width, format, type, region);
+  }
+
+  auto& graph = filter.getGraph();
+  const size_t dispatches = graph.dispatchesCount();
+  filter.applyRegions(input, incremental, width, height, params, mode, post, dirty);
+  const size_t region_dispatches = graph.dispatchesCount() - dispatches;
+  filter.apply(input, reference, width, height, params, mode, post);
+
+  bool identical = readTexture(incremental, width, height, format, type) ==
+                   readTexture(reference, width, height, format, type);
+  for (auto texture : { input, incremental, reference, scratch })
+    pool.release(texture);
+
+  std::cout << mode_name << " dirty regions vs full refilter: "
+            << (identical ? "identical" : "different") << " (" << region_dispatches
+            << " dispatches)\n";
+  return identical;
+}
+
+// Filters the image and two variants of it as the layers of an array
+// texture, and compares every layer with the image filtered on its own
+bool checkArrayLayers(GaussianComputeFilter& filter, const TestImage& image, FilterMode mode,
+                      const char *mode_name) {
+  const int width = image.width, height = image.height;
+  const GLint format = image.format;
+  const GLenum type = image.type;
+
+  FilterParams params = thresholdParams();
+  params.iterations = 2;
+  PostFilters post;
+  post.morphology = Morphology::Close;
+  post.grayscale = true;
+
+  // The image, inverted, and with its rows reversed
+  const size_t stride = image.layout().stride;
+  std::vector<std::vector<unsigned char>> images(3, image.pixels);
+  for (auto& value : images[1])
+    value = static_cast<unsigned char>(~value);
+  for (int y = 0; y < height; ++y)
+    std::copy_n(image.pixels.data() + (height - 1 - y) * stride, stride,
+                images[2].data() + y * stride);
+  const int layers = static_cast<int>(images.size());
+
+  auto& pool = filter.texturePool();
+  const GLenum internal_format = imageTextureFormat(type);
+  GLuint input = pool.acquireArray(width, height, layers, internal_format);
+  GLuint output = pool.acquireArray(width, height, layers, internal_format);
+  GLuint single_input = pool.acquire(width, height, internal_format);
+  GLuint single_output = pool.acquire(width, height, internal_format);
+  GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_ALIGNMENT, 4));
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D_ARRAY, input));
+  for (int layer = 0; layer < layers; ++layer)
+    GL_ERROR_CHECK(glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, format,
+                                   type, images[layer].data()));
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
+
+  auto& graph = filter.getGraph();
+  const size_t dispatches = graph.dispatchesCount();
+  filter.applyLayers(input, output, width, height, layers, params, mode, post);
+  const size_t array_dispatches = graph.dispatchesCount() - dispatches;
+
+  bool identical = true;
+  const ImageRegion whole{ 0, 0, width, height };
+  for (int layer = 0; layer < layers; ++layer) {
+    uploadTextureRegion(single_input, images[layer].data(), width, format, type, whole);
+    filter.apply(single_input, single_output, width, height, params, mode, post);
+    auto expected = readTexture(single_output, width, height, format, type);
+    copyTextureLayer(single_output, output, layer, width, height, false);
+    identical = readTexture(single_output, width, height, format, type) == expected && identical;
+  }
+  for (auto texture : { input, output, single_input, single_output })
+    pool.release(texture);
+
+  std::cout << mode_name << " array of " << layers << " layers vs one by one: "
+            << (identical ? "identical" : "different") << " (" << array_dispatches
+            << " dispatches)\n";
+  return identical;
+}
+
+int main(int argc, char **argv) {
+  const char *file_name = argc > 1 ? argv[1] : "assets/textures/tex1.png";
+
+  bool ok = true;
+  std::unique_ptr<HeadlessGLContext> context;
+  TestImage image; // Deleted before the context
+  try {
+    loadTestImage(file_name, image);
+    std::cout << "Testing with " << file_name << "\n";
+
+    ThreadPool pool;
+    for (auto border : { BorderMode::Zero, BorderMode::Clamp }) {
+      ok = checkCpuKernels(image, border) && ok;
+      ok = checkStreaming(image, pool, border) && ok;
+    }
+    ok = checkCpuKernels(image, BorderMode::Zero, 3) && ok;
+    ok = checkStreaming(image, pool, BorderMode::Zero, 3) && ok;
+  } catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  context = HeadlessGLContext::create();
+  if (!context) {
+    std::cerr << "No GL 4.3 context, skipping the GL filter tests" << std::endl;
+    std::cout << (ok ? "All CPU filter tests passed" : "Some filter tests FAILED") << "\n";
+    return ok ? 0 : 1;
+  }
+  if (glxwInit()) {
+    std::cerr << "Failed to initialize GL3W" << std::endl;
+    return 1;
+  }
+  std::cout << "Testing on [" << glGetString(GL_RENDERER) << "]\n";
+
+  try {
+    uploadTestImage(image);
+    GaussianComputeFilter filter;
+
+    // The 273-sum 5x5 kernel isn't exactly separable, allow for rounding
+    ok = checkFilterMode(filter, image, FilterMode::Separable, "Separable", 1) && ok;
+    ok = checkFilterMode(filter, image, FilterMode::Tiled, "Tiled", 1) && ok;
+    ok = checkCpuFilter(filter, image, 1, BorderMode::Zero) && ok;
+    ok = checkCpuFilter(filter, image, 1, BorderMode::Clamp) && ok;
+    ok = checkCpuFilter(filter, image, 1, BorderMode::Zero, 3) && ok;
+    const struct {
+      FilterMode mode;
+      const char *name;
+    } modes[] = {
+      { FilterMode::Direct5x5, "Direct 5x5" }, { FilterMode::Separable, "Separable" },
+      { FilterMode::Tiled, "Tiled" }
+    };
+    for (auto& mode : modes)
+      ok = checkDirtyRegions(filter, image, mode.mode, mode.name) && ok;
+    for (auto& mode : modes)
+      ok = checkArrayLayers(filter, image, mode.mode, mode.name) && ok;
+  } catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  if (glGetError() != GL_NO_ERROR)
+    ok = false;
+
+  std::cout << (ok ? "All filter tests passed" : "Some filter tests FAILED") << "\n";
+  return ok ? 0 : 1;
+}
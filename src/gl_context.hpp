@@ -0,0 +1,124 @@
+#ifndef HEADER_GLCONTEXT_HPP
+#define HEADER_GLCONTEXT_HPP
+
+#include <memory>
+#include <iostream>
+
+// FILTER_HAVE_EGL is defined by the build when libEGL is available
+#ifdef FILTER_HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <cstring>
+#endif
+
+// A GL 4.3 core context that doesn't need a window or a display server, for
+// batch processing on render farms. Created through EGL, preferring Mesa's
+// surfaceless platform (which also covers llvmpipe) over the default display.
+class HeadlessGLContext {
+public:
+  HeadlessGLContext(const HeadlessGLContext&) = delete;
+  HeadlessGLContext& operator=(const HeadlessGLContext&) = delete;
+
+  ~HeadlessGLContext() {
+#ifdef FILTER_HAVE_EGL
+    // Also called on partially created contexts when create() fails
+    if (initialized == false)
+      return;
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (surface != EGL_NO_SURFACE)
+      eglDestroySurface(display, surface);
+    if (context != EGL_NO_CONTEXT)
+      eglDestroyContext(display, context);
+    eglTerminate(display);
+#endif
+  }
+
+  // Creates the context and makes it current. Returns nullptr if no GL 4.3
+  // context can be created, in which case the caller should use the CPU filter.
+  // A 'debug' context reports more through the debug output, see
+  // enableGLDebugOutput().
+  static std::unique_ptr<HeadlessGLContext> create(bool debug = false) {
+#ifdef FILTER_HAVE_EGL
+    std::unique_ptr<HeadlessGLContext> ctx(new HeadlessGLContext());
+
+    const char *client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+      eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    if (client_extensions && std::strstr(client_extensions, "EGL_MESA_platform_surfaceless") &&
+        getPlatformDisplay)
+      ctx->display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (ctx->display == EGL_NO_DISPLAY)
+      ctx->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (ctx->display == EGL_NO_DISPLAY || !eglInitialize(ctx->display, &major, &minor)) {
+      std::cerr << "EGL initialization failed" << std::endl;
+      ctx->display = EGL_NO_DISPLAY;
+      return nullptr;
+    }
+    ctx->initialized = true;
+
+    if (!eglBindAPI(EGL_OPENGL_API))
+      return nullptr;
+
+    const char *extensions = eglQueryString(ctx->display, EGL_EXTENSIONS);
+    bool surfaceless = extensions && std::strstr(extensions, "EGL_KHR_surfaceless_context");
+
+    const EGLint config_attributes[] = {
+      EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+      EGL_NONE
+    };
+    EGLConfig config = nullptr;
+    EGLint configs_count = 0;
+    eglChooseConfig(ctx->display, config_attributes, &config, 1, &configs_count);
+    if (configs_count == 0 && !surfaceless) {
+      std::cerr << "No EGL config supports pbuffers" << std::endl;
+      return nullptr;
+    }
+
+    const EGLint context_attributes[] = {
+      EGL_CONTEXT_MAJOR_VERSION, 4,
+      EGL_CONTEXT_MINOR_VERSION, 3,
+      EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+      EGL_CONTEXT_FLAGS_KHR, debug ? EGL_CONTEXT_OPENGL_DEBUG_BIT_KHR : 0,
+      EGL_NONE
+    };
+    ctx->context = eglCreateContext(ctx->display, configs_count ? config : EGL_NO_CONFIG_KHR,
+                                    EGL_NO_CONTEXT, context_attributes);
+    if (ctx->context == EGL_NO_CONTEXT) {
+      std::cerr << "Could not create a GL 4.3 core context" << std::endl;
+      return nullptr;
+    }
+
+    // Compute-only work never touches the default framebuffer, a surface is
+    // only needed when the implementation can't do without one
+    if (!surfaceless) {
+      const EGLint pbuffer_attributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+      ctx->surface = eglCreatePbufferSurface(ctx->display, config, pbuffer_attributes);
+      if (ctx->surface == EGL_NO_SURFACE)
+        return nullptr;
+    }
+
+    if (!eglMakeCurrent(ctx->display, ctx->surface, ctx->surface, ctx->context)) {
+      std::cerr << "Could not make the EGL context current" << std::endl;
+      return nullptr;
+    }
+    return ctx;
+#else
+    return nullptr;
+#endif
+  }
+
+private:
+  HeadlessGLContext() = default;
+
+#ifdef FILTER_HAVE_EGL
+  EGLDisplay display = EGL_NO_DISPLAY;
+  EGLContext context = EGL_NO_CONTEXT;
+  EGLSurface surface = EGL_NO_SURFACE;
+  bool initialized = false;
+#endif
+};
+
+#endif // HEADER_GLCONTEXT_HPP
@@ -5,38 +5,121 @@
 #include <iostream>
 #include <string>
 
+// Inline so that translation units not using some of them don't warn
 namespace {
-  std::string glErrorString(GLenum error_code) {
-    switch (error_code) {
-      case GL_NO_ERROR:
-        return "No error";
-      case GL_INVALID_ENUM:
-        return "Invalid enum";
-      case GL_INVALID_VALUE:
-        return "Invalid value";
-      case GL_INVALID_OPERATION:
-        return "Invalid operation";
-      case GL_STACK_OVERFLOW:
-        return "Stack overflow";
-      case GL_STACK_UNDERFLOW:
-        return "Stack underflow";
-      case GL_OUT_OF_MEMORY:
-        return "Out of memory";
-      default:
-        return std::string();
-    }
+  inline std::string glErrorString(GLenum error_code) {
+    switch (error_code) {
+      case GL_NO_ERROR:
+        return "No error";
+      case GL_INVALID_ENUM:
+        return "Invalid enum";
+      case GL_INVALID_VALUE:
+        return "Invalid value";
+      case GL_INVALID_OPERATION:
+        return "Invalid operation";
+      case GL_STACK_OVERFLOW:
+        return "Stack overflow";
+      case GL_STACK_UNDERFLOW:
+        return "Stack underflow";
+      case GL_OUT_OF_MEMORY:
+        return "Out of memory";
+      default:
+        return std::string();
+    }
   }
+
+  inline const char *glDebugTypeString(GLenum type) {
+    switch (type) {
+      case GL_DEBUG_TYPE_ERROR:
+        return "error";
+      case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR:
+        return "deprecated";
+      case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:
+        return "undefined behavior";
+      case GL_DEBUG_TYPE_PORTABILITY:
+        return "portability";
+      case GL_DEBUG_TYPE_PERFORMANCE:
+        return "performance";
+      default:
+        return "other";
+    }
+  }
+
+  inline void APIENTRY glDebugOutputCallback(GLenum source, GLenum type, GLuint id,
+                                             GLenum severity, GLsizei length,
+                                             const GLchar *message, const void *user_param) {
+    std::cerr << "[GLDEBUG] " << glDebugTypeString(type)
+              << (severity == GL_DEBUG_SEVERITY_HIGH ? " (high)" : "") << " - "
+              << std::string(message, length >= 0 ? length : std::char_traits<char>::length(message))
+              << std::endl;
+  }
+
+  // True while the debug output callback reports the errors, GL_ERROR_CHECK
+  // then doesn't query them itself
+  bool gl_debug_output_enabled = false;
+
+  // Reports GL errors and warnings as they're raised through the KHR_debug
+  // callback (core in GL 4.3) instead of glGetError() after every call, which
+  // is a round trip to the driver. Messages are most detailed on debug contexts
+  // (GLUT_DEBUG, HeadlessGLContext::create(true)). With 'synchronous' they're
+  // reported from inside the offending call, so a breakpoint in the callback
+  // shows where it was made, at the cost of serializing the driver; otherwise
+  // they may come later and from another thread. Returns false if the context
+  // has no debug output.
+  inline bool enableGLDebugOutput(bool synchronous) {
+    if (glDebugMessageCallback == nullptr)
+      return false;
+
+    glEnable(GL_DEBUG_OUTPUT);
+    if (synchronous)
+      glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+    else
+      glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+    glDebugMessageCallback(glDebugOutputCallback, nullptr);
+    // Notifications are chatty (buffer placements, shader statistics...)
+    glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, nullptr,
+                          GL_FALSE);
+    gl_debug_output_enabled = glGetError() == GL_NO_ERROR;
+    return gl_debug_output_enabled;
+  }
+
+#ifdef FILTER_COUNT_GL_CALLS
+  // GL calls made through GL_ERROR_CHECK so far, e.g. to count the calls of a
+  // frame. Only the GL thread may make them.
+  unsigned long long gl_calls_count = 0;
+#endif
 }
 
+#ifdef FILTER_COUNT_GL_CALLS
+#define GL_COUNT_CALL() (++gl_calls_count)
+#else
+#define GL_COUNT_CALL() ((void)0)
+#endif
 
+// Runs the GL call 'x' and reports the error it raised. Release builds
+// (NDEBUG) compile the check away unless FILTER_GL_ERROR_CHECKS is defined,
+// and it's skipped while the debug output callback is enabled.
+#if defined(NDEBUG) && !defined(FILTER_GL_ERROR_CHECKS)
 
 #define GL_ERROR_CHECK(x) do {                                                \
   x;                                                                          \
-  GLenum res = glGetError();                                                  \
-  if (res != GL_NO_ERROR)                                                     \
-    std::cerr << "[GLERROR] " << __FILE__ << ":" << __LINE__ <<               \
-              " - " << glErrorString(res) << std::endl;                       \
-} while (0)                                  
+  GL_COUNT_CALL();                                                            \
+} while (0)
+
+#else
+
+#define GL_ERROR_CHECK(x) do {                                                \
+  x;                                                                          \
+  GL_COUNT_CALL();                                                            \
+  if (gl_debug_output_enabled == false) {                                     \
+    GLenum res = glGetError();                                                \
+    if (res != GL_NO_ERROR)                                                   \
+      std::cerr << "[GLERROR] " << __FILE__ << ":" << __LINE__ <<             \
+                " - " << glErrorString(res) << std::endl;                     \
+  }                                                                           \
+} while (0)
+
+#endif
 
 
 #endif // HEADER_GLERRORCHECK_HPP
@@ -0,0 +1,98 @@
+#ifndef HEADER_GLOBJECTS_HPP
+#define HEADER_GLOBJECTS_HPP
+
+#include <GLXW/glxw.h>
+#include "gl_error_check.hpp"
+#include <utility>
+
+// Owns the name of a GL object and deletes the object when destroyed, as
+// std::unique_ptr does with memory. A default constructed one owns nothing.
+//
+// Caveat: as for the shader classes, a valid GL context must be current, also
+// when the object is destroyed or reset
+template <typename Traits>
+class GLObject {
+public:
+  GLObject() = default;
+
+  // Takes ownership of 'id'
+  explicit GLObject(GLuint id) : id(id) {}
+
+  // Generates a new object
+  static GLObject create() {
+    GLuint id = 0;
+    Traits::generate(&id);
+    return GLObject(id);
+  }
+
+  GLObject(const GLObject&) = delete;
+  GLObject& operator=(const GLObject&) = delete;
+
+  GLObject(GLObject&& other) : id(other.release()) {}
+
+  GLObject& operator=(GLObject&& other) {
+    if (this != &other)
+      reset(other.release());
+    return *this;
+  }
+
+  ~GLObject() {
+    reset();
+  }
+
+  GLuint get() const {
+    return id;
+  }
+
+  explicit operator bool() const {
+    return id != 0;
+  }
+
+  // Gives up ownership without deleting the object
+  GLuint release() {
+    return std::exchange(id, 0);
+  }
+
+  // Deletes the object owned, if any, and takes ownership of 'new_id'
+  void reset(GLuint new_id = 0) {
+    if (id != 0)
+      Traits::destroy(id); // No error check, this runs in destructors
+    id = new_id;
+  }
+
+private:
+  GLuint id = 0;
+};
+
+struct GLTextureTraits {
+  static void generate(GLuint *id) {
+    GL_ERROR_CHECK(glGenTextures(1, id));
+  }
+  static void destroy(GLuint id) {
+    glDeleteTextures(1, &id);
+  }
+};
+
+struct GLBufferTraits {
+  static void generate(GLuint *id) {
+    GL_ERROR_CHECK(glGenBuffers(1, id));
+  }
+  static void destroy(GLuint id) {
+    glDeleteBuffers(1, &id);
+  }
+};
+
+struct GLVertexArrayTraits {
+  static void generate(GLuint *id) {
+    GL_ERROR_CHECK(glGenVertexArrays(1, id));
+  }
+  static void destroy(GLuint id) {
+    glDeleteVertexArrays(1, &id);
+  }
+};
+
+using GLTexture = GLObject<GLTextureTraits>;
+using GLBuffer = GLObject<GLBufferTraits>;
+using GLVertexArray = GLObject<GLVertexArrayTraits>;
+
+#endif // HEADER_GLOBJECTS_HPP
@@ -0,0 +1,262 @@
+#ifndef HEADER_GPUPROFILER_HPP
+#define HEADER_GPUPROFILER_HPP
+
+#include <GLXW/glxw.h>
+#include "gl_error_check.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Measures how long sections of GL work take on the GPU.
+//
+// Every section is bracketed by two GL_TIMESTAMP queries (unlike
+// GL_TIME_ELAPSED ones, timestamps can nest, e.g. the passes of a filter
+// inside a frame). Query results are only read once the GPU has written them,
+// typically a frame later: collect() never waits, so profiling doesn't stall
+// the pipeline. Query objects are recycled once read.
+//
+// Caveat: as for the shader classes, a valid GL context must be current, and
+// the profiler must be destroyed while it still is.
+class GpuProfiler {
+public:
+  // Durations of a section over every time it ran, in milliseconds
+  struct SectionStats {
+    std::string name;
+    size_t count;
+    double min_ms;
+    double avg_ms;
+    double p99_ms;
+    double total_ms;
+  };
+
+  GpuProfiler() = default;
+  GpuProfiler(const GpuProfiler&) = delete;
+  GpuProfiler& operator=(const GpuProfiler&) = delete;
+
+  ~GpuProfiler() {
+    for (auto& section : open)
+      free_queries.push_back(section.begin_query);
+    for (auto& section : in_flight) {
+      free_queries.push_back(section.begin_query);
+      free_queries.push_back(section.end_query);
+    }
+    if (free_queries.empty() == false)
+      glDeleteQueries(static_cast<GLsizei>(free_queries.size()), free_queries.data());
+  }
+
+  // Starts a section, sections must be ended in reverse order
+  void begin(const std::string& name) {
+    Section section;
+    section.name = name;
+    section.begin_query = newQuery();
+    GL_ERROR_CHECK(glQueryCounter(section.begin_query, GL_TIMESTAMP));
+    open.push_back(section);
+  }
+
+  void end() {
+    if (open.empty())
+      throw std::logic_error("GpuProfiler::end() without a matching begin()");
+    Section section = open.back();
+    open.pop_back();
+    section.end_query = newQuery();
+    GL_ERROR_CHECK(glQueryCounter(section.end_query, GL_TIMESTAMP));
+    in_flight.push_back(section);
+  }
+
+  // Records the sections whose results are available, without waiting for
+  // the others
+  void collect() {
+    while (in_flight.empty() == false) {
+      GLint available = 0;
+      GL_ERROR_CHECK(glGetQueryObjectiv(in_flight.front().end_query, GL_QUERY_RESULT_AVAILABLE,
+                                        &available));
+      if (available == 0)
+        return; // Later queries can't be done either
+      record(in_flight.front());
+      in_flight.pop_front();
+    }
+  }
+
+  // Waits for every ended section and records it
+  void finish() {
+    while (in_flight.empty() == false) {
+      record(in_flight.front());
+      in_flight.pop_front();
+    }
+  }
+
+  // Statistics of the recorded sections, by name
+  std::vector<SectionStats> statistics() const {
+    std::vector<SectionStats> statistics;
+    for (auto& durations : section_durations) {
+      std::vector<double> sorted = durations.second;
+      std::sort(sorted.begin(), sorted.end());
+      SectionStats stats;
+      stats.name = durations.first;
+      stats.count = sorted.size();
+      stats.min_ms = sorted.front();
+      stats.total_ms = 0.0;
+      for (auto duration : sorted)
+        stats.total_ms += duration;
+      stats.avg_ms = stats.total_ms / sorted.size();
+      size_t p99 = static_cast<size_t>(std::ceil(0.99 * sorted.size()));
+      stats.p99_ms = sorted[std::max<size_t>(p99, 1) - 1];
+      statistics.push_back(stats);
+    }
+    return statistics;
+  }
+
+  // { "sections": [ { "name": ..., "count": ..., "min_ms": ..., ... }, ... ] }
+  void writeJSON(std::ostream& out) const {
+    auto flags = out.flags();
+    auto precision = out.precision(6); // Nanoseconds
+    out << std::fixed << "{\n  \"sections\": [";
+    bool first = true;
+    for (auto& stats : statistics()) {
+      out << (first ? "\n" : ",\n") << "    { \"name\": \"" << jsonEscape(stats.name) << "\""
+          << ", \"count\": " << stats.count << ", \"min_ms\": " << stats.min_ms
+          << ", \"avg_ms\": " << stats.avg_ms << ", \"p99_ms\": " << stats.p99_ms
+          << ", \"total_ms\": " << stats.total_ms << " }";
+      first = false;
+    }
+    out << "\n  ]\n}\n";
+    out.flags(flags);
+    out.precision(precision);
+  }
+
+  // Every recorded section as a complete event of the Chrome trace event
+  // format (chrome://tracing, Perfetto), on a single "GPU" track
+  void writeChromeTrace(std::ostream& out) const {
+    auto flags = out.flags();
+    auto precision = out.precision(3); // Nanoseconds
+    out << std::fixed << "{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [\n"
+        << "    { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0,"
+        << " \"args\": { \"name\": \"GPU\" } }";
+    for (auto& event : events) {
+      // Microseconds since the first section started
+      out << ",\n    { \"name\": \"" << jsonEscape(event.name) << "\", \"ph\": \"X\", \"pid\": 0,"
+          << " \"tid\": 0, \"ts\": " << (event.start - first_timestamp) / 1000.0
+          << ", \"dur\": " << event.duration / 1000.0 << " }";
+    }
+    out << "\n  ]\n}\n";
+    out.flags(flags);
+    out.precision(precision);
+  }
+
+  // Sections ended but not recorded yet
+  size_t pendingCount() const {
+    return in_flight.size();
+  }
+
+private:
+  struct Section {
+    std::string name;
+    GLuint begin_query = 0;
+    GLuint end_query = 0;
+  };
+
+  struct Event {
+    std::string name;
+    GLuint64 start; // GPU timestamp, in nanoseconds
+    GLuint64 duration;
+  };
+
+  GLuint newQuery() {
+    GLuint query;
+    if (free_queries.empty()) {
+      GL_ERROR_CHECK(glGenQueries(1, &query));
+    } else {
+      query = free_queries.back();
+      free_queries.pop_back();
+    }
+    return query;
+  }
+
+  // Reads the section's queries, waiting for them if needed
+  void record(const Section& section) {
+    GLuint64 begin = 0, end = 0;
+    GL_ERROR_CHECK(glGetQueryObjectui64v(section.begin_query, GL_QUERY_RESULT, &begin));
+    GL_ERROR_CHECK(glGetQueryObjectui64v(section.end_query, GL_QUERY_RESULT, &end));
+    free_queries.push_back(section.begin_query);
+    free_queries.push_back(section.end_query);
+
+    GLuint64 duration = end > begin ? end - begin : 0;
+    if (events.empty() || begin < first_timestamp)
+      first_timestamp = begin;
+    events.push_back({ section.name, begin, duration });
+    section_durations[section.name].push_back(duration / 1e6);
+  }
+
+  static std::string jsonEscape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+      if (c == '"' || c == '\\')
+        escaped += '\\';
+      if (static_cast<unsigned char>(c) >= 0x20)
+        escaped += c;
+    }
+    return escaped;
+  }
+
+  std::vector<Section> open;
+  std::deque<Section> in_flight; // Ended, in the order their queries were issued
+  std::vector<GLuint> free_queries;
+  std::vector<Event> events;
+  std::map<std::string, std::vector<double>> section_durations;
+  GLuint64 first_timestamp = 0;
+};
+
+// Waits for the pending sections of 'profiler', then writes its statistics to
+// 'json_file' and its sections to 'trace_file' (either can be empty)
+void saveGpuProfile(GpuProfiler& profiler, const std::string& json_file,
+                    const std::string& trace_file) {
+  profiler.finish();
+  if (json_file.empty() == false) {
+    std::ofstream out(json_file);
+    profiler.writeJSON(out);
+    if (out)
+      std::cout << "GPU profile written to " << json_file << "\n";
+    else
+      std::cerr << "Cannot write " << json_file << std::endl;
+  }
+  if (trace_file.empty() == false) {
+    std::ofstream out(trace_file);
+    profiler.writeChromeTrace(out);
+    if (out)
+      std::cout << "GPU trace written to " << trace_file << "\n";
+    else
+      std::cerr << "Cannot write " << trace_file << std::endl;
+  }
+}
+
+// Profiles the GL work issued during its lifetime as a section of 'profiler',
+// which may be null
+class GpuProfileScope {
+public:
+  GpuProfileScope(GpuProfiler *profiler, const std::string& name) : profiler(profiler) {
+    if (profiler)
+      profiler->begin(name);
+  }
+
+  GpuProfileScope(const GpuProfileScope&) = delete;
+  GpuProfileScope& operator=(const GpuProfileScope&) = delete;
+
+  ~GpuProfileScope() {
+    if (profiler)
+      profiler->end();
+  }
+
+private:
+  GpuProfiler *profiler;
+};
+
+#endif // HEADER_GPUPROFILER_HPP
@@ -0,0 +1,184 @@
+#ifndef HEADER_IMAGECACHE_HPP
+#define HEADER_IMAGECACHE_HPP
+
+#include <GLXW/glxw.h>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Identifies the version of a file: a file rewritten in place gets another
+// modification time or size, and cached copies of it are stale
+struct FileStamp {
+  int64_t modified = 0; // Nanoseconds where the platform has them
+  uint64_t size = 0;
+
+  bool operator==(const FileStamp& other) const {
+    return modified == other.modified && size == other.size;
+  }
+};
+
+// Returns false if 'path' can't be stat'ed
+bool fileStamp(const std::string& path, FileStamp& stamp) {
+#ifdef _WIN32
+  struct _stat64 info;
+  if (_stat64(path.c_str(), &info) != 0)
+    return false;
+  stamp.modified = static_cast<int64_t>(info.st_mtime) * 1000000000;
+#else
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0)
+    return false;
+#ifdef __APPLE__
+  stamp.modified = static_cast<int64_t>(info.st_mtimespec.tv_sec) * 1000000000 +
+                   info.st_mtimespec.tv_nsec;
+#else
+  stamp.modified = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 +
+                   info.st_mtim.tv_nsec;
+#endif
+#endif
+  stamp.size = static_cast<uint64_t>(info.st_size);
+  return true;
+}
+
+// An image as it was decoded or uploaded: its pixels, laid out as
+// loadPNGFromFile returns them, and/or a GL texture holding them
+struct CachedImage {
+  int width = 0;
+  int height = 0;
+  GLint format = GL_RGBA;
+  GLenum type = GL_UNSIGNED_BYTE;
+  std::shared_ptr<const std::vector<unsigned char>> pixels;
+  GLuint texture = 0;
+};
+
+// Least recently used images, keyed by file path and bounded by a byte budget.
+// Decoded pixels are shared: an image evicted while it's being filtered stays
+// alive until the filter drops it. Textures are handed back through
+// takeRetiredTextures() instead, since they may only be deleted or recycled
+// on the GL thread.
+//
+// Every method is thread safe.
+class ImageCache {
+public:
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0; // Including stale entries
+    size_t evictions = 0;
+    size_t images = 0; // Resident
+    size_t bytes = 0; // Resident
+  };
+
+  explicit ImageCache(size_t budget_bytes) : budget(budget_bytes) {}
+
+  ImageCache(const ImageCache&) = delete;
+  ImageCache& operator=(const ImageCache&) = delete;
+
+  size_t budgetBytes() const {
+    return budget;
+  }
+
+  // Copies the entry of 'path' to 'image' and makes it the most recently
+  // used. An entry of another version of the file is dropped.
+  bool find(const std::string& path, const FileStamp& stamp, CachedImage& image) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(path);
+    if (it != entries.end() && !(it->second->stamp == stamp)) {
+      remove(it->second);
+      it = entries.end();
+    }
+    if (it == entries.end()) {
+      ++stats.misses;
+      return false;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    image = it->second->image;
+    ++stats.hits;
+    return true;
+  }
+
+  // True if find() would find 'path' now, for callers that only look it up
+  // later. A miss is counted here, a hit by find().
+  bool contains(const std::string& path, const FileStamp& stamp) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(path);
+    if (it != entries.end() && it->second->stamp == stamp)
+      return true;
+    ++stats.misses;
+    return false;
+  }
+
+  // Caches 'image', whose pixels and texture take 'bytes', evicting the least
+  // recently used images until it fits. Returns false, leaving 'image' to the
+  // caller, if it's larger than the whole budget.
+  bool insert(const std::string& path, const FileStamp& stamp, CachedImage image, size_t bytes) {
+    if (bytes > budget)
+      return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(path);
+    if (it != entries.end())
+      remove(it->second);
+    while (stats.bytes + bytes > budget) {
+      remove(std::prev(lru.end()));
+      ++stats.evictions;
+    }
+    lru.push_front(Entry{ path, stamp, std::move(image), bytes });
+    entries[path] = lru.begin();
+    ++stats.images;
+    stats.bytes += bytes;
+    return true;
+  }
+
+  // Textures of the entries dropped since the last call, owned by the caller
+  std::vector<GLuint> takeRetiredTextures() {
+    std::vector<GLuint> textures;
+    std::lock_guard<std::mutex> lock(mutex);
+    textures.swap(retired_textures);
+    return textures;
+  }
+
+  // Drops every entry, their textures are retired
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (!lru.empty())
+      remove(lru.begin());
+  }
+
+  Stats statistics() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+
+private:
+  struct Entry {
+    std::string path;
+    FileStamp stamp;
+    CachedImage image;
+    size_t bytes;
+  };
+
+  void remove(std::list<Entry>::iterator entry) {
+    if (entry->image.texture != 0)
+      retired_textures.push_back(entry->image.texture);
+    --stats.images;
+    stats.bytes -= entry->bytes;
+    entries.erase(entry->path);
+    lru.erase(entry);
+  }
+
+  const size_t budget;
+  mutable std::mutex mutex;
+  std::list<Entry> lru; // Most recently used first
+  std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+  std::vector<GLuint> retired_textures;
+  Stats stats;
+};
+
+#endif // HEADER_IMAGECACHE_HPP
@@ -0,0 +1,32 @@
+#ifndef HEADER_IMAGELAYOUT_HPP
+#define HEADER_IMAGELAYOUT_HPP
+
+#include <stddef.h>
+
+// Row size of the buffers loadPNGFromFile fills and glGetTexImage reads back:
+// 'row_bytes' of pixels padded to 4 bytes, GL's default (UN)PACK_ALIGNMENT
+inline size_t alignedRowBytes(size_t row_bytes) {
+  return row_bytes + 3 - ((row_bytes - 1) % 4);
+}
+
+// Layout of an image buffer
+struct ImageLayout {
+  int width;
+  int height;
+  int channels; // 3 (RGB) or 4 (RGBA)
+  size_t stride; // Bytes between the beginning of two consecutive rows
+  int channel_bytes; // 1 (8-bit) or 2 (16-bit, native endian)
+
+  // loadPNGFromFile pads every row to 4 bytes for glTexImage2D
+  static ImageLayout fromPNG(int width, int height, int channels, int channel_bytes = 1) {
+    const size_t rowbytes = alignedRowBytes(static_cast<size_t>(width) * channels * channel_bytes);
+    return { width, height, channels, rowbytes, channel_bytes };
+  }
+
+  size_t size() const {
+    return stride * height;
+  }
+};
+
+
+#endif // HEADER_IMAGELAYOUT_HPP
@@ -4,6 +4,12 @@
 #include <png.h>
 #include <pngstruct.h>
 #include <pnginfo.h>
+#include "image_layout.hpp"
+#include "mapped_file.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <functional>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -16,136 +22,376 @@ void fopen_s(FILE **file, const char *filename, const char *mode) {
 }
 #endif
 
-bool loadPNGFromFile(const char *file_name, int& width, int& height, GLint& format, std::vector<unsigned char>& image_data)
-{
-  // Adapted from https://github.com/DavidEGrayson/ahrs-visualizer
+// Where PNGReader reads the file from: stdio (png_init_io) or a memory
+// mapping of the file (png_set_read_fn), which avoids stdio's copies and is
+// faster on fast storage
+enum class PNGInput { Stdio, MemoryMapped };
 
-  png_byte header[8];
+// Incremental PNG decoder. open() reads the header, then readRows() decodes
+// the rows from the top of the image as libpng produces them, so that work on
+// the first rows can start while the others are still being decoded. Rows are
+// written straight to the caller's buffers, nothing is allocated per row.
+class PNGReader {
+public:
+  PNGReader() = default;
 
-  FILE *fp = nullptr;
-  fopen_s(&fp, file_name, "rb");
-  if (fp == 0)
-  {
-    perror(file_name);
-    return 0;
-  }
+  PNGReader(const PNGReader&) = delete;
+  PNGReader& operator=(const PNGReader&) = delete;
 
-  // read the header
-  fread(header, 1, 8, fp);
+  ~PNGReader() {
+    close();
+  }
 
-  if (png_sig_cmp(header, 0, 8))
+  // Reads the header of 'file_name'. Every color type and bit depth is
+  // decoded to RGB or RGBA, with 8-bit channels up to 8-bit images and native
+  // endian 16-bit channels for 16-bit ones: palettes and grayscale are
+  // expanded to RGB, transparency chunks to an alpha channel.
+  bool open(const char *file_name, PNGInput input = PNGInput::Stdio)
   {
-    std::cerr << "Error: " << file_name << " is not a PNG file" << std::endl;
-    fclose(fp);
-    return 0;
+    // Adapted from https://github.com/DavidEGrayson/ahrs-visualizer
+
+    close();
+
+    png_byte header[8];
+    bool header_read;
+
+    if (input == PNGInput::MemoryMapped)
+    {
+      if (mapped_file.open(file_name) == false)
+        return false;
+      mapped_file.adviseSequential();
+      header_read = mapped_file.size() >= 8;
+      if (header_read)
+        std::memcpy(header, mapped_file.data(), 8);
+      mapped_offset = 8;
+    }
+    else
+    {
+      fopen_s(&fp, file_name, "rb");
+      if (fp == 0)
+      {
+        perror(file_name);
+        return false;
+      }
+      header_read = fread(header, 1, 8, fp) == 8;
+    }
+
+    // check the header
+    if (header_read == false || png_sig_cmp(header, 0, 8))
+    {
+      std::cerr << "Error: " << file_name << " is not a PNG file" << std::endl;
+      close();
+      return false;
+    }
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr)
+    {
+      std::cerr << "Error: png_create_read_struct returned 0" << std::endl;
+      close();
+      return false;
+    }
+
+    // create png info struct
+    info_ptr = png_create_info_struct(png_ptr);
+    end_info = info_ptr ? png_create_info_struct(png_ptr) : nullptr;
+    if (!info_ptr || !end_info)
+    {
+      std::cerr << "Error: png_create_info_struct returned 0" << std::endl;
+      close();
+      return false;
+    }
+
+    // the code in this if statement gets called if libpng encounters an error
+    if (setjmp(png_jmpbuf(png_ptr))) {
+      std::cerr << "Error from libpng" << std::endl;
+      close();
+      return false;
+    }
+
+    // init png reading
+    if (fp)
+      png_init_io(png_ptr, fp);
+    else
+      png_set_read_fn(png_ptr, this, readMapped);
+
+    // let libpng know you already read the first 8 bytes
+    png_set_sig_bytes(png_ptr, 8);
+
+    // read all the info up to the image data
+    png_read_info(png_ptr, info_ptr);
+
+    // variables to pass to get info
+    int bit_depth, color_type, interlace_type;
+    png_uint_32 temp_width, temp_height;
+
+    // get info about png
+    png_get_IHDR(png_ptr, info_ptr, &temp_width, &temp_height, &bit_depth, &color_type,
+      &interlace_type, NULL, NULL);
+
+    image_width = temp_width;
+    image_height = temp_height;
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+      png_set_palette_to_rgb(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+      png_set_expand_gray_1_2_4_to_8(png_ptr);
+    if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+      png_set_tRNS_to_alpha(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+      png_set_gray_to_rgb(png_ptr);
+    // PNG stores 16-bit samples big endian, GL_UNSIGNED_SHORT is native endian
+    const png_uint_16 endian_probe = 1;
+    if (bit_depth == 16 && *reinterpret_cast<const png_byte*>(&endian_probe) == 1)
+      png_set_swap(png_ptr);
+
+    // Interlaced images go through every row once per pass
+    passes = (interlace_type == PNG_INTERLACE_NONE) ? 1 : png_set_interlace_handling(png_ptr);
+
+    // Update the png info struct.
+    png_read_update_info(png_ptr, info_ptr);
+
+    image_format = (png_get_channels(png_ptr, info_ptr) == 4) ? GL_RGBA : GL_RGB;
+    image_type = (png_get_bit_depth(png_ptr, info_ptr) == 16) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+
+    // Row size in bytes. glTexImage2d requires rows to be 4-byte aligned
+    row_bytes = alignedRowBytes(png_get_rowbytes(png_ptr, info_ptr));
+
+    rows_read = 0;
+    return true;
   }
 
-  png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (!png_ptr)
+  int width() const { return image_width; }
+  int height() const { return image_height; }
+  GLint format() const { return image_format; } // GL_RGB or GL_RGBA
+  GLenum type() const { return image_type; } // GL_UNSIGNED_BYTE or GL_UNSIGNED_SHORT
+  size_t rowBytes() const { return row_bytes; } // 4-byte aligned
+  int rowsRead() const { return rows_read; }
+
+  // Interlaced images can't be decoded incrementally, readRows() must be
+  // given all of their rows at once
+  bool interlaced() const { return passes > 1; }
+
+  // Decodes the next 'count' rows (fewer if the image ends before) into
+  // 'first_row', 'first_row' + 'stride', ... A negative stride stores the
+  // image bottom row first, as glTexImage2D expects. Returns the number of
+  // rows decoded or -1 on error, after which the reader is closed.
+  int readRows(unsigned char *first_row, std::ptrdiff_t stride, int count)
   {
-    std::cerr << "Error: png_create_read_struct returned 0" << std::endl;
-    fclose(fp);
-    return 0;
+    if (png_ptr == nullptr)
+      return -1;
+    count = std::min(count, image_height - rows_read);
+    if (interlaced() && count != image_height)
+    {
+      std::cerr << "Error: interlaced images must be decoded at once" << std::endl;
+      close();
+      return -1;
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+      std::cerr << "Error from libpng" << std::endl;
+      close();
+      return -1;
+    }
+
+    for (int pass = 0; pass < passes; ++pass)
+      for (int i = 0; i < count; ++i)
+        png_read_row(png_ptr, first_row + i * stride, NULL);
+
+    rows_read += count;
+    if (rows_read == image_height)
+      png_read_end(png_ptr, end_info);
+    return count;
   }
 
-  // create png info struct
-  png_infop info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr)
+  void close()
   {
-    std::cerr << "Error: png_create_info_struct returned 0" << std::endl;
-    png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-    fclose(fp);
-    return 0;
+    if (png_ptr)
+      png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : (png_infopp)NULL,
+                              end_info ? &end_info : (png_infopp)NULL);
+    png_ptr = nullptr;
+    info_ptr = end_info = nullptr;
+    if (fp)
+      fclose(fp);
+    fp = nullptr;
+    mapped_file.close();
   }
 
-  // create png info struct
-  png_infop end_info = png_create_info_struct(png_ptr);
-  if (!end_info)
+private:
+
+  // libpng read callback of the memory mapped input
+  static void readMapped(png_structp png_ptr, png_bytep data, png_size_t length)
   {
-    std::cerr << "Error: png_create_info_struct returned 0" << std::endl;
-    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-    fclose(fp);
-    return 0;
+    auto reader = static_cast<PNGReader*>(png_get_io_ptr(png_ptr));
+    if (length > reader->mapped_file.size() - reader->mapped_offset)
+      png_error(png_ptr, "Read past the end of the file");
+    std::memcpy(data, reader->mapped_file.data() + reader->mapped_offset, length);
+    reader->mapped_offset += length;
   }
 
-  // the code in this if statement gets called if libpng encounters an error
-  if (setjmp(png_jmpbuf(png_ptr))) {
-    std::cerr << "Error from libpng" << std::endl;
-    png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-    fclose(fp);
-    return 0;
-  }
+  FILE *fp = nullptr;
+  MappedFile mapped_file;
+  size_t mapped_offset = 0;
+  png_structp png_ptr = nullptr;
+  png_infop info_ptr = nullptr;
+  png_infop end_info = nullptr;
+  int image_width = 0;
+  int image_height = 0;
+  GLint image_format = 0;
+  GLenum image_type = 0;
+  size_t row_bytes = 0;
+  int passes = 1;
+  int rows_read = 0;
+};
 
-  // init png reading
-  png_init_io(png_ptr, fp);
 
-  // let libpng know you already read the first 8 bytes
-  png_set_sig_bytes(png_ptr, 8);
+// Decodes a PNG into memory returned by allocate(size), called once the image
+// size is known. allocate may return nullptr to abort the decoding. Rows are
+// 4-byte aligned and stored bottom row first, as glTexImage2D expects.
+// 'format' is GL_RGB or GL_RGBA, 'type' GL_UNSIGNED_BYTE or GL_UNSIGNED_SHORT.
+bool loadPNGFromFile(const char *file_name, int& width, int& height, GLint& format, GLenum& type,
+                     const std::function<unsigned char*(size_t)>& allocate,
+                     PNGInput input = PNGInput::Stdio)
+{
+  PNGReader reader;
+  if (reader.open(file_name, input) == false)
+    return false;
 
-  // read all the info up to the image data
-  png_read_info(png_ptr, info_ptr);
+  width = reader.width();
+  height = reader.height();
+  format = reader.format();
+  type = reader.type();
 
-  // variables to pass to get info
-  int bit_depth, color_type;
-  png_uint_32 temp_width, temp_height;
+  // Allocate the image_data as a big block, to be given to opengl
+  const size_t rowbytes = reader.rowBytes();
+  unsigned char *image_data = allocate(rowbytes * height);
+  if (image_data == nullptr)
+    return false;
 
-  // get info about png
-  png_get_IHDR(png_ptr, info_ptr, &temp_width, &temp_height, &bit_depth, &color_type,
-    NULL, NULL, NULL);
+  return reader.readRows(image_data + (height - 1) * rowbytes,
+                         -static_cast<std::ptrdiff_t>(rowbytes), height) == height;
+}
 
-  width = temp_width;
-  height = temp_height;
+bool loadPNGFromFile(const char *file_name, int& width, int& height, GLint& format, GLenum& type,
+                     std::vector<unsigned char>& image_data)
+{
+  return loadPNGFromFile(file_name, width, height, format, type, [&image_data](size_t size) {
+    image_data.resize(size);
+    return image_data.data();
+  });
+}
 
-  //printf("%s: %lux%lu %d\n", file_name, temp_width, temp_height, color_type);
 
-  if (bit_depth != 8) {
-    std::cerr << "Unsupported bit depth " << bit_depth << ". Must be 8." << std::endl;
-    return 0;
+bool savePNGToFile(const char *file_name, int width, int height, GLint format, GLenum type,
+                   const std::vector<unsigned char>& image_data)
+{
+  // Inverse of loadPNGFromFile: image_data holds 4-byte aligned rows, bottom row first
+
+  int bit_depth;
+  switch (type)
+  {
+  case GL_UNSIGNED_BYTE:
+    bit_depth = 8;
+    break;
+  case GL_UNSIGNED_SHORT:
+    bit_depth = 16;
+    break;
+  default:
+    std::cerr << "Unsupported type " << type << std::endl;
+    return false;
   }
 
-  switch (color_type)
+  int color_type;
+  size_t channels;
+  switch (format)
   {
-  case PNG_COLOR_TYPE_RGB:
-    format = GL_RGB;
+  case GL_RGB:
+    color_type = PNG_COLOR_TYPE_RGB;
+    channels = 3;
     break;
-  case PNG_COLOR_TYPE_RGB_ALPHA:
-    format = GL_RGBA;
+  case GL_RGBA:
+    color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+    channels = 4;
     break;
   default:
-    std::cerr << "Unknown libpng color type " << color_type << std::endl;
-    return 0;
+    std::cerr << "Unsupported format " << format << std::endl;
+    return false;
+  }
+
+  const size_t rowbytes = alignedRowBytes(width * channels * (bit_depth / 8));
+  if (image_data.size() < rowbytes * height)
+  {
+    std::cerr << "Error: image data is smaller than " << width << "x" << height << std::endl;
+    return false;
+  }
+
+  FILE *fp = nullptr;
+  fopen_s(&fp, file_name, "wb");
+  if (fp == 0)
+  {
+    perror(file_name);
+    return false;
+  }
+
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png_ptr)
+  {
+    std::cerr << "Error: png_create_write_struct returned 0" << std::endl;
+    fclose(fp);
+    return false;
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr)
+  {
+    std::cerr << "Error: png_create_info_struct returned 0" << std::endl;
+    png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+    fclose(fp);
+    return false;
   }
 
-  // Update the png info struct.
-  png_read_update_info(png_ptr, info_ptr);
+  // row_pointers is declared before setjmp so that longjmp doesn't skip its destructor
+  std::vector<png_byte*> row_pointers(height, nullptr);
 
-  // Row size in bytes.
-  size_t rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+  // the code in this if statement gets called if libpng encounters an error
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    std::cerr << "Error from libpng" << std::endl;
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    fclose(fp);
+    return false;
+  }
 
-  // glTexImage2d requires rows to be 4-byte aligned
-  rowbytes += 3 - ((rowbytes - 1) % 4);
+  png_init_io(png_ptr, fp);
 
-  // Allocate the image_data as a big block, to be given to opengl
-  image_data.resize(rowbytes * temp_height * sizeof(png_byte));
+  png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type, PNG_INTERLACE_NONE,
+    PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
 
-  // row_pointers is for pointing to image_data for reading the png with libpng
-  std::vector<png_byte*> row_pointers(temp_height, nullptr);
+  // 16-bit samples are native endian in memory and big endian in the file
+  const png_uint_16 endian_probe = 1;
+  if (bit_depth == 16 && *reinterpret_cast<const png_byte*>(&endian_probe) == 1)
+    png_set_swap(png_ptr);
 
-  // set the individual row_pointers to point at the correct offsets of image_data
-  for (unsigned int i = 0; i < temp_height; i++) 
+  // flip the rows back to top-first order
+  for (int i = 0; i < height; i++)
   {
-    row_pointers[temp_height - 1 - i] = static_cast<unsigned char*>(image_data.data()) + i * rowbytes;
+    row_pointers[height - 1 - i] = const_cast<png_byte*>(image_data.data()) + i * rowbytes;
   }
 
-  // read the png into image_data through row_pointers
-  png_read_image(png_ptr, row_pointers.data());
+  png_write_image(png_ptr, row_pointers.data());
+  png_write_end(png_ptr, NULL);
 
   // clean up
-  png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
   fclose(fp);
   return true;
 }
 
+bool savePNGToFile(const char *file_name, int width, int height, GLint format,
+                   const std::vector<unsigned char>& image_data)
+{
+  return savePNGToFile(file_name, width, height, format, GL_UNSIGNED_BYTE, image_data);
+}
 
 
 #endif // HEADER_IMAGEUTILS_HPP
@@ -4,23 +4,33 @@
 #include "shader_utils.hpp"
 #include "image_utils.hpp"
 #include "gl_error_check.hpp"
+#include "filter_params.hpp"
+#include "compute_filter.hpp"
+#include "cpu_filter.hpp"
+#include "batch.hpp"
+#include "pixel_buffer.hpp"
+#include "gpu_profiler.hpp"
+#include "render_state.hpp"
+#include "gl_objects.hpp"
 #include <iostream>
 #include <algorithm>
 #include <array>
 #include <vector>
 #include <tuple>
 #include <sstream>
-
-// Range of valid RGB values
-struct RGB {
-  float r;
-  float g;
-  float b;
-};
-
-// Threshold values on the filtered image
-const RGB min_rgb_threshold = { 0.0f, 0.0f, 0.0f };
-const RGB max_rgb_threshold = { 0.5f, 1.0f, 1.0f };
+#include <stdexcept>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+// Threshold values on the filtered image, --min-threshold and --max-threshold
+// override them
+RGB min_rgb_threshold = { 0.0f, 0.0f, 0.0f };
+RGB max_rgb_threshold = { 0.5f, 1.0f, 1.0f };
 
 // Type unsafe way of converting an integer to a char pointer
 #define BUFFER_OFFSET(i) ((char *)NULL + (i))
@@ -128,13 +138,33 @@ private:
 };
 
 
-std::unique_ptr<ShaderProgram> shader_program;
-GLuint texture_id;
-GLuint filtered_texture_id;
-GLuint vaoId;
-GLuint vboId;
-GLuint vboiId;
+// Programs are kept in 'program_cache_directory' across runs, unless empty
+std::string program_cache_directory = "shader_cache";
+std::unique_ptr<ProgramCache> program_cache;
+ShaderProgram *shader_program = nullptr; // Owned by program_cache
+GLTexture input_texture;
+GLTexture filtered_texture;
+GLVertexArray vertex_array;
+GLBuffer vertex_buffer;
+GLBuffer index_buffer;
 GLsizei indices_count;
+// Texture unit the fragment shader samples the filtered texture from
+const GLuint filtered_texture_unit = 1;
+
+// Bindings of the render loop, and the GL calls of its last frame when
+// built with FILTER_COUNT_GL_CALLS
+RenderState render_state;
+unsigned long long frame_gl_calls = 0;
+
+// GPU times of the filter passes and of every frame, written on exit when
+// profiling was requested
+std::unique_ptr<GpuProfiler> gpu_profiler;
+std::string profile_file;
+std::string trace_file;
+
+// Filtered image being saved, read back without stalling the main loop
+const char *filtered_file = "filtered.png";
+std::unique_ptr<PixelReadback> filtered_readback;
 
 // Set up a quad
 void setupQuad() {
@@ -166,11 +196,11 @@ void setupQuad() {
 
   // Set up VAO and VBO
   
-  GL_ERROR_CHECK(glGenVertexArrays(1, &vaoId)); // Generate an unused vertex array name
-  GL_ERROR_CHECK(glBindVertexArray(vaoId)); // Bind and create a VAO
+  vertex_array = GLVertexArray::create(); // Generate an unused vertex array name
+  GL_ERROR_CHECK(glBindVertexArray(vertex_array.get())); // Bind and create a VAO
 
-  GL_ERROR_CHECK(glGenBuffers(1, &vboId));
-  GL_ERROR_CHECK(glBindBuffer(GL_ARRAY_BUFFER, vboId)); // Bind and create a VBO (0-sized for now)
+  vertex_buffer = GLBuffer::create();
+  GL_ERROR_CHECK(glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer.get())); // Bind and create a VBO (0-sized for now)
   GL_ERROR_CHECK(glBufferData(GL_ARRAY_BUFFER, sizeof(TexturedVertex::PackedData) * vertices_buffer.size(),
     vertices_buffer.data(), GL_STATIC_DRAW));
 
@@ -186,14 +216,20 @@ void setupQuad() {
   GL_ERROR_CHECK(glVertexAttribPointer(2, TexturedVertex::uv_components_count, GL_FLOAT,
     false, TexturedVertex::stride, BUFFER_OFFSET(TexturedVertex::uv_byte_offset)));
 
-  GL_ERROR_CHECK(glBindBuffer(GL_ARRAY_BUFFER, 0)); // Unbind VBO
-  GL_ERROR_CHECK(glBindVertexArray(0)); // Unbind VAO
+  // The enabled attributes are VAO state, enable them once and for all
+  GL_ERROR_CHECK(glEnableVertexAttribArray(0));
+  GL_ERROR_CHECK(glEnableVertexAttribArray(1));
+  GL_ERROR_CHECK(glEnableVertexAttribArray(2));
 
-  // Create a new VBO for the indices and select it (bind it)  
-  GL_ERROR_CHECK(glGenBuffers(1, &vboiId));
-  GL_ERROR_CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vboiId));
+  GL_ERROR_CHECK(glBindBuffer(GL_ARRAY_BUFFER, 0)); // Unbind VBO (the attributes keep it)
+
+  // Create a new VBO for the indices and select it (bind it). The element
+  // buffer binding is VAO state too, keep it bound in the VAO.
+  index_buffer = GLBuffer::create();
+  GL_ERROR_CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer.get()));
   GL_ERROR_CHECK(glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(char), indices.data(), GL_STATIC_DRAW));
-  GL_ERROR_CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+
+  GL_ERROR_CHECK(glBindVertexArray(0)); // Unbind VAO
 }
 
 const std::string vertex_shader_source = { R"(
@@ -238,57 +274,51 @@ void main(void) {
 
 void setupShaders() {
 
-  // Load the vertex shader from file
-  Shader vertex_textured(GL_VERTEX_SHADER);
-  vertex_textured.loadFromString(vertex_shader_source);
-  vertex_textured.compile();
+  program_cache = std::make_unique<ProgramCache>();
+  program_cache->setDirectory(program_cache_directory);
 
-  // Load the fragment shader
-  Shader fragment_shader(GL_FRAGMENT_SHADER);
-  fragment_shader.loadFromString(fragment_shader_source);
-  fragment_shader.compile();
+  // Create a program which binds the vertex and fragment shaders (or load it
+  // from the cache). Named attributes are bound to 1, 2 and 3 VAO indices.
+  shader_program = &program_cache->get({ { GL_VERTEX_SHADER, vertex_shader_source },
+                                         { GL_FRAGMENT_SHADER, fragment_shader_source } },
+                                       { { 0, "in_Position" },
+                                         { 1, "in_Color" },
+                                         { 2, "in_TextureCoord" } });
 
-  // Create a program which binds the shaders
-  shader_program = std::make_unique<ShaderProgram>();
-  shader_program->addShader(std::move(vertex_textured));
-  shader_program->addShader(std::move(fragment_shader));
-
-  // Bind named attributes in the shader program to 1, 2 and 3 VAO indices
-  GL_ERROR_CHECK(glBindAttribLocation(shader_program->getId(), 0, "in_Position"));
-  GL_ERROR_CHECK(glBindAttribLocation(shader_program->getId(), 1, "in_Color"));
-  GL_ERROR_CHECK(glBindAttribLocation(shader_program->getId(), 2, "in_TextureCoord"));
-
-  shader_program->linkProgram();
+  // Uniforms are program state, the sampler is set once instead of every frame
+  GLint sampler2D_loc;
+  GL_ERROR_CHECK(sampler2D_loc = glGetUniformLocation(shader_program->getId(), "texture_diffuse"));
+  GL_ERROR_CHECK(glProgramUniform1i(shader_program->getId(), sampler2D_loc, filtered_texture_unit));
   shader_program->validateProgram();
 }
 
+std::string texture_file = "assets/textures/tex1.png";
+// Dimensions and channel type of the loaded texture, the filtered texture
+// follows them
+int texture_width = 0;
+int texture_height = 0;
+GLenum texture_type = GL_UNSIGNED_BYTE;
+
 void loadPNGTexture() {
 
     int width, height;
     GLint format;
+    GLenum type;
     std::vector<unsigned char> image_data;
 
-    bool res = loadPNGFromFile("assets/textures/tex1.png", width, height, format, image_data);  
+    bool res = loadPNGFromFile(texture_file.c_str(), width, height, format, type, image_data);
     if (res == false)
       throw std::runtime_error("Could not load asset");    
 
-    auto isPowerOf2 = [](int val) {
-      if (((val - 1) & val) == 0)
-        return true;
-      else
-        return false;
-    };
-    if (isPowerOf2(width) == false || isPowerOf2(height) == false)
-      // This is not true for all implementations, keep it as a safety measure
-      throw std::runtime_error("Texture dimensions should be a power of two");
-    
-    GL_ERROR_CHECK(glGenTextures(1, &texture_id)); // Create texture object
+    input_texture = GLTexture::create(); // Create texture object
     GL_ERROR_CHECK(glActiveTexture(GL_TEXTURE0)); // Activate texunit 0
-    GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, texture_id)); // Bind as 2D texture
+    GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, input_texture.get())); // Bind as 2D texture
 
-    // Upload data and generate mipmaps (normalize unsigned values)
-    GL_ERROR_CHECK(glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, image_data.data()));
-    GL_ERROR_CHECK(glGenerateMipmap(GL_TEXTURE_2D));
+    // Upload data (normalize unsigned values). Image load/store needs a sized
+    // 1, 2 or 4 channel internal format, RGB images get an opaque alpha. The
+    // filter only reads level 0, no mipmaps are needed.
+    GLint internal_format = imageTextureFormat(type);
+    GL_ERROR_CHECK(glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, image_data.data()));
 
     // Set up UV coords 
     GL_ERROR_CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT));
@@ -299,136 +329,42 @@ void loadPNGTexture() {
     GL_ERROR_CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
     
     GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, 0));
-}
-
-
-// local_size_x/y/z layout variables define the work group size.
-// gl_GlobalInvocationID is a uvec3 variable giving the global ID of the thread,
-// gl_LocalInvocationID is the local index within the work group, and
-// gl_WorkGroupID is the work group's index
-const std::string gaussian_filter_computeshader_source = { R"(
-
-#version 430
-
-// Invocations in the work group
-// Operate on the image in a block of 16x16 "threads"
-layout (local_size_x = 16, local_size_y = 16) in;
 
-uniform layout(rgba8, binding = 0) readonly image2D input_texture;
-uniform layout(rgba8, binding = 1) writeonly image2D output_texture;
-uniform vec3 rgb_min_threshold;
-uniform vec3 rgb_max_threshold;
-
-bool in_range(float v, int rgb_index) {
-  if (v < rgb_min_threshold[rgb_index] || v > rgb_max_threshold[rgb_index])
-    return false;
-  else
-    return true;
+    texture_width = width;
+    texture_height = height;
+    texture_type = type;
 }
 
-void main() {
-  // Coordinates of the texel we're about to process
-  ivec2 texelCoords = ivec2(gl_GlobalInvocationID.xy);
-
-  // Read the pixel from the first texture.
-  // vec4 pixel = imageLoad(input_texture, texelCoords);
-  // imageStore(output_texture, texelCoords, pixel);
-
-  const float gaussian_kernel[25] = float[](1.0, 4.0, 7.0, 4.0, 1.0,
-    4.0, 16.0, 26.0, 16.0, 4.0,
-    7.0, 26.0, 41.0, 26.0, 7.0,
-    4.0, 16.0, 26.0, 16.0, 4.0,
-    1.0, 4.0, 7.0, 4.0, 1.0);
-  const float kernel_sum = 273.0;
-
-  // Compute a simple gaussian blur
-  float result_r = 0.0;
-  float result_g = 0.0;
-  float result_b = 0.0;
-  float result_a = 0.0;
-  for(int i=-2; i<=2; ++i) {
-    for(int j=-2; j<=2; ++j) {
-      int x = texelCoords.x + i;
-      int y = texelCoords.y + j;
-      vec4 pixel = vec4(0.0, 0.0, 0.0, 255.0);
-      if(!(x < 0 || x > 255 || y < 0 || y > 255)) {
-        vec4 pixel = imageLoad(input_texture, ivec2(x,y));
-        float gauss_val = gaussian_kernel[(j + 2) * 5 + (i + 2)];
-        result_r += pixel.r * gauss_val;
-        result_g += pixel.g * gauss_val;
-        result_b += pixel.b * gauss_val;
-        result_a += pixel.a * gauss_val;
-      }
-    }
-  }
 
-  result_r /= kernel_sum;
-  result_g /= kernel_sum;
-  result_b /= kernel_sum;
-  result_a /= kernel_sum;
-
-  // [OT] Example of swapping the red and green channels
-  // pixel.rg = pixel.gr;
-
-  // Check for ranges to be in threshold
-  if (in_range(result_r, 0) == false || in_range(result_g, 1) == false ||
-      in_range(result_b, 2) == false) {
-    // White -> out of range
-    result_r = 1.0;
-    result_g = 1.0;
-    result_b = 1.0;
+std::unique_ptr<GaussianComputeFilter> compute_filter;
+
+GaussianComputeFilter& computeFilter() {
+  if (!compute_filter) {
+    compute_filter = std::make_unique<GaussianComputeFilter>();
+    compute_filter->setProgramCacheDirectory(program_cache_directory);
+    compute_filter->setProfiler(gpu_profiler.get());
   }
- 
-  // Now write the modified pixel to the second texture.
-  imageStore(output_texture, texelCoords, vec4(result_r, result_g, result_b, result_a));
+  return *compute_filter;
 }
 
-)" };
-
+void gaussianFilterTexture(FilterMode mode = FilterMode::Direct5x5,
+                           int radius = FilterParams().radius,
+                           float sigma = FilterParams().sigma,
+                           BorderMode border = FilterParams().border,
+                           int iterations = FilterParams().iterations,
+                           const PostFilters& post = PostFilters()) {
 
-void gaussianFilterTexture() {
-
-  // Creating the compute shader, and the program object containing the shader
-  GLuint progHandle = glCreateProgram();
-  GLuint cs = glCreateShader(GL_COMPUTE_SHADER);
-
-  const char *source = gaussian_filter_computeshader_source.c_str();
-  glShaderSource(cs, 1, &source, NULL);
-  GL_ERROR_CHECK(glCompileShader(cs));
-  int rvalue;
-  GL_ERROR_CHECK(glGetShaderiv(cs, GL_COMPILE_STATUS, &rvalue));
-  if (!rvalue) {
-    fprintf(stderr, "Error in compiling the compute shader\n");
-    GLchar log[10240];
-    GLsizei length;
-    glGetShaderInfoLog(cs, 10239, &length, log);
-    fprintf(stderr, "Compiler log:\n%s\n", log);
-    exit(40);
-  }
-  GL_ERROR_CHECK(glAttachShader(progHandle, cs));
-
-  GL_ERROR_CHECK(glLinkProgram(progHandle));
-  GL_ERROR_CHECK(glGetProgramiv(progHandle, GL_LINK_STATUS, &rvalue));
-  if (!rvalue) {
-    fprintf(stderr, "Error in linking compute shader program\n");
-    GLchar log[10240];
-    GLsizei length;
-    glGetProgramInfoLog(progHandle, 10239, &length, log);
-    fprintf(stderr, "Linker log:\n%s\n", log);
-    exit(41);
-  }
-  GL_ERROR_CHECK(glUseProgram(progHandle));
-
-  
   // Create other texture for output
 
-  GL_ERROR_CHECK(glGenTextures(1, &filtered_texture_id)); // Create texture object
+  // Replaces (and deletes) the previous one
+  filtered_texture = GLTexture::create(); // Create texture object
   GL_ERROR_CHECK(glActiveTexture(GL_TEXTURE1)); // Activate texunit 1
-  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, filtered_texture_id)); // Bind as 2D texture
+  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, filtered_texture.get())); // Bind as 2D texture
 
-  // Upload data and generate mipmaps
-  GL_ERROR_CHECK(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 256, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0));
-  GL_ERROR_CHECK(glGenerateMipmap(GL_TEXTURE_2D));
+  // Allocate level 0, the filter writes it. The display samples it without
+  // mipmaps.
+  GL_ERROR_CHECK(glTexImage2D(GL_TEXTURE_2D, 0, imageTextureFormat(texture_type), texture_width,
+                              texture_height, 0, GL_RGBA, texture_type, 0));
 
   // Set up UV coords 
   GL_ERROR_CHECK(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT));
@@ -440,68 +376,39 @@ void gaussianFilterTexture() {
 
   GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, 0));
 
-  // Bind the textures to the compute shader
-
-  GL_ERROR_CHECK(glBindImageTexture(
-    0,
-    texture_id,
-    0,
-    GL_FALSE,
-    0,
-    GL_READ_ONLY,
-    GL_RGBA8 // Treat stores as normalized 8-bit unsigned integers
-  ));
-
-  GL_ERROR_CHECK(glBindImageTexture(
-    1,
-    filtered_texture_id,
-    0,
-    GL_FALSE,
-    0,
-    GL_WRITE_ONLY,
-    GL_RGBA8 // Treat stores as normalized 8-bit unsigned integers
-  ));
-
-  // Bind the thresholds
-  GLint min_threshold;
-  GL_ERROR_CHECK(min_threshold = glGetUniformLocation(progHandle, "rgb_min_threshold"));
-  GL_ERROR_CHECK(glUniform3f(min_threshold, min_rgb_threshold.r, min_rgb_threshold.g, min_rgb_threshold.b));
-  
-  GLint max_threshold;
-  GL_ERROR_CHECK(max_threshold = glGetUniformLocation(progHandle, "rgb_max_threshold"));
-  GL_ERROR_CHECK(glUniform3f(max_threshold, max_rgb_threshold.r, max_rgb_threshold.g, max_rgb_threshold.b));
-
-  GL_ERROR_CHECK(glDispatchCompute(256 / 16, 256 / 16, 1)); // 256^2 threads in blocks of 16^2
-
-  GL_ERROR_CHECK(glUseProgram(0));
+  FilterParams params;
+  params.radius = radius;
+  params.sigma = sigma;
+  params.border = border;
+  params.iterations = iterations;
+  params.min_threshold = min_rgb_threshold;
+  params.max_threshold = max_rgb_threshold;
+
+  GpuProfileScope scope(gpu_profiler.get(), "filter");
+  computeFilter().apply(input_texture.get(), filtered_texture.get(), texture_width, texture_height, params,
+                        mode, post);
+  render_state.invalidate(); // The filter changes the bindings
 }
 
-
+// Deletes every GL object while the context is still current
 void unloadOpenGL() {
-  GL_ERROR_CHECK(glDeleteTextures(1, &texture_id));
+  input_texture.reset();
+  filtered_texture.reset();
+  filtered_readback.reset();
+  compute_filter.reset(); // Its programs and pooled textures
 
   // Delete the shaders
   GL_ERROR_CHECK(glUseProgram(0));
-  shader_program.release(); // Also detaches shaders before deleting them
-
-  // Select the VAO
-  GL_ERROR_CHECK(glBindVertexArray(vaoId));
-
-  // Disable the VBO index from the VAO attributes list
-  GL_ERROR_CHECK(glDisableVertexAttribArray(0));
-  GL_ERROR_CHECK(glDisableVertexAttribArray(1));
-
-  // Delete the vertex VBO
-  GL_ERROR_CHECK(glBindBuffer(GL_ARRAY_BUFFER, 0));
-  GL_ERROR_CHECK(glDeleteBuffers(1, &vboId));
+  shader_program = nullptr;
+  program_cache.reset(); // Also detaches shaders before deleting them
 
-  // Delete the index VBO
-  GL_ERROR_CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
-  GL_ERROR_CHECK(glDeleteBuffers(1, &vboiId));
-
-  // Delete the VAO
+  // Delete the VAO first, the buffers are only really deleted once it
+  // doesn't reference them anymore
   GL_ERROR_CHECK(glBindVertexArray(0));
-  GL_ERROR_CHECK(glDeleteVertexArrays(1, &vaoId));
+  vertex_array.reset();
+  vertex_buffer.reset();
+  index_buffer.reset();
+  render_state.invalidate();
 }
 
 
@@ -509,44 +416,61 @@ void unloadOpenGL() {
 static int continue_in_main_loop = 1;
 
 static void displayProc(void) {
-  
+  if (gpu_profiler)
+    gpu_profiler->collect(); // Previous frames, without waiting for them
+  GpuProfileScope scope(gpu_profiler.get(), "display");
+#ifdef FILTER_COUNT_GL_CALLS
+  const auto gl_calls_before = gl_calls_count;
+#endif
+
   // Render the scene  
   GL_ERROR_CHECK(glClear(GL_COLOR_BUFFER_BIT));
 
-  GL_ERROR_CHECK(glUseProgram(shader_program->getId()));
-
-  // Bind the texture to texture unit 1
-  GL_ERROR_CHECK(glActiveTexture(GL_TEXTURE1));
-  GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, filtered_texture_id));
-
-  GLint sampler2D_loc;
-  GL_ERROR_CHECK(sampler2D_loc = glGetUniformLocation(shader_program->getId(), "texture_diffuse"));
-  GL_ERROR_CHECK(glUniform1i(sampler2D_loc, 1)); // Set texture unit 1 for the sampler2D
-
-  // Bind to the VAO that has all the information about the vertices
-  GL_ERROR_CHECK(glBindVertexArray(vaoId));
-  GL_ERROR_CHECK(glEnableVertexAttribArray(0));
-  GL_ERROR_CHECK(glEnableVertexAttribArray(1));
-  GL_ERROR_CHECK(glEnableVertexAttribArray(2));
+  // Nothing is unbound after drawing: as long as nothing else ran, every
+  // binding is still there and the frame is a clear and a draw
+  render_state.useProgram(shader_program->getId());
+  render_state.bindTexture(filtered_texture_unit, filtered_texture.get());
 
-  // Bind to the index VBO that has all the information about the order of the vertices
-  GL_ERROR_CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vboiId));
+  // The VAO has all the information about the vertices and their order
+  render_state.bindVertexArray(vertex_array.get());
 
   // Draw the vertices
   GL_ERROR_CHECK(glDrawElements(GL_TRIANGLES, indices_count, GL_UNSIGNED_BYTE, 0));
 
-  // Put everything back to default (deselect)
-  GL_ERROR_CHECK(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
-  GL_ERROR_CHECK(glDisableVertexAttribArray(0));
-  GL_ERROR_CHECK(glDisableVertexAttribArray(1));
-  GL_ERROR_CHECK(glDisableVertexAttribArray(2));
-  GL_ERROR_CHECK(glBindVertexArray(0));
-
-  GL_ERROR_CHECK(glUseProgram(0));
+#ifdef FILTER_COUNT_GL_CALLS
+  frame_gl_calls = gl_calls_count - gl_calls_before;
+#endif
 
   glutSwapBuffers();
 }
 
+static void idleProc(void) {
+  if (!filtered_readback || filtered_readback->ready() == false)
+    return;
+
+  std::vector<unsigned char> image_data;
+  filtered_readback->finish(image_data);
+  render_state.invalidate();
+  if (savePNGToFile(filtered_file, texture_width, texture_height, GL_RGBA, texture_type,
+                    image_data))
+    std::cout << "Filtered image saved to " << filtered_file << "\n";
+  glutIdleFunc(nullptr);
+}
+
+// Called while the window and its context still exist, whether it's closed
+// or the main loop is left
+static void closeProc(void) {
+#ifdef FILTER_COUNT_GL_CALLS
+  std::cout << frame_gl_calls << " GL calls in the last frame\n";
+#endif
+  if (gpu_profiler) {
+    saveGpuProfile(*gpu_profiler, profile_file, trace_file);
+    if (compute_filter)
+      compute_filter->setProfiler(nullptr);
+    gpu_profiler.reset();
+  }
+}
+
 static void keyProc(unsigned char key, int x, int y) {
   int need_redisplay = 1;
 
@@ -555,6 +479,18 @@ static void keyProc(unsigned char key, int x, int y) {
       glutLeaveMainLoop();
       break;
 
+    case 's': // Save the filtered image, idleProc writes it once it's read back
+      if (!filtered_readback)
+        filtered_readback = std::make_unique<PixelReadback>();
+      if (filtered_readback->pending() == false) {
+        filtered_readback->start(filtered_texture.get(), texture_width, texture_height, GL_RGBA,
+                                  texture_type);
+        render_state.invalidate();
+        glutIdleFunc(idleProc);
+      }
+      need_redisplay = 0;
+      break;
+
     default:
       need_redisplay = 0;
       break;
@@ -572,13 +508,306 @@ static void reshapeProc(int width, int height) {
   glutPostRedisplay();
 }
 
+// Command line options (FreeGLUT's own options are removed by glutInit)
+struct Options {
+  // The fixed 5x5 kernel unless --separable or --tiled, which take a radius
+  // and sigma
+  FilterMode mode = FilterMode::Direct5x5;
+  int radius = FilterParams().radius;
+  float sigma = FilterParams().sigma;
+  BorderMode border = FilterParams().border;
+  int iterations = FilterParams().iterations;
+  RGB min_threshold = min_rgb_threshold;
+  RGB max_threshold = max_rgb_threshold;
+  PostFilters post;
+  std::string input_file; // Image to filter instead of the default texture
+  // Batch mode: filter every PNG of a directory without a window
+  bool batch = false;
+  std::string batch_input_directory;
+  std::string batch_output_directory;
+  // Runs every line of this file as the arguments of a batch, on one session
+  std::string jobs_file;
+  bool cpu = false; // Batch mode only: always filter on the CPU
+  // Converts PNGs into raw images, or raw images into PNGs, and exits
+  bool convert = false;
+  std::string convert_input; // A file or a directory
+  std::string convert_output;
+  unsigned threads = 0;
+  unsigned io_threads = 2; // Batch mode only: PNG decoding and encoding threads, each
+  bool mapped_upload = true; // Batch mode only: upload through persistently mapped buffers
+  bool mapped_input = false; // Batch mode only: decode from memory mapped files
+  PNGWriteOptions png; // Batch mode only: compression of the output files
+  int cache_mb = -1; // Batch mode only: image cache budget, -1 is 256 with --jobs and 0 otherwise
+  int array_layers = 0; // Batch mode only: images of the same size filtered per array texture
+  std::string shader_cache = program_cache_directory; // Empty disables the on-disk cache
+  bool gl_debug = false; // Debug context, errors reported by the debug output callback
+  bool gl_debug_sync = false; // Same, reported from inside the failing call
+  std::string profile_file; // GPU time statistics of every pass, as JSON
+  std::string trace_file; // GPU timeline of every pass, in Chrome trace format
+};
+
+// Parses "R,G,B", returns false if 'text' isn't three numbers
+bool parseRGB(const char *text, RGB& rgb) {
+  char end;
+  return std::sscanf(text, "%f,%f,%f%c", &rgb.r, &rgb.g, &rgb.b, &end) == 3;
+}
+
+// PNG row filter named 'name', returns false if there's none
+bool parsePNGFilter(const char *name, PNGFilter& filter) {
+  const struct {
+    const char *name;
+    PNGFilter filter;
+  } filters[] = {
+    { "none", PNGFilter::None }, { "sub", PNGFilter::Sub }, { "up", PNGFilter::Up },
+    { "average", PNGFilter::Average }, { "paeth", PNGFilter::Paeth },
+    { "adaptive", PNGFilter::Adaptive }
+  };
+  for (auto& candidate : filters) {
+    if (std::strcmp(name, candidate.name) == 0) {
+      filter = candidate.filter;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Writes the command line usage to stderr
+void printUsage(const char *program_name) {
+  std::cerr << "Usage: " << program_name << " [--direct | --separable | --tiled] [--radius N] [--sigma S] [--clamp-border] [--iterations N] [THRESHOLDS] [POST_FILTERS] [--input FILE]\n"
+            << "       " << program_name <<  " --batch INPUT_DIR OUTPUT_DIR [--cpu] [--threads N] [--io-threads N] [--no-mapped-upload] [--mmap]"
+            << " [--png-level 0-9] [--png-filter none|sub|up|average|paeth|adaptive] [--cache-mb N] [--array-layers N]"
+            << " [--direct | --separable | --tiled] [--radius N] [--sigma S] [--clamp-border] [--iterations N] [THRESHOLDS] [POST_FILTERS]\n"
+            << "       " << program_name << " --jobs FILE [--cpu] [--threads N] [--cache-mb N]"
+            << " (each line of FILE: INPUT_DIR OUTPUT_DIR [batch options])\n"
+            << "       " << program_name << " --convert INPUT OUTPUT [--threads N] [--png-level 0-9] [--png-filter FILTER]\n"
+            << "THRESHOLDS: [--min-threshold R,G,B] [--max-threshold R,G,B]\n"
+            << "POST_FILTERS (GL only): [--dilate N | --erode N | --open N | --close N] [--grayscale]\n"
+            << "Both also take [--shader-cache DIR | --no-shader-cache] [--gl-debug | --gl-debug-sync]"
+            << " [--profile FILE.json] [--trace FILE.json]"
+            << std::endl;
+}
+
+// Options of the command line 'argv', throws std::invalid_argument on an
+// unknown option or a missing value
+Options parseOptions(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--direct") == 0)
+      options.mode = FilterMode::Direct5x5;
+    else if (std::strcmp(argv[i], "--separable") == 0)
+      options.mode = FilterMode::Separable;
+    else if (std::strcmp(argv[i], "--tiled") == 0)
+      options.mode = FilterMode::Tiled;
+    else if (std::strcmp(argv[i], "--radius") == 0 && i + 1 < argc)
+      options.radius = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--sigma") == 0 && i + 1 < argc)
+      options.sigma = static_cast<float>(std::atof(argv[++i]));
+    else if (std::strcmp(argv[i], "--clamp-border") == 0)
+      options.border = BorderMode::Clamp;
+    else if (std::strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+      options.iterations = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--min-threshold") == 0 && i + 1 < argc &&
+             parseRGB(argv[i + 1], options.min_threshold))
+      ++i;
+    else if (std::strcmp(argv[i], "--max-threshold") == 0 && i + 1 < argc &&
+             parseRGB(argv[i + 1], options.max_threshold))
+      ++i;
+    else if (std::strcmp(argv[i], "--dilate") == 0 && i + 1 < argc) {
+      options.post.morphology = Morphology::Dilate;
+      options.post.morphology_radius = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--erode") == 0 && i + 1 < argc) {
+      options.post.morphology = Morphology::Erode;
+      options.post.morphology_radius = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--open") == 0 && i + 1 < argc) {
+      options.post.morphology = Morphology::Open;
+      options.post.morphology_radius = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--close") == 0 && i + 1 < argc) {
+      options.post.morphology = Morphology::Close;
+      options.post.morphology_radius = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--grayscale") == 0)
+      options.post.grayscale = true;
+    else if (std::strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+      options.input_file = argv[++i];
+    else if (std::strcmp(argv[i], "--batch") == 0 && i + 2 < argc) {
+      options.batch = true;
+      options.batch_input_directory = argv[++i];
+      options.batch_output_directory = argv[++i];
+    } else if (std::strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      options.batch = true;
+      options.jobs_file = argv[++i];
+    } else if (std::strcmp(argv[i], "--convert") == 0 && i + 2 < argc) {
+      options.convert = true;
+      options.convert_input = argv[++i];
+      options.convert_output = argv[++i];
+    } else if (std::strcmp(argv[i], "--cpu") == 0)
+      options.cpu = true;
+    else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      options.threads = static_cast<unsigned>(std::max(std::atoi(argv[++i]), 0));
+    else if (std::strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc)
+      options.io_threads = static_cast<unsigned>(std::max(std::atoi(argv[++i]), 1));
+    else if (std::strcmp(argv[i], "--no-mapped-upload") == 0)
+      options.mapped_upload = false;
+    else if (std::strcmp(argv[i], "--mmap") == 0)
+      options.mapped_input = true;
+    else if (std::strcmp(argv[i], "--png-level") == 0 && i + 1 < argc)
+      options.png.compression_level = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--png-filter") == 0 && i + 1 < argc &&
+             parsePNGFilter(argv[i + 1], options.png.filter))
+      ++i;
+    else if (std::strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc)
+      options.cache_mb = std::max(std::atoi(argv[++i]), 0);
+    else if (std::strcmp(argv[i], "--array-layers") == 0 && i + 1 < argc)
+      options.array_layers = std::max(std::atoi(argv[++i]), 0);
+    else if (std::strcmp(argv[i], "--shader-cache") == 0 && i + 1 < argc)
+      options.shader_cache = argv[++i];
+    else if (std::strcmp(argv[i], "--no-shader-cache") == 0)
+      options.shader_cache.clear();
+    else if (std::strcmp(argv[i], "--gl-debug") == 0)
+      options.gl_debug = true;
+    else if (std::strcmp(argv[i], "--gl-debug-sync") == 0)
+      options.gl_debug = options.gl_debug_sync = true;
+    else if (std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+      options.profile_file = argv[++i];
+    else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+      options.trace_file = argv[++i];
+    else {
+      throw std::invalid_argument(std::string("Unknown option or missing value: ") + argv[i]);
+    }
+  }
+  return options;
+}
+
+// Options of the program's own command line, prints the usage and exits on
+// an error
+Options parseCommandLine(int argc, char **argv) {
+  try {
+    return parseOptions(argc, argv);
+  } catch (std::invalid_argument& e) {
+    std::cerr << e.what() << "\n";
+    printUsage(argv[0]);
+    std::exit(1);
+  }
+}
+
+// Batch options of 'options', for --batch and for every line of --jobs
+BatchOptions batchOptions(const Options& options) {
+  BatchOptions batch;
+  batch.input_directory = options.batch_input_directory;
+  batch.output_directory = options.batch_output_directory;
+  batch.params.radius = options.radius;
+  batch.params.sigma = options.sigma;
+  batch.params.border = options.border;
+  batch.params.iterations = options.iterations;
+  batch.params.min_threshold = options.min_threshold;
+  batch.params.max_threshold = options.max_threshold;
+  batch.mode = options.mode;
+  batch.post = options.post;
+  batch.force_cpu = options.cpu;
+  batch.threads = options.threads;
+  batch.decode_threads = options.io_threads;
+  batch.encode_threads = options.io_threads;
+  if (options.mapped_upload == false)
+    batch.upload_slot_bytes = 0;
+  if (options.mapped_input)
+    batch.input = PNGInput::MemoryMapped;
+  batch.png = options.png;
+  batch.program_cache_directory = options.shader_cache;
+  batch.profile_file = options.profile_file;
+  batch.trace_file = options.trace_file;
+  batch.gl_debug = options.gl_debug;
+  batch.gl_debug_sync = options.gl_debug_sync;
+  const int cache_mb = options.cache_mb >= 0 ? options.cache_mb
+                                             : (options.jobs_file.empty() ? 0 : 256);
+  batch.cache_bytes = static_cast<size_t>(cache_mb) * 1024 * 1024;
+  batch.array_layers = options.array_layers;
+  return batch;
+}
+
+// Runs every line of options.jobs_file, "INPUT_DIR OUTPUT_DIR [batch options]"
+// with whitespace separated arguments, as a batch. The jobs share one session,
+// so inputs already seen by an earlier job come from the image cache. Empty
+// lines and lines starting with # are skipped, a malformed line fails its job
+// only. Returns the number of files and malformed lines that failed.
+int runBatchJobs(const Options& options, const char *program_name) {
+  std::ifstream jobs(options.jobs_file);
+  if (!jobs)
+    throw std::runtime_error("Cannot open " + options.jobs_file);
+
+  BatchSession session(batchOptions(options));
+  int failed = 0, job_count = 0;
+  std::string line;
+  for (int line_number = 1; std::getline(jobs, line); ++line_number) {
+    std::istringstream words(line);
+    std::vector<std::string> args = { program_name, "--batch" };
+    for (std::string word; words >> word;)
+      args.push_back(word);
+    if (args.size() == 2 || args[2][0] == '#')
+      continue;
+
+    std::vector<char*> argv;
+    for (auto& arg : args)
+      argv.push_back(&arg[0]);
+    ++job_count;
+    try {
+      // A malformed line only fails its own job
+      Options job = parseOptions(static_cast<int>(argv.size()), argv.data());
+      std::cout << "Job " << job_count << ": " << job.batch_input_directory << " -> "
+                << job.batch_output_directory << "\n";
+      BatchStats stats;
+      failed += runBatch(session, batchOptions(job), stats);
+    } catch (std::exception& e) {
+      std::cerr << "Job " << job_count << " (line " << line_number << ") failed: " << e.what()
+                << std::endl;
+      ++failed;
+    }
+  }
+  return failed;
+}
+
 int main(int argc, char **argv) {
+
+  // Converting images needs no GL at all
+  if (std::find_if(argv + 1, argv + argc, [](const char *arg) {
+        return std::strcmp(arg, "--convert") == 0; }) != argv + argc) {
+    Options options = parseCommandLine(argc, argv);
+    ThreadPool pool(options.threads ? options.threads : std::thread::hardware_concurrency());
+    if (isDirectory(options.convert_input)) {
+      return convertImages(options.convert_input, options.convert_output, options.png, pool) == 0
+             ? 0 : 1;
+    }
+    return convertImage(options.convert_input.c_str(), options.convert_output.c_str(),
+                        options.png, &pool) ? 0 : 1;
+  }
+
+  // Batch mode never opens a window, so it must not go through glutInit
+  // (which needs a display server)
+  if (std::find_if(argv + 1, argv + argc, [](const char *arg) {
+        return std::strcmp(arg, "--batch") == 0 || std::strcmp(arg, "--jobs") == 0;
+      }) != argv + argc) {
+    Options options = parseCommandLine(argc, argv);
+    try {
+      if (options.jobs_file.empty() == false)
+        return runBatchJobs(options, argv[0]) == 0 ? 0 : 1;
+      return runBatch(batchOptions(options)) == 0 ? 0 : 1;
+    } catch (std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+  }
   
   glutInitContextVersion(4, 3);
-  //glutInitContextFlags(GLUT_DEBUG);
   glutInitContextProfile(GLUT_CORE_PROFILE);
   glutInit(&argc, argv);
 
+  Options options = parseCommandLine(argc, argv);
+  if (options.gl_debug)
+    glutInitContextFlags(GLUT_DEBUG);
+  program_cache_directory = options.shader_cache;
+  min_rgb_threshold = options.min_threshold;
+  max_rgb_threshold = options.max_threshold;
+  profile_file = options.profile_file;
+  trace_file = options.trace_file;
+
   glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE);
   glutInitWindowSize(300, 300);
   glutInitWindowPosition(140, 140);
@@ -587,6 +816,7 @@ int main(int argc, char **argv) {
   glutKeyboardFunc(keyProc);
   glutDisplayFunc(displayProc);
   glutReshapeFunc(reshapeProc);
+  glutCloseFunc(closeProc);
 
   if(glxwInit()) {
     std::cerr << "Failed to initialize GL3W" << std::endl;    
@@ -599,10 +829,20 @@ int main(int argc, char **argv) {
   ss << "OpenGL version supported by this platform: [" << glGetString(GL_VERSION) << "]\n";
   std::cout << ss.str();
 
+  if (options.gl_debug && enableGLDebugOutput(options.gl_debug_sync) == false)
+    std::cerr << "The GL context has no debug output" << std::endl;
+
+  if (profile_file.empty() == false || trace_file.empty() == false)
+    gpu_profiler = std::make_unique<GpuProfiler>();
+
   setupQuad();
+  if (options.input_file.empty() == false)
+    texture_file = options.input_file;
   loadPNGTexture();
   setupShaders();
-  gaussianFilterTexture();
+
+  gaussianFilterTexture(options.mode, options.radius, options.sigma, options.border,
+                        options.iterations, options.post);
 
   glutMainLoop(); // Start main window loop - return on close
 
@@ -0,0 +1,126 @@
+#ifndef HEADER_MAPPEDFILE_HPP
+#define HEADER_MAPPEDFILE_HPP
+
+#include <cstddef>
+#include <iostream>
+#include <stdio.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file. Reading from the mapping skips the
+// copy from the page cache into stdio's buffer and the read() system calls.
+class MappedFile {
+public:
+  MappedFile() = default;
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    close();
+  }
+
+  bool open(const char *file_name) {
+    close();
+#ifdef _WIN32
+    file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                       FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    LARGE_INTEGER file_size;
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size)) {
+      std::cerr << "Error: cannot open " << file_name << std::endl;
+      close();
+      return false;
+    }
+    map_size = static_cast<size_t>(file_size.QuadPart);
+    if (map_size == 0)
+      return true;
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping != NULL)
+      map_data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+    fd = ::open(file_name, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+      perror(file_name);
+      close();
+      return false;
+    }
+    map_size = static_cast<size_t>(info.st_size);
+    if (map_size == 0) // mmap rejects empty mappings
+      return true;
+    void *address = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address != MAP_FAILED)
+      map_data = static_cast<const unsigned char*>(address);
+#endif
+    if (map_data == nullptr) {
+      std::cerr << "Error: cannot map " << file_name << std::endl;
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  // Hints that the file is about to be read once from start to end: the
+  // kernel reads ahead aggressively and drops the pages behind the reader
+  // early. Sequential scanning was requested when opening on Windows.
+  void adviseSequential() {
+#ifndef _WIN32
+    if (map_data) {
+      void *address = const_cast<unsigned char*>(map_data);
+      madvise(address, map_size, MADV_SEQUENTIAL);
+      madvise(address, map_size, MADV_WILLNEED);
+    }
+#endif
+  }
+
+  const unsigned char *data() const {
+    return map_data;
+  }
+
+  size_t size() const {
+    return map_size;
+  }
+
+  void close() {
+#ifdef _WIN32
+    if (map_data)
+      UnmapViewOfFile(map_data);
+    if (mapping != NULL)
+      CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+      CloseHandle(file);
+    mapping = NULL;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (map_data)
+      munmap(const_cast<unsigned char*>(map_data), map_size);
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+#endif
+    map_data = nullptr;
+    map_size = 0;
+  }
+
+private:
+#ifdef _WIN32
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = NULL;
+#else
+  int fd = -1;
+#endif
+  const unsigned char *map_data = nullptr;
+  size_t map_size = 0;
+};
+
+#endif // HEADER_MAPPEDFILE_HPP
@@ -0,0 +1,151 @@
+#ifndef HEADER_PIPELINE_HPP
+#define HEADER_PIPELINE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Building blocks of multi-stage pipelines where every stage runs on its own
+// threads and hands its results to the next one
+
+// FIFO queue with a maximum size. push() blocks while the queue is full, so a
+// fast producer can't run arbitrarily far ahead of a slow consumer.
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity ? capacity : 1) {}
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  // Returns false, dropping 'item', if the queue has been closed
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this] { return items.size() < capacity || closed; });
+    if (closed)
+      return false;
+    items.emplace_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  // Blocks until an item is available. Returns false once the queue has been
+  // closed and drained.
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return !items.empty() || closed; });
+    if (items.empty())
+      return false;
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  // No more items will be pushed, consumers drain what's left
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+  }
+
+private:
+  const size_t capacity;
+  std::deque<T> items;
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  bool closed = false;
+};
+
+// Throughput counters of a pipeline stage, updated concurrently by all the
+// threads running it
+struct StageCounters {
+  explicit StageCounters(const char *name) : name(name) {}
+
+  // Records one item of 'bytes' bytes which took 'busy' time to process
+  void add(size_t bytes, std::chrono::steady_clock::duration busy) {
+    items += 1;
+    this->bytes += bytes;
+    busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count();
+  }
+
+  // Prints items/s and MB/s over 'wall_seconds', and the time the stage's
+  // threads spent working (the remainder was spent waiting on the queues)
+  void print(std::ostream& os, double wall_seconds) const {
+    double busy_seconds = busy_ns.load() / 1e9;
+    os << std::left << std::setw(8) << name << std::right << std::fixed << std::setprecision(2)
+       << std::setw(8) << items.load() << " items" << std::setw(10) << items.load() / wall_seconds
+       << " items/s" << std::setw(10) << bytes.load() / 1e6 / wall_seconds << " MB/s"
+       << std::setw(10) << busy_seconds << "s busy\n";
+  }
+
+  const char *name;
+  std::atomic<uint64_t> items{ 0 };
+  std::atomic<uint64_t> bytes{ 0 }; // Decoded image bytes
+  std::atomic<int64_t> busy_ns{ 0 };
+};
+
+// Recycles the byte buffers images travel in, so that once the pipeline has
+// seen its largest image no more memory is allocated
+class BufferPool {
+public:
+  explicit BufferPool(size_t max_buffers) : max_buffers(max_buffers) {}
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  // Returns a buffer of 'size' bytes, reusing the smallest free one that fits
+  // (or else the largest one, which is then grown). Contents are unspecified.
+  std::vector<unsigned char> acquire(size_t size) {
+    std::vector<unsigned char> buffer;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto best = buffers.end();
+      for (auto it = buffers.begin(); it != buffers.end(); ++it) {
+        bool fits = it->capacity() >= size;
+        if (best == buffers.end() ||
+            (fits && (best->capacity() < size || it->capacity() < best->capacity())) ||
+            (!fits && best->capacity() < size && it->capacity() > best->capacity()))
+          best = it;
+      }
+      if (best != buffers.end()) {
+        buffer = std::move(*best);
+        buffers.erase(best);
+      }
+      if (buffer.capacity() < size)
+        allocations++;
+    }
+    buffer.resize(size);
+    return buffer;
+  }
+
+  // Gives a buffer back, it's freed if the pool is already full
+  void release(std::vector<unsigned char> buffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (buffers.size() < max_buffers && buffer.capacity() > 0)
+      buffers.push_back(std::move(buffer));
+  }
+
+  // Number of acquire() calls which had to allocate
+  size_t allocationsCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return allocations;
+  }
+
+private:
+  const size_t max_buffers;
+  std::vector<std::vector<unsigned char>> buffers;
+  mutable std::mutex mutex;
+  size_t allocations = 0;
+};
+
+#endif // HEADER_PIPELINE_HPP
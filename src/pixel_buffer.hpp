@@ -0,0 +1,274 @@
+#ifndef HEADER_PIXELBUFFER_HPP
+#define HEADER_PIXELBUFFER_HPP
+
+#include <GLXW/glxw.h>
+#include "gl_error_check.hpp"
+#include "image_layout.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// True if the context supports immutable buffer storage (GL 4.4 or
+// ARB_buffer_storage), needed for persistently mapped buffers
+bool glSupportsBufferStorage() {
+  GLint major = 0, minor = 0;
+  glGetIntegerv(GL_MAJOR_VERSION, &major);
+  glGetIntegerv(GL_MINOR_VERSION, &minor);
+  if (major > 4 || (major == 4 && minor >= 4))
+    return true;
+
+  GLint extensions_count = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &extensions_count);
+  for (GLint i = 0; i < extensions_count; ++i) {
+    auto extension = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+    if (extension && std::strcmp(extension, "GL_ARB_buffer_storage") == 0)
+      return true;
+  }
+  return false;
+}
+
+// Ring of pixel unpack buffer slots, persistently mapped for writing.
+//
+// Images are written (e.g. decoded) straight into a slot's mapped memory, from
+// any thread, and uploaded to a texture with glTexSubImage2D sourcing the
+// buffer. The upload is asynchronous: the slot is fenced and must not be
+// written again before waitIdle() returned, by which time the GL has consumed
+// it. With a few slots in flight uploads overlap with the previous images'
+// compute dispatches instead of stalling on a client memory copy.
+//
+// The mapping is coherent, so writes are visible to the GL without flushes.
+// Every GL call must be made on the thread where the context is current.
+class PixelUploadRing {
+public:
+  PixelUploadRing(size_t slot_size, unsigned slot_count) : fences(slot_count, nullptr) {
+    if (slot_count == 0)
+      throw std::invalid_argument("PixelUploadRing needs at least one slot");
+
+    // Keep every slot offset aligned for any pixel type
+    this->slot_size = (slot_size + slot_alignment - 1) / slot_alignment * slot_alignment;
+
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    GLsizeiptr total_size = static_cast<GLsizeiptr>(this->slot_size * slot_count);
+    GL_ERROR_CHECK(glGenBuffers(1, &buffer_id));
+    GL_ERROR_CHECK(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer_id));
+    GL_ERROR_CHECK(glBufferStorage(GL_PIXEL_UNPACK_BUFFER, total_size, nullptr, flags));
+    mapped = static_cast<unsigned char*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, total_size, flags));
+    GL_ERROR_CHECK(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+    if (mapped == nullptr) {
+      glDeleteBuffers(1, &buffer_id);
+      throw std::runtime_error("Could not map the pixel upload buffer");
+    }
+  }
+
+  PixelUploadRing(const PixelUploadRing&) = delete;
+  PixelUploadRing& operator=(const PixelUploadRing&) = delete;
+
+  ~PixelUploadRing() {
+    for (unsigned slot = 0; slot < slotCount(); ++slot)
+      waitIdle(slot);
+    GL_ERROR_CHECK(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer_id));
+    GL_ERROR_CHECK(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+    GL_ERROR_CHECK(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+    GL_ERROR_CHECK(glDeleteBuffers(1, &buffer_id));
+  }
+
+  unsigned slotCount() const {
+    return static_cast<unsigned>(fences.size());
+  }
+
+  size_t slotSize() const {
+    return slot_size;
+  }
+
+  // Mapped memory of 'slot', slotSize() bytes
+  unsigned char *slotData(unsigned slot) const {
+    return mapped + slot * slot_size;
+  }
+
+  // Uploads 'width' x 'height' pixels from the start of 'slot' into level 0 of
+  // 'texture', then fences the slot. Rows are 4-byte aligned.
+  void upload(unsigned slot, GLuint texture, int width, int height, GLenum format,
+              GLenum type = GL_UNSIGNED_BYTE) {
+    uploadImage(slot, texture, -1, width, height, format, type);
+  }
+
+  // Same as above into 'layer' of level 0 of the 2D array texture 'texture'
+  void uploadLayer(unsigned slot, GLuint texture, int layer, int width, int height,
+                   GLenum format, GLenum type = GL_UNSIGNED_BYTE) {
+    uploadImage(slot, texture, layer, width, height, format, type);
+  }
+
+  // Blocks until the GL is done reading 'slot', after which it can be written again
+  void waitIdle(unsigned slot) {
+    GLsync fence = fences[slot];
+    if (fence == nullptr)
+      return;
+
+    GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    if (status == GL_TIMEOUT_EXPIRED) {
+      stalls_count++;
+      do {
+        status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+      } while (status == GL_TIMEOUT_EXPIRED);
+    }
+    if (status == GL_WAIT_FAILED)
+      std::cerr << "[GLERROR] glClientWaitSync failed on upload slot " << slot << std::endl;
+
+    glDeleteSync(fence);
+    fences[slot] = nullptr;
+  }
+
+  // Uploads done, and how many times waitIdle() had to block on one
+  size_t uploadsCount() const {
+    return uploads_count;
+  }
+
+  size_t stallsCount() const {
+    return stalls_count;
+  }
+
+private:
+  static constexpr size_t slot_alignment = 256;
+
+  // Uploads to a 2D texture when 'layer' is -1, to that layer of a 2D array
+  // texture otherwise
+  void uploadImage(unsigned slot, GLuint texture, int layer, int width, int height,
+                   GLenum format, GLenum type) {
+    const GLenum target = layer < 0 ? GL_TEXTURE_2D : GL_TEXTURE_2D_ARRAY;
+    // The data pointer is an offset into the bound unpack buffer
+    const void *offset = reinterpret_cast<const void*>(static_cast<uintptr_t>(slot * slot_size));
+    GL_ERROR_CHECK(glPixelStorei(GL_UNPACK_ALIGNMENT, 4));
+    GL_ERROR_CHECK(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer_id));
+    GL_ERROR_CHECK(glBindTexture(target, texture));
+    if (layer < 0)
+      GL_ERROR_CHECK(glTexSubImage2D(target, 0, 0, 0, width, height, format, type, offset));
+    else
+      GL_ERROR_CHECK(glTexSubImage3D(target, 0, 0, 0, layer, width, height, 1, format, type,
+                                     offset));
+    GL_ERROR_CHECK(glBindTexture(target, 0));
+    // Left bound, client memory uploads elsewhere would read from the buffer
+    GL_ERROR_CHECK(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+
+    if (fences[slot])
+      glDeleteSync(fences[slot]);
+    fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    uploads_count++;
+  }
+
+  GLuint buffer_id = 0;
+  unsigned char *mapped = nullptr;
+  size_t slot_size = 0;
+  std::vector<GLsync> fences;
+  size_t uploads_count = 0;
+  size_t stalls_count = 0;
+};
+
+// Asynchronous texture readback: glGetTexImage into a pixel pack buffer
+// followed by a fence, so the copy is queued behind the work producing the
+// texture instead of stalling the caller. The pixels are fetched with
+// finish(), which only blocks if the GL isn't done yet (poll with ready()).
+// A 2D array texture is read back whole, and each layer fetched on its own.
+// Every call must be made on the thread where the context is current.
+class PixelReadback {
+public:
+  PixelReadback() = default;
+
+  PixelReadback(const PixelReadback&) = delete;
+  PixelReadback& operator=(const PixelReadback&) = delete;
+
+  ~PixelReadback() {
+    if (fence)
+      glDeleteSync(fence);
+    if (buffer_id != 0)
+      glDeleteBuffers(1, &buffer_id);
+  }
+
+  // Queues the copy of level 0 of 'texture', 'width' x 'height' pixels with
+  // 4-byte aligned rows. 'format' is GL_RGB or GL_RGBA, 'type' is
+  // GL_UNSIGNED_BYTE or GL_UNSIGNED_SHORT. 'texture' is a 2D array texture
+  // of 'layers' layers when that's not 0.
+  void start(GLuint texture, int width, int height, GLenum format,
+             GLenum type = GL_UNSIGNED_BYTE, int layers = 0) {
+    size_t pixel_size = (format == GL_RGBA ? 4 : 3) * (type == GL_UNSIGNED_BYTE ? 1 : 2);
+    const size_t rowbytes = alignedRowBytes(width * pixel_size);
+    size = rowbytes * height;
+    const size_t total_size = size * std::max(layers, 1);
+
+    if (buffer_id == 0)
+      GL_ERROR_CHECK(glGenBuffers(1, &buffer_id));
+    GL_ERROR_CHECK(glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer_id));
+    if (total_size > capacity) {
+      GL_ERROR_CHECK(glBufferData(GL_PIXEL_PACK_BUFFER, total_size, nullptr, GL_STREAM_READ));
+      capacity = total_size;
+    }
+    const GLenum target = layers ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+    GL_ERROR_CHECK(glPixelStorei(GL_PACK_ALIGNMENT, 4));
+    GL_ERROR_CHECK(glBindTexture(target, texture));
+    // The data pointer is an offset into the bound pack buffer. Layers are
+    // packed one after the other.
+    GL_ERROR_CHECK(glGetTexImage(target, 0, format, type, nullptr));
+    GL_ERROR_CHECK(glBindTexture(target, 0));
+    GL_ERROR_CHECK(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+
+    if (fence)
+      glDeleteSync(fence);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    completed = false;
+  }
+
+  // True if a readback was started and not finished yet
+  bool pending() const {
+    return fence != nullptr;
+  }
+
+  // True if the last readback started can be finished without blocking
+  bool ready() {
+    if (fence == nullptr)
+      return completed;
+    GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+    return status != GL_TIMEOUT_EXPIRED;
+  }
+
+  // Waits for the pending readback and copies the pixels of 'layer' to
+  // 'pixels'. Returns true if it had to block. Every layer can be fetched
+  // once the readback completed, only the first call waits.
+  bool finish(std::vector<unsigned char>& pixels, int layer = 0) {
+    bool stalled = false;
+    if (fence) {
+      GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+      stalled = status == GL_TIMEOUT_EXPIRED;
+      while (status == GL_TIMEOUT_EXPIRED)
+        status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+      if (status == GL_WAIT_FAILED)
+        std::cerr << "[GLERROR] glClientWaitSync failed on readback" << std::endl;
+      glDeleteSync(fence);
+      fence = nullptr;
+      completed = true;
+    }
+
+    pixels.resize(size);
+    GL_ERROR_CHECK(glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer_id));
+    auto mapped = static_cast<const unsigned char*>(
+      glMapBufferRange(GL_PIXEL_PACK_BUFFER, static_cast<GLintptr>(size * layer), size,
+                       GL_MAP_READ_BIT));
+    if (mapped) {
+      std::memcpy(pixels.data(), mapped, size);
+      GL_ERROR_CHECK(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+    } else {
+      std::cerr << "[GLERROR] Could not map the readback buffer" << std::endl;
+    }
+    GL_ERROR_CHECK(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+    return stalled;
+  }
+
+private:
+  GLuint buffer_id = 0;
+  size_t capacity = 0;
+  size_t size = 0; // Of one layer
+  GLsync fence = nullptr;
+  bool completed = false; // The last readback started, once finished
+};
+
+#endif // HEADER_PIXELBUFFER_HPP
@@ -0,0 +1,339 @@
+#ifndef HEADER_PNGWRITER_HPP
+#define HEADER_PNGWRITER_HPP
+
+#include <GLXW/glxw.h>
+#include <zlib.h>
+#include "image_utils.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <utility>
+#include <vector>
+#include <stdio.h>
+
+// Row filter applied before deflating (PNG filter method 0). Adaptive picks
+// the filter of every row with the minimum sum of absolute differences
+// heuristic, as libpng does by default; None is the fastest and Paeth usually
+// compresses photos best among the fixed ones.
+enum class PNGFilter { None, Sub, Up, Average, Paeth, Adaptive };
+
+struct PNGWriteOptions {
+  int compression_level = 6; // zlib level, 0 (stored) to 9
+  PNGFilter filter = PNGFilter::Adaptive;
+  // Images are deflated in strips of at least that many filtered bytes, every
+  // strip on its own thread. Smaller strips spread better over the cores but
+  // compress a bit worse, since matches can't reach back into the previous
+  // strip.
+  size_t strip_bytes = 1024 * 1024;
+};
+
+namespace png_writer {
+
+  // The five PNG filter types, in their file order
+  const PNGFilter row_filters[] = { PNGFilter::None, PNGFilter::Sub, PNGFilter::Up,
+                                    PNGFilter::Average, PNGFilter::Paeth };
+
+  // Written without branches on the pixel values so that the loops using it
+  // vectorize
+  unsigned char paethPredictor(int a, int b, int c) {
+    // |p - a|, |p - b| and |p - c| with p = a + b - c
+    int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+    int b_or_c = pb <= pc ? b : c;
+    return static_cast<unsigned char>(pa <= pb && pa <= pc ? a : b_or_c);
+  }
+
+  // Writes the filter type byte and the filtered bytes of 'row' to 'out'.
+  // 'prior' is the row above (zeros for the first row), 'bpp' the bytes per
+  // pixel.
+  void filterRow(PNGFilter filter, const unsigned char *row, const unsigned char *prior,
+                 size_t length, size_t bpp, unsigned char *out) {
+    *out++ = static_cast<unsigned char>(filter);
+    // The first pixel has no left neighbour, as if it were zero
+    switch (filter) {
+      case PNGFilter::None:
+        std::copy(row, row + length, out);
+        break;
+      case PNGFilter::Sub:
+        std::copy(row, row + bpp, out);
+        for (size_t i = bpp; i < length; ++i)
+          out[i] = static_cast<unsigned char>(row[i] - row[i - bpp]);
+        break;
+      case PNGFilter::Up:
+        for (size_t i = 0; i < length; ++i)
+          out[i] = static_cast<unsigned char>(row[i] - prior[i]);
+        break;
+      case PNGFilter::Average:
+        for (size_t i = 0; i < bpp; ++i)
+          out[i] = static_cast<unsigned char>(row[i] - prior[i] / 2);
+        for (size_t i = bpp; i < length; ++i)
+          out[i] = static_cast<unsigned char>(row[i] - (row[i - bpp] + prior[i]) / 2);
+        break;
+      case PNGFilter::Paeth:
+      case PNGFilter::Adaptive:
+        for (size_t i = 0; i < bpp; ++i)
+          out[i] = static_cast<unsigned char>(row[i] - prior[i]);
+        for (size_t i = bpp; i < length; ++i)
+          out[i] = static_cast<unsigned char>(
+            row[i] - paethPredictor(row[i - bpp], prior[i], prior[i - bpp]));
+        break;
+    }
+  }
+
+  // Sum of the filtered bytes taken as signed values, lower usually deflates
+  // better. Stops counting once past 'limit'.
+  size_t filteredCost(const unsigned char *filtered, size_t length, size_t limit) {
+    const size_t block = 1024; // Checked against 'limit' every block only
+    size_t cost = 0;
+    for (size_t begin = 0; begin < length && cost <= limit; begin += block) {
+      const size_t end = std::min(begin + block, length);
+      unsigned block_cost = 0;
+      for (size_t i = begin; i < end; ++i)
+        block_cost += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+      cost += block_cost;
+    }
+    return cost;
+  }
+
+  // Filters 'row' with 'filter', or with the cheapest filter if adaptive
+  // (which is tried with each one). 'scratch' holds length + 1 bytes.
+  void filterRowAdaptive(PNGFilter filter, const unsigned char *row, const unsigned char *prior,
+                         size_t length, size_t bpp, unsigned char *out,
+                         std::vector<unsigned char>& scratch) {
+    if (filter != PNGFilter::Adaptive) {
+      filterRow(filter, row, prior, length, bpp, out);
+      return;
+    }
+    // Every candidate is filtered into whichever of 'out' and 'scratch'
+    // doesn't hold the best one so far
+    unsigned char *best = nullptr;
+    size_t best_cost = SIZE_MAX;
+    for (auto candidate : row_filters) {
+      unsigned char *target = best == out ? scratch.data() : out;
+      filterRow(candidate, row, prior, length, bpp, target);
+      size_t cost = filteredCost(target + 1, length, best_cost);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best = target;
+      }
+    }
+    if (best != out)
+      std::copy(best, best + length + 1, out);
+  }
+
+  // Deflates 'size' bytes as a piece of a raw deflate stream. All strips but
+  // the last end with a sync flush, which byte aligns them without ending the
+  // stream, so the strips can simply be concatenated.
+  bool deflateStrip(const unsigned char *data, size_t size, int level, bool last,
+                    std::vector<unsigned char>& out) {
+    z_stream stream = {};
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return false;
+    // deflateBound assumes Z_FINISH, a sync flush adds an empty stored block
+    out.resize(deflateBound(&stream, static_cast<uLong>(size)) + 16);
+    stream.next_in = const_cast<Bytef*>(data);
+    stream.avail_in = static_cast<uInt>(size);
+    stream.next_out = out.data();
+    stream.avail_out = static_cast<uInt>(out.size());
+    int result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    bool ok = last ? result == Z_STREAM_END : (result == Z_OK && stream.avail_in == 0);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return ok;
+  }
+
+  void appendUInt32(std::vector<unsigned char>& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+      out.push_back(static_cast<unsigned char>(value >> shift));
+  }
+
+  // Appends a chunk whose data is the concatenation of 'pieces'
+  void appendChunk(std::vector<unsigned char>& out, const char *type,
+                   std::initializer_list<std::pair<const unsigned char*, size_t>> pieces) {
+    size_t length = 0;
+    for (auto& piece : pieces)
+      length += piece.second;
+    appendUInt32(out, static_cast<uint32_t>(length));
+    size_t type_offset = out.size();
+    out.insert(out.end(), type, type + 4);
+    for (auto& piece : pieces)
+      out.insert(out.end(), piece.first, piece.first + piece.second);
+    uLong crc = crc32(0L, out.data() + type_offset, static_cast<uInt>(out.size() - type_offset));
+    appendUInt32(out, static_cast<uint32_t>(crc));
+  }
+
+} // namespace png_writer
+
+// Encodes an image laid out as loadPNGFromFile returns it (4-byte aligned
+// rows, bottom row first, native endian 16-bit samples) into 'png'.
+//
+// The filtered rows are split into strips deflated independently, in
+// parallel on 'pool' when there are several (null encodes them on the
+// calling thread). The strips are stitched into a single zlib stream, one
+// IDAT chunk per strip, with the strips' Adler-32 checksums combined.
+bool encodePNG(std::vector<unsigned char>& png, int width, int height, GLint format, GLenum type,
+               const unsigned char *image_data, const PNGWriteOptions& options,
+               ThreadPool *pool = nullptr) {
+  if (type != GL_UNSIGNED_BYTE && type != GL_UNSIGNED_SHORT) {
+    std::cerr << "Unsupported type " << type << std::endl;
+    return false;
+  }
+  if (format != GL_RGB && format != GL_RGBA) {
+    std::cerr << "Unsupported format " << format << std::endl;
+    return false;
+  }
+  if (width <= 0 || height <= 0) {
+    std::cerr << "Cannot encode an empty image" << std::endl;
+    return false;
+  }
+  if (options.compression_level < 0 || options.compression_level > 9) {
+    std::cerr << "Compression level must be between 0 and 9" << std::endl;
+    return false;
+  }
+
+  const size_t sample_bytes = type == GL_UNSIGNED_SHORT ? 2 : 1;
+  const size_t bpp = (format == GL_RGBA ? 4 : 3) * sample_bytes;
+  const size_t length = width * bpp; // Of a row in the file
+  const size_t stride = alignedRowBytes(length);
+  const size_t filtered_stride = length + 1; // With the filter type byte
+
+  const int strip_rows = static_cast<int>(std::min<size_t>(
+    std::max<size_t>(options.strip_bytes / filtered_stride, 1), height));
+  const int strips_count = (height + strip_rows - 1) / strip_rows;
+
+  std::vector<std::vector<unsigned char>> strips(strips_count);
+  std::vector<uLong> checksums(strips_count);
+  std::vector<char> failed(strips_count, 0);
+
+  auto encodeStrip = [&](size_t strip) {
+    const int row_begin = static_cast<int>(strip) * strip_rows;
+    const int row_end = std::min(row_begin + strip_rows, height);
+
+    // Rows in file order (top first, big endian samples), the previous one
+    // kept for the filters
+    std::vector<unsigned char> row(length), prior(length, 0), scratch(filtered_stride);
+    std::vector<unsigned char> filtered(static_cast<size_t>(row_end - row_begin) * filtered_stride);
+    auto fileRow = [&](int y, std::vector<unsigned char>& out) {
+      const unsigned char *source = image_data + static_cast<size_t>(height - 1 - y) * stride;
+      if (sample_bytes == 2) {
+        for (size_t i = 0; i < length; i += 2) {
+          uint16_t sample;
+          std::memcpy(&sample, source + i, 2);
+          out[i] = static_cast<unsigned char>(sample >> 8);
+          out[i + 1] = static_cast<unsigned char>(sample & 0xff);
+        }
+      } else {
+        std::copy(source, source + length, out.begin());
+      }
+    };
+    if (row_begin > 0)
+      fileRow(row_begin - 1, prior);
+    for (int y = row_begin; y < row_end; ++y) {
+      fileRow(y, row);
+      png_writer::filterRowAdaptive(options.filter, row.data(), prior.data(), length, bpp,
+                                    filtered.data() + (y - row_begin) * filtered_stride, scratch);
+      std::swap(row, prior);
+    }
+
+    checksums[strip] = adler32(adler32(0L, Z_NULL, 0), filtered.data(),
+                               static_cast<uInt>(filtered.size()));
+    bool last = static_cast<int>(strip) + 1 == strips_count;
+    if (png_writer::deflateStrip(filtered.data(), filtered.size(), options.compression_level,
+                                 last, strips[strip]) == false)
+      failed[strip] = 1;
+  };
+
+  if (pool && strips_count > 1) {
+    pool->parallelFor(strips_count, encodeStrip);
+  } else {
+    for (int strip = 0; strip < strips_count; ++strip)
+      encodeStrip(strip);
+  }
+  if (std::find(failed.begin(), failed.end(), 1) != failed.end()) {
+    std::cerr << "Error: deflate failed" << std::endl;
+    return false;
+  }
+
+  uLong checksum = adler32(0L, Z_NULL, 0);
+  for (int strip = 0; strip < strips_count; ++strip) {
+    z_off_t strip_size = static_cast<z_off_t>(
+      std::min(strip_rows, height - strip * strip_rows) * filtered_stride);
+    checksum = adler32_combine(checksum, checksums[strip], strip_size);
+  }
+
+  const unsigned char signature[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+  png.assign(signature, signature + sizeof(signature));
+
+  std::vector<unsigned char> header;
+  png_writer::appendUInt32(header, static_cast<uint32_t>(width));
+  png_writer::appendUInt32(header, static_cast<uint32_t>(height));
+  header.push_back(static_cast<unsigned char>(sample_bytes * 8));
+  header.push_back(format == GL_RGBA ? 6 : 2); // Truecolor with or without alpha
+  header.push_back(0); // Deflate
+  header.push_back(0); // Filter method 0
+  header.push_back(0); // Not interlaced
+  png_writer::appendChunk(png, "IHDR", { { header.data(), header.size() } });
+
+  // zlib header: 32K window, and the level class in FLEVEL
+  unsigned char zlib_header[2] = { 0x78, 0 };
+  const int level = options.compression_level;
+  zlib_header[1] = static_cast<unsigned char>((level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6);
+  zlib_header[1] += 31 - (zlib_header[0] * 256 + zlib_header[1]) % 31;
+  std::vector<unsigned char> zlib_trailer;
+  png_writer::appendUInt32(zlib_trailer, static_cast<uint32_t>(checksum));
+
+  for (int strip = 0; strip < strips_count; ++strip) {
+    bool first = strip == 0, last = strip + 1 == strips_count;
+    png_writer::appendChunk(png, "IDAT", {
+      { zlib_header, first ? sizeof(zlib_header) : 0 },
+      { strips[strip].data(), strips[strip].size() },
+      { zlib_trailer.data(), last ? zlib_trailer.size() : 0 } });
+  }
+  png_writer::appendChunk(png, "IEND", {});
+  return true;
+}
+
+// Same as savePNGToFile with the compression tuned by 'options' and large
+// images encoded on 'pool', see encodePNG. 'png_size' receives the size of the
+// file when not null.
+bool savePNGToFile(const char *file_name, int width, int height, GLint format, GLenum type,
+                   const unsigned char *image_data, const PNGWriteOptions& options,
+                   ThreadPool *pool = nullptr, size_t *png_size = nullptr) {
+  std::vector<unsigned char> png;
+  if (encodePNG(png, width, height, format, type, image_data, options, pool) == false)
+    return false;
+
+  FILE *fp = nullptr;
+  fopen_s(&fp, file_name, "wb");
+  if (fp == 0) {
+    perror(file_name);
+    return false;
+  }
+  bool written = fwrite(png.data(), 1, png.size(), fp) == png.size();
+  written = fclose(fp) == 0 && written;
+  if (written == false) {
+    perror(file_name);
+    return false;
+  }
+  if (png_size)
+    *png_size = png.size();
+  return true;
+}
+
+bool savePNGToFile(const char *file_name, int width, int height, GLint format, GLenum type,
+                   const std::vector<unsigned char>& image_data, const PNGWriteOptions& options,
+                   ThreadPool *pool = nullptr, size_t *png_size = nullptr) {
+  const size_t stride = alignedRowBytes(width * (format == GL_RGBA ? 4 : 3) *
+                                        (type == GL_UNSIGNED_SHORT ? 2 : 1));
+  if (image_data.size() < stride * height) {
+    std::cerr << "Error: image data is smaller than " << width << "x" << height << std::endl;
+    return false;
+  }
+  return savePNGToFile(file_name, width, height, format, type, image_data.data(), options, pool,
+                       png_size);
+}
+
+#endif // HEADER_PNGWRITER_HPP
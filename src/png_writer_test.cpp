@@ -0,0 +1,143 @@
+#include <GLXW/glxw.h>
+#include "image_layout.hpp"
+#include "image_utils.hpp"
+#include "png_writer.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <stdio.h>
+
+// Round trips synthetic images through the strip encoder (encodePNG) and
+// libpng's decoder (loadPNGFromFile), for every row filter, a few
+// compression levels, and RGB/RGBA in 8 and 16 bits. The strips are small so
+// that every image spans several of them. No GL context is needed. The PNGs
+// are written to the file given, png_writer_test.png unless another one is
+// given. Returns 0 if every decoded image is identical.
+
+// An image laid out as loadPNGFromFile returns it: gradients, so that the
+// row filters have something to predict, mixed with noise so that the
+// strips don't compress to nothing
+std::vector<unsigned char> makeTestImage(const ImageLayout& layout) {
+  std::vector<unsigned char> image(layout.size(), 0);
+  const size_t samples = static_cast<size_t>(layout.width) * layout.channels;
+  uint32_t noise = 12345;
+  for (int y = 0; y < layout.height; ++y) {
+    unsigned char *row = image.data() + y * layout.stride;
+    for (size_t i = 0; i < samples; ++i) {
+      noise = noise * 1103515245 + 12345;
+      const uint32_t value = static_cast<uint32_t>(i * 7 + y * 13) + ((noise >> 16) & 0x1f);
+      if (layout.channel_bytes == 2) {
+        const uint16_t sample = static_cast<uint16_t>(value * 263);
+        std::memcpy(row + i * 2, &sample, 2);
+      } else {
+        row[i] = static_cast<unsigned char>(value);
+      }
+    }
+  }
+  return image;
+}
+
+size_t idatChunksCount(const std::vector<unsigned char>& png) {
+  const char idat[] = "IDAT";
+  size_t count = 0;
+  for (auto it = png.begin(); (it = std::search(it, png.end(), idat, idat + 4)) != png.end(); ++it)
+    ++count;
+  return count;
+}
+
+bool writeFile(const char *file_name, const std::vector<unsigned char>& data) {
+  FILE *fp = nullptr;
+  fopen_s(&fp, file_name, "wb");
+  if (fp == 0) {
+    perror(file_name);
+    return false;
+  }
+  bool written = fwrite(data.data(), 1, data.size(), fp) == data.size();
+  return fclose(fp) == 0 && written;
+}
+
+// Encodes the image with 'options', decodes it and compares the pixels, row
+// padding excluded
+bool checkRoundTrip(const char *file_name, const ImageLayout& layout, GLint format, GLenum type,
+                    const std::vector<unsigned char>& image, const PNGWriteOptions& options,
+                    ThreadPool *pool) {
+  std::vector<unsigned char> png;
+  if (encodePNG(png, layout.width, layout.height, format, type, image.data(), options, pool) == false ||
+      writeFile(file_name, png) == false)
+    return false;
+
+  int width = 0, height = 0;
+  GLint decoded_format = 0;
+  GLenum decoded_type = 0;
+  std::vector<unsigned char> decoded;
+  if (loadPNGFromFile(file_name, width, height, decoded_format, decoded_type, decoded) == false)
+    return false;
+  if (width != layout.width || height != layout.height || decoded_format != format ||
+      decoded_type != type || decoded.size() < layout.size())
+    return false;
+
+  const size_t row_bytes = static_cast<size_t>(layout.width) * layout.channels * layout.channel_bytes;
+  for (int y = 0; y < layout.height; ++y) {
+    if (std::memcmp(image.data() + y * layout.stride, decoded.data() + y * layout.stride,
+                    row_bytes) != 0)
+      return false;
+  }
+  // Several strips, several IDAT chunks
+  return idatChunksCount(png) > 1;
+}
+
+int main(int argc, char **argv) {
+  const char *file_name = argc > 1 ? argv[1] : "png_writer_test.png";
+
+  const struct {
+    PNGFilter filter;
+    const char *name;
+  } filters[] = {
+    { PNGFilter::None, "none" }, { PNGFilter::Sub, "sub" }, { PNGFilter::Up, "up" },
+    { PNGFilter::Average, "average" }, { PNGFilter::Paeth, "paeth" },
+    { PNGFilter::Adaptive, "adaptive" }
+  };
+  const struct {
+    GLint format;
+    GLenum type;
+    const char *name;
+  } formats[] = {
+    { GL_RGB, GL_UNSIGNED_BYTE, "RGB8" }, { GL_RGBA, GL_UNSIGNED_BYTE, "RGBA8" },
+    { GL_RGB, GL_UNSIGNED_SHORT, "RGB16" }, { GL_RGBA, GL_UNSIGNED_SHORT, "RGBA16" }
+  };
+
+  ThreadPool pool(4);
+  bool ok = true;
+  for (auto& format : formats) {
+    // An odd width so that the rows are padded
+    auto layout = ImageLayout::fromPNG(37, 29, format.format == GL_RGBA ? 4 : 3,
+                                       format.type == GL_UNSIGNED_SHORT ? 2 : 1);
+    auto image = makeTestImage(layout);
+    for (auto& filter : filters) {
+      for (int level : { 0, 1, 9 }) {
+        PNGWriteOptions options;
+        options.compression_level = level;
+        options.filter = filter.filter;
+        options.strip_bytes = 4 * layout.stride; // About 4 rows per strip
+        // The strips are stitched the same way whether they were deflated
+        // in parallel or not
+        for (ThreadPool *strip_pool : { static_cast<ThreadPool*>(nullptr), &pool }) {
+          bool identical = checkRoundTrip(file_name, layout, format.format, format.type, image,
+                                          options, strip_pool);
+          if (identical == false) {
+            std::cout << format.name << ", " << filter.name << " filter, level " << level
+                      << (strip_pool ? ", on the pool" : "") << ": decoded image differs\n";
+          }
+          ok = ok && identical;
+        }
+      }
+    }
+  }
+  remove(file_name);
+
+  std::cout << (ok ? "All PNG writer tests passed" : "Some PNG writer tests FAILED") << "\n";
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,202 @@
+#ifndef HEADER_RAWIMAGE_HPP
+#define HEADER_RAWIMAGE_HPP
+
+#include <GLXW/glxw.h>
+#include "image_utils.hpp"
+#include "mapped_file.hpp"
+#include "png_writer.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+// Uncompressed image file, for datasets filtered over and over: opening one is
+// a memory mapping instead of a PNG decode, and its pixels go to the GL upload
+// or to the CPU filter straight from the mapping.
+//
+// A 64-byte RawImageHeader is followed by 'height' rows of 'stride' bytes,
+// laid out as loadPNGFromFile returns them: bottom row first, every row
+// padded to 4 bytes, 16-bit samples in the byte order of the machine that
+// wrote the file (files of the other byte order are rejected).
+struct RawImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // raw_image::byte_order_mark as written
+  uint32_t width;
+  uint32_t height;
+  uint32_t format; // GL_RGB or GL_RGBA
+  uint32_t type; // GL_UNSIGNED_BYTE or GL_UNSIGNED_SHORT
+  uint64_t stride; // Bytes per row
+  uint64_t data_offset; // Of the first row, from the start of the file
+  uint8_t reserved[16];
+};
+
+static_assert(sizeof(RawImageHeader) == 64, "RawImageHeader must stay 64 bytes");
+
+namespace raw_image {
+
+  const char magic[8] = { 'F', 'L', 'T', 'R', 'A', 'W', '\r', '\n' };
+  const uint32_t version = 1;
+  const uint32_t byte_order_mark = 0x01020304;
+
+  // loadPNGFromFile's row size: pixels, padded to 4 bytes
+  size_t rowStride(int width, GLint format, GLenum type) {
+    return alignedRowBytes(static_cast<size_t>(width) * (format == GL_RGBA ? 4 : 3) *
+                           (type == GL_UNSIGNED_SHORT ? 2 : 1));
+  }
+
+} // namespace raw_image
+
+// True if 'name' ends with .raw, in any case
+bool isRawImageName(std::string name) {
+  if (name.size() < 4)
+    return false;
+  std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+    return static_cast<char>(std::tolower(c));
+  });
+  return name.compare(name.size() - 4, 4, ".raw") == 0;
+}
+
+// Writes 'image_data', laid out as loadPNGFromFile returns it, as a raw image
+bool saveRawImage(const char *file_name, int width, int height, GLint format, GLenum type,
+                  const unsigned char *image_data) {
+  if ((format != GL_RGB && format != GL_RGBA) ||
+      (type != GL_UNSIGNED_BYTE && type != GL_UNSIGNED_SHORT)) {
+    std::cerr << "Unsupported format " << format << " or type " << type << std::endl;
+    return false;
+  }
+
+  RawImageHeader header = {};
+  std::memcpy(header.magic, raw_image::magic, sizeof(header.magic));
+  header.version = raw_image::version;
+  header.byte_order = raw_image::byte_order_mark;
+  header.width = static_cast<uint32_t>(width);
+  header.height = static_cast<uint32_t>(height);
+  header.format = static_cast<uint32_t>(format);
+  header.type = static_cast<uint32_t>(type);
+  header.stride = raw_image::rowStride(width, format, type);
+  header.data_offset = sizeof(header);
+
+  FILE *fp = nullptr;
+  fopen_s(&fp, file_name, "wb");
+  if (fp == 0) {
+    perror(file_name);
+    return false;
+  }
+  const size_t data_size = header.stride * height;
+  bool written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                 fwrite(image_data, 1, data_size, fp) == data_size;
+  written = fclose(fp) == 0 && written;
+  if (written == false)
+    perror(file_name);
+  return written;
+}
+
+// A raw image mapped in memory. pixels() stays valid until the file is closed
+// or another one opened.
+class RawImageFile {
+public:
+  bool open(const char *file_name) {
+    if (file.open(file_name) == false)
+      return false;
+
+    if (file.size() < sizeof(RawImageHeader)) {
+      std::cerr << "Error: " << file_name << " is not a raw image" << std::endl;
+      file.close();
+      return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    const char *error = nullptr;
+    if (std::memcmp(header.magic, raw_image::magic, sizeof(header.magic)) != 0)
+      error = "is not a raw image";
+    else if (header.version != raw_image::version)
+      error = "has an unknown raw image version";
+    else if (header.byte_order != raw_image::byte_order_mark)
+      error = "was written on a machine of another byte order";
+    else if ((header.format != GL_RGB && header.format != GL_RGBA) ||
+             (header.type != GL_UNSIGNED_BYTE && header.type != GL_UNSIGNED_SHORT))
+      error = "has an unsupported pixel format";
+    else if (header.width == 0 || header.height == 0 || header.width > INT32_MAX ||
+             header.height > INT32_MAX ||
+             header.stride != raw_image::rowStride(width(), format(), type()))
+      error = "has an invalid size";
+    else if (header.data_offset < sizeof(header) || header.data_offset % 4 != 0 ||
+             file.size() < header.data_offset ||
+             (file.size() - header.data_offset) / header.stride < header.height)
+      error = "is truncated";
+    if (error) {
+      std::cerr << "Error: " << file_name << " " << error << std::endl;
+      file.close();
+      return false;
+    }
+    return true;
+  }
+
+  // Hints that the pixels are about to be read once, see MappedFile
+  void adviseSequential() {
+    file.adviseSequential();
+  }
+
+  int width() const {
+    return static_cast<int>(header.width);
+  }
+
+  int height() const {
+    return static_cast<int>(header.height);
+  }
+
+  GLint format() const {
+    return static_cast<GLint>(header.format);
+  }
+
+  GLenum type() const {
+    return static_cast<GLenum>(header.type);
+  }
+
+  size_t stride() const {
+    return static_cast<size_t>(header.stride);
+  }
+
+  const unsigned char *pixels() const {
+    return file.data() + header.data_offset;
+  }
+
+  void close() {
+    file.close();
+  }
+
+private:
+  MappedFile file;
+  RawImageHeader header = {};
+};
+
+// Converts a PNG into a raw image or the other way around, depending on
+// whether 'output_file' ends with .raw. PNGs are written with 'png_options',
+// on 'pool' if not null.
+bool convertImage(const char *input_file, const char *output_file,
+                  const PNGWriteOptions& png_options = PNGWriteOptions(),
+                  ThreadPool *pool = nullptr) {
+  if (isRawImageName(output_file)) {
+    int width, height;
+    GLint format;
+    GLenum type;
+    std::vector<unsigned char> image_data;
+    if (loadPNGFromFile(input_file, width, height, format, type, image_data) == false)
+      return false;
+    return saveRawImage(output_file, width, height, format, type, image_data.data());
+  }
+
+  RawImageFile raw;
+  if (raw.open(input_file) == false)
+    return false;
+  return savePNGToFile(output_file, raw.width(), raw.height(), raw.format(), raw.type(),
+                       raw.pixels(), png_options, pool);
+}
+
+#endif // HEADER_RAWIMAGE_HPP
@@ -0,0 +1,66 @@
+#ifndef HEADER_RENDERSTATE_HPP
+#define HEADER_RENDERSTATE_HPP
+
+#include <GLXW/glxw.h>
+#include "gl_error_check.hpp"
+#include <array>
+
+// Shadows the GL bindings the render loop sets, so that binding what's already
+// bound costs no GL call. Every other piece of GL code is free to change the
+// bindings behind its back (the compute filter, readbacks...): invalidate()
+// must be called after it ran, the next binds are then issued again.
+//
+// Caveat: as for the shader classes, a valid GL context must be current
+class RenderState {
+public:
+  RenderState() {
+    invalidate();
+  }
+
+  void useProgram(GLuint program) {
+    if (current_program != program) {
+      GL_ERROR_CHECK(glUseProgram(program));
+      current_program = program;
+    }
+  }
+
+  void bindVertexArray(GLuint vertex_array) {
+    if (current_vertex_array != vertex_array) {
+      GL_ERROR_CHECK(glBindVertexArray(vertex_array));
+      current_vertex_array = vertex_array;
+    }
+  }
+
+  // Binds a 2D texture to texture unit 'unit'
+  void bindTexture(GLuint unit, GLuint texture) {
+    if (unit < bound_textures.size() && bound_textures[unit] == texture)
+      return;
+    if (current_unit != unit) {
+      GL_ERROR_CHECK(glActiveTexture(GL_TEXTURE0 + unit));
+      current_unit = unit;
+    }
+    GL_ERROR_CHECK(glBindTexture(GL_TEXTURE_2D, texture));
+    if (unit < bound_textures.size())
+      bound_textures[unit] = texture;
+  }
+
+  // Forgets every binding
+  void invalidate() {
+    current_program = unknown;
+    current_vertex_array = unknown;
+    current_unit = unknown;
+    bound_textures.fill(unknown);
+  }
+
+private:
+  // Never a valid name, so the first bind is always issued. An enumerator
+  // rather than a static constexpr member, which fill() would odr-use
+  enum : GLuint { unknown = ~0u };
+
+  GLuint current_program;
+  GLuint current_vertex_array;
+  GLuint current_unit;
+  std::array<GLuint, 8> bound_textures; // Units past these aren't shadowed
+};
+
+#endif // HEADER_RENDERSTATE_HPP
@@ -8,9 +8,42 @@
 #include <fstream>
 #include <sstream>
 #include <memory>
+#include <map>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 // Caveat: make sure to have a valid GL context before invoking these classes
 
+using ShaderDefines = std::vector<std::pair<std::string, std::string>>;
+
+// Returns 'source' with a #define for every (name, value) pair, followed by
+// 'prelude', inserted right after the #version directive
+std::string specializeShaderSource(const std::string& source, const ShaderDefines& defines,
+                                   const std::string& prelude = std::string()) {
+  auto version = source.find("#version");
+  auto line_end = source.find('\n', version);
+  if (version == std::string::npos || line_end == std::string::npos)
+    throw std::runtime_error("Shader source lacks a #version directive");
+
+  std::stringstream ss;
+  for (auto& define : defines)
+    ss << "#define " << define.first << " " << define.second << "\n";
+  ss << prelude;
+  std::string specialized = source;
+  specialized.insert(line_end + 1, ss.str());
+  return specialized;
+}
+
+
 class Shader {
 public:
 
@@ -34,9 +67,13 @@ public:
     glShaderSource(id, 1, &ptr, NULL);
   }
 
-  void loadFromString(const std::string& shader_source) {
+  // Specializes 'shader_source' with 'defines' (see specializeShaderSource)
+  // before loading it. Values known when the program is built, such as a
+  // kernel radius or a border mode, become compile time constants: loops over
+  // them are unrolled and the branches on them are compiled out.
+  void loadFromString(const std::string& shader_source, const ShaderDefines& defines = {}) {
     compiled = false;
-    source = shader_source;
+    source = defines.empty() ? shader_source : specializeShaderSource(shader_source, defines);
     auto ptr = source.c_str();
     glShaderSource(id, 1, &ptr, NULL);
   }
@@ -51,8 +88,8 @@ public:
       GLint log_length;
       glGetShaderiv(id, GL_INFO_LOG_LENGTH, &log_length);
 
-      std::unique_ptr<GLchar> info_log = std::make_unique<GLchar>(log_length + 1);
-      glGetShaderInfoLog(id, log_length, NULL, info_log.get());
+      auto info_log = std::make_unique<GLchar[]>(log_length + 1);
+      glGetShaderInfoLog(id, log_length + 1, NULL, info_log.get());
 
       std::stringstream ss;
       ss << "Shader " << id << " failed compiling: " << info_log.get() << std::endl;
@@ -97,6 +134,9 @@ public:
   }
 
   void addShader(Shader&& shader) {
+    // Errors of earlier calls may still be pending when GL_ERROR_CHECK didn't
+    // query them, don't blame them on the attach
+    while (glGetError() != GL_NO_ERROR) {}
     glAttachShader(id, shader.getId());
     GLenum res = glGetError();
     if (res != GL_NO_ERROR) {
@@ -107,12 +147,16 @@ public:
       vertex_shader_present = true;
     else if (shader.getType() == GL_FRAGMENT_SHADER)
       fragment_shader_present = true;
+    else if (shader.getType() == GL_COMPUTE_SHADER)
+      compute_shader_present = true;
     shaders.emplace_back(std::move(shader));    
   }
 
   void linkProgram() {
-    // Both a vertex and a fragment shader must be present
-    if (vertex_shader_present == true && fragment_shader_present == true) {
+    // Both a vertex and a fragment shader must be present, unless this is a
+    // compute program
+    if ((vertex_shader_present == true && fragment_shader_present == true) ||
+        compute_shader_present == true) {
 
       std::for_each(shaders.begin(), shaders.end(), [](auto shader) {
         if (shader.isCompiled() == false)
@@ -137,12 +181,38 @@ public:
         std::exit(1);
       }
     } else {
-      std::cerr << "At least a vertex and a fragment shaders are needed to " \
-        "perform linking" << std::endl;
+      std::cerr << "At least a vertex and a fragment shaders (or a compute " \
+        "shader) are needed to perform linking" << std::endl;
       std::exit(1);
     }
   }
 
+  // Asks the driver to keep the linked binary so getBinary() can return it,
+  // must be called before linkProgram()
+  void setBinaryRetrievable() {
+    glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  }
+
+  // Linked binary in the driver's 'format', empty if unavailable
+  std::vector<unsigned char> getBinary(GLenum& format) const {
+    GLint length = 0;
+    glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &length);
+    std::vector<unsigned char> binary(length);
+    if (length > 0)
+      glGetProgramBinary(id, length, &length, &format, binary.data());
+    binary.resize(length);
+    return binary;
+  }
+
+  // Loads a binary returned by getBinary() instead of linking shaders.
+  // Returns false if the driver rejects it, e.g. after a driver update.
+  bool loadBinary(GLenum format, const std::vector<unsigned char>& binary) {
+    glProgramBinary(id, format, binary.data(), static_cast<GLsizei>(binary.size()));
+    GLint link_status = GL_FALSE;
+    glGetProgramiv(id, GL_LINK_STATUS, &link_status);
+    return link_status == GL_TRUE;
+  }
+
   void detachAllShaders() {
     for (auto& shader : shaders)
       glDetachShader(id, shader.getId());
@@ -166,7 +236,182 @@ private:
   std::vector<Shader> shaders;
   bool vertex_shader_present = false;
   bool fragment_shader_present = false;
+  bool compute_shader_present = false;
   bool shaders_detached = false;
 };
 
+// Linked programs, keyed by the sources and specialization defines of their
+// shaders and their attribute bindings, so that every variant is compiled once
+// per context.
+//
+// With a directory set, programs are also kept there across runs as driver
+// binaries (glGetProgramBinary), and later runs load them with glProgramBinary
+// instead of compiling. Binaries are tied to the GL vendor, renderer and
+// version; stale or rejected ones are recompiled and replaced.
+class ProgramCache {
+public:
+  struct Stage {
+    GLenum type;
+    std::string source;
+    ShaderDefines defines;
+  };
+  // Attribute index and name pairs, bound before linking
+  using AttributeBindings = std::vector<std::pair<GLuint, std::string>>;
+
+  ProgramCache() = default;
+  ProgramCache(const ProgramCache&) = delete;
+  ProgramCache& operator=(const ProgramCache&) = delete;
+
+  // Empty disables the on-disk cache
+  void setDirectory(const std::string& directory) {
+    this->directory = directory;
+    if (directory.empty() == false) {
+#ifdef _WIN32
+      _mkdir(directory.c_str());
+#else
+      mkdir(directory.c_str(), 0755);
+#endif
+    }
+  }
+
+  // Returns the program linking 'stages', compiling it on first use unless
+  // a binary of it is on disk. The program belongs to the cache.
+  ShaderProgram& get(const std::vector<Stage>& stages, const AttributeBindings& attributes = {}) {
+    std::string key;
+    for (auto& stage : stages) {
+      key += std::to_string(stage.type) + "\n";
+      for (auto& define : stage.defines)
+        key += "#define " + define.first + " " + define.second + "\n";
+      key += stage.source + "\n";
+    }
+    for (auto& attribute : attributes)
+      key += "attribute " + std::to_string(attribute.first) + " " + attribute.second + "\n";
+
+    auto& program = programs[key];
+    if (program)
+      return *program;
+
+    program = std::make_unique<ShaderProgram>();
+    std::string binary_key, file_name;
+    if (directory.empty() == false && binaryFormatsCount() > 0) {
+      // The driver invalidates binaries across versions, and so do we
+      for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+        binary_key += reinterpret_cast<const char*>(glGetString(name)) + std::string("\n");
+      binary_key += key;
+      file_name = directory + "/" + hashName(binary_key) + ".bin";
+      if (loadBinary(*program, file_name, binary_key)) {
+        binary_loads_count++;
+        return *program;
+      }
+      // A failed glProgramBinary leaves the program unusable, start over
+      program = std::make_unique<ShaderProgram>();
+    }
+
+    for (auto& stage : stages) {
+      Shader shader(stage.type);
+      shader.loadFromString(stage.source, stage.defines);
+      shader.compile();
+      program->addShader(std::move(shader));
+    }
+    for (auto& attribute : attributes)
+      glBindAttribLocation(program->getId(), attribute.first, attribute.second.c_str());
+    if (file_name.empty() == false)
+      program->setBinaryRetrievable();
+    program->linkProgram();
+    compiled_count++;
+
+    if (file_name.empty() == false)
+      saveBinary(*program, file_name, binary_key);
+    return *program;
+  }
+
+  // Programs compiled from source, and loaded from binaries on disk
+  size_t compiledCount() const {
+    return compiled_count;
+  }
+
+  size_t binaryLoadsCount() const {
+    return binary_loads_count;
+  }
+
+private:
+  // File layout: magic, binary format, key size, key, binary size, binary
+  static constexpr uint32_t file_magic = 0x42505847; // "GXPB"
+
+  static GLint binaryFormatsCount() {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &count);
+    return count;
+  }
+
+  // 64-bit FNV-1a, stable across runs and standard libraries unlike std::hash
+  static std::string hashName(const std::string& key) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : key) {
+      hash ^= c;
+      hash *= 1099511628211ull;
+    }
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    return name;
+  }
+
+  static bool loadBinary(ShaderProgram& program, const std::string& file_name,
+                         const std::string& key) {
+    std::ifstream file(file_name, std::ios::binary);
+    uint32_t magic = 0, format = 0;
+    uint64_t key_size = 0, binary_size = 0;
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char*>(&format), sizeof(format));
+    file.read(reinterpret_cast<char*>(&key_size), sizeof(key_size));
+    // The whole key is stored, a hash collision must not load the wrong program
+    if (!file || magic != file_magic || key_size != key.size())
+      return false;
+    std::string stored_key(key_size, '\0');
+    file.read(&stored_key[0], key_size);
+    file.read(reinterpret_cast<char*>(&binary_size), sizeof(binary_size));
+    if (!file || stored_key != key || binary_size == 0 || binary_size > (1u << 30))
+      return false;
+    std::vector<unsigned char> binary(binary_size);
+    file.read(reinterpret_cast<char*>(binary.data()), binary_size);
+    return file && program.loadBinary(format, binary);
+  }
+
+  static void saveBinary(const ShaderProgram& program, const std::string& file_name,
+                         const std::string& key) {
+    GLenum format = 0;
+    auto binary = program.getBinary(format);
+    if (binary.empty())
+      return;
+
+    // Written aside and renamed, a concurrent run never reads half a file
+    std::string temporary_name = file_name + ".tmp";
+    bool written;
+    {
+      std::ofstream file(temporary_name, std::ios::binary | std::ios::trunc);
+      uint32_t magic = file_magic, format32 = format;
+      uint64_t key_size = key.size(), binary_size = binary.size();
+      file.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+      file.write(reinterpret_cast<const char*>(&format32), sizeof(format32));
+      file.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+      file.write(key.data(), key.size());
+      file.write(reinterpret_cast<const char*>(&binary_size), sizeof(binary_size));
+      file.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+      written = file.good();
+    }
+    if (written == false) {
+      std::cerr << "Warning: cannot write " << temporary_name << std::endl;
+      std::remove(temporary_name.c_str());
+      return;
+    }
+    std::remove(file_name.c_str()); // rename() doesn't replace files on Windows
+    std::rename(temporary_name.c_str(), file_name.c_str());
+  }
+
+  std::string directory;
+  std::map<std::string, std::unique_ptr<ShaderProgram>> programs;
+  size_t compiled_count = 0;
+  size_t binary_loads_count = 0;
+};
+
 #endif // HEADER_SHADERUTILS_HPP
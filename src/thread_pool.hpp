@@ -0,0 +1,147 @@
+#ifndef HEADER_THREADPOOL_HPP
+#define HEADER_THREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker owns a task queue: it pops its own
+// tasks from the back (most recently pushed, likely still in cache) and when
+// that's empty steals from the front of the other workers' queues.
+class ThreadPool {
+public:
+  explicit ThreadPool(unsigned thread_count = std::thread::hardware_concurrency()) {
+    if (thread_count == 0)
+      thread_count = 1;
+    for (unsigned i = 0; i < thread_count; ++i)
+      queues.emplace_back(std::make_unique<WorkerQueue>());
+    for (unsigned i = 0; i < thread_count; ++i)
+      workers.emplace_back([this, i] { workerLoop(i); });
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers)
+      worker.join();
+  }
+
+  unsigned size() const {
+    return static_cast<unsigned>(workers.size());
+  }
+
+  // Queues a task. Tasks are spread round robin over the workers' queues.
+  void submit(std::function<void()> task) {
+    // Count the task first so that 'queued' never underflows when a worker
+    // pops it right away
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      ++queued;
+    }
+    auto& queue = *queues[next_queue++ % queues.size()];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.emplace_back(std::move(task));
+    }
+    wake.notify_one();
+  }
+
+  // Runs task(i) for every i in [0; count) on the pool and blocks until all of
+  // them completed. The first exception thrown by a task is rethrown here.
+  // Must not be called from a task running on the same pool.
+  void parallelFor(size_t count, const std::function<void(size_t)>& task) {
+    struct Completion {
+      std::mutex mutex;
+      std::condition_variable done;
+      size_t remaining;
+      std::exception_ptr error;
+    };
+    auto completion = std::make_shared<Completion>();
+    completion->remaining = count;
+
+    for (size_t i = 0; i < count; ++i) {
+      submit([completion, &task, i] {
+        std::exception_ptr error;
+        try {
+          task(i);
+        } catch (...) {
+          error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(completion->mutex);
+        if (error && !completion->error)
+          completion->error = error;
+        if (--completion->remaining == 0)
+          completion->done.notify_all();
+      });
+    }
+
+    std::unique_lock<std::mutex> lock(completion->mutex);
+    completion->done.wait(lock, [&] { return completion->remaining == 0; });
+    if (completion->error)
+      std::rethrow_exception(completion->error);
+  }
+
+private:
+
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  // Pops from the back of the worker's own queue or steals from the front of
+  // another one
+  bool popTask(unsigned index, std::function<void()>& task) {
+    for (size_t i = 0; i < queues.size(); ++i) {
+      auto& queue = *queues[(index + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty())
+        continue;
+      if (i == 0) {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+      } else {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      }
+      --queued;
+      return true;
+    }
+    return false;
+  }
+
+  void workerLoop(unsigned index) {
+    while (true) {
+      std::function<void()> task;
+      if (popTask(index, task)) {
+        task();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(wake_mutex);
+      wake.wait(lock, [this] { return queued > 0 || stopping; });
+      if (stopping && queued == 0)
+        return;
+    }
+  }
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> next_queue{ 0 };
+  std::atomic<size_t> queued{ 0 }; // Tasks pushed but not yet popped
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+};
+
+#endif // HEADER_THREADPOOL_HPP